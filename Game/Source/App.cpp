@@ -131,7 +131,8 @@ bool App::Awake()
 		item = modules.start;
 		while(item != NULL && ret == true)
 		{
-			ret = item->data->Awake(config.child(item->data->name.GetString()));
+			// Baking only parses maps, the window, renderer and audio are never created
+			if (IsBaking() == false || item->data == map) ret = item->data->Awake(config.child(item->data->name.GetString()));
 			item = item->next;
 		}
 	}
@@ -331,7 +332,7 @@ bool App::CleanUp()
 
 	while(item != NULL && ret == true)
 	{
-		ret = item->data->CleanUp();
+		if (IsBaking() == false || item->data == map) ret = item->data->CleanUp();
 		item = item->prev;
 	}
 	return ret;
@@ -339,6 +340,21 @@ bool App::CleanUp()
 
 int App::GetArgc() const { return argc; }
 
+bool App::IsBaking() const
+{
+	return (argc > 1 && strcmp(args[1], "-bake") == 0);
+}
+
+bool App::BakeMaps()
+{
+	bool ret = true;
+	for (int i = 2; i < argc; ++i)
+	{
+		if (map->Bake(args[i]) == false) ret = false;
+	}
+	return ret;
+}
+
 const char* App::GetArgv(int index) const
 {
 	if(index < argc)
@@ -62,6 +62,10 @@ public:
 	const char* GetTitle() const;
 	const char* GetOrganization() const;
 
+	// Compiles the maps listed after "-bake" in the command line, headless: only the map module is awake
+	bool IsBaking() const;
+	bool BakeMaps();
+
 	//Checks if there is a save file
 	bool CheckSaveFile();
 
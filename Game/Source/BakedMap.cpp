@@ -0,0 +1,123 @@
+#include "BakedMap.h"
+
+#include "Log.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+uint BakedSection::Write(const void* src, uint count)
+{
+	uint start = size;
+	uint padded = (count + 3) & ~3u;
+	if (padded == 0) return start;
+
+	if (size + padded > capacity)
+	{
+		uint newCapacity = (capacity == 0) ? 1024 : capacity * 2;
+		while (newCapacity < size + padded) newCapacity *= 2;
+
+		uchar* newBytes = new uchar[newCapacity];
+		if (bytes != NULL) memcpy(newBytes, bytes, size);
+		RELEASE_ARRAY(bytes);
+		bytes = newBytes;
+		capacity = newCapacity;
+	}
+
+	memcpy(bytes + size, src, count);
+	memset(bytes + size + count, 0, padded - count);
+	size += padded;
+
+	return start;
+}
+
+uint BakedSection::WriteString(const char* string)
+{
+	return Write(string, strlen(string) + 1);
+}
+
+MappedFile::MappedFile() : data(NULL), size(0), file(NULL), mapping(NULL)
+{}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* path)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+
+	file = handle;
+	size = GetFileSize(handle, NULL);
+	if (size == 0 || size == INVALID_FILE_SIZE)
+	{
+		Close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapping != NULL) data = (uchar*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		size = (uint)info.st_size;
+		void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (view != MAP_FAILED) data = (uchar*)view;
+	}
+	close(fd);
+#endif
+
+	if (data == NULL)
+	{
+		LOG("Could not map file %s", path);
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (data != NULL) UnmapViewOfFile(data);
+	if (mapping != NULL) CloseHandle((HANDLE)mapping);
+	if (file != NULL) CloseHandle((HANDLE)file);
+#else
+	if (data != NULL) munmap(data, size);
+#endif
+
+	data = NULL;
+	size = 0;
+	file = NULL;
+	mapping = NULL;
+}
+
+bool IsBakedMapOutdated(const char* bakedPath, const char* sourcePath)
+{
+	struct stat baked, source;
+
+	// Without the source there is nothing newer to fall back to
+	if (stat(sourcePath, &source) != 0) return false;
+	if (stat(bakedPath, &baked) != 0) return true;
+
+	return source.st_mtime > baked.st_mtime;
+}
@@ -0,0 +1,136 @@
+#ifndef __BAKEDMAP_H__
+#define __BAKEDMAP_H__
+
+#include "Defs.h"
+
+// Binary map produced by "Game -bake level.tmx", stored next to the tmx with this extension.
+// Loaded by mapping the file, the big arrays are used in place without copying them
+#define BAKED_MAP_EXTENSION ".bmap"
+#define BAKED_MAP_MAGIC 0x50414D42 // "BMAP"
+#define BAKED_MAP_VERSION 1
+
+// File layout: header followed by the sections it points to, every section 4 byte aligned.
+// Strings are referenced by byte offset inside the strings section, property and tile
+// records by index, and raw arrays by byte offset inside the blob section
+struct BakedMapHeader
+{
+	uint magic;
+	uint version;
+	uint fileSize;
+
+	int width;
+	int height;
+	int tileWidth;
+	int tileHeight;
+	int type;
+
+	uint tilesetCount;
+	uint layerCount;
+	uint tileDrawCount;
+	int colliderGridWidth;
+	int colliderGridHeight;
+	int navigationGridWidth;
+	int navigationGridHeight;
+
+	// Sections, byte offsets from the start of the file
+	uint strings;
+	uint properties;
+	uint tiles;
+	uint tilesets;
+	uint layers;
+	uint blob;
+
+	// Arrays inside the blob
+	uint tileDrawTable;
+	uint colliderGrid;
+	uint navigationGrid;
+};
+
+struct BakedProperty
+{
+	uint name;
+	int value;
+};
+
+struct BakedPropertyList
+{
+	uint first;
+	uint count;
+};
+
+struct BakedTile
+{
+	int id;
+	BakedPropertyList properties;
+};
+
+struct BakedTileset
+{
+	uint name;
+	uint image;
+	int firstgid;
+	int margin;
+	int spacing;
+	int tileWidth;
+	int tileHeight;
+	int texWidth;
+	int texHeight;
+	int numTilesWidth;
+	int numTilesHeight;
+	int tileCount;
+
+	// Tiles with properties
+	uint firstTile;
+	uint tileRecords;
+};
+
+struct BakedLayer
+{
+	uint name;
+	int width;
+	int height;
+	float parallax;
+	BakedPropertyList properties;
+	uint data;
+};
+
+// Growable byte buffer used to write one section of a baked map
+struct BakedSection
+{
+	BakedSection() : bytes(NULL), size(0), capacity(0) {}
+	~BakedSection() { RELEASE_ARRAY(bytes); }
+
+	// Appends the data padded to 4 bytes and returns where it starts
+	uint Write(const void* src, uint count);
+	uint WriteString(const char* string);
+
+	uchar* bytes;
+	uint size;
+	uint capacity;
+};
+
+// Whole file mapped in memory copy on write: pages are read from the file when first
+// touched and only the ones the game modifies get a private copy
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* path);
+	void Close();
+
+	inline bool IsOpen() const { return data != NULL; }
+
+	uchar* data;
+	uint size;
+
+private:
+	void* file;
+	void* mapping;
+};
+
+// True if the source file was modified after the baked one was written
+bool IsBakedMapOutdated(const char* bakedPath, const char* sourcePath);
+
+#endif // __BAKEDMAP_H__
@@ -11,7 +11,7 @@ Coin::Coin(int x, int y) : Entity(x, y, EntityType::COIN)
 {
 	pendingToDelete = false;
 	entityRect = { x, y, 64, 64 };
-	collider = app->collisions->AddCollider(entityRect, Collider::Type::COIN, (Module*)app->entityManager);
+	collider = app->collisions->AddCollider(entityRect, Collider::Type::COIN, (Module*)app->entityManager, this, true);
 
 	invert = false;
 
@@ -52,5 +52,5 @@ void Coin::OnCollision(Collider* c1, Collider* c2)
 	app->scene->score += 50;
 	app->audio->PlayFx(app->entityManager->coinSFX);
 	this->pendingToDelete = true;
-	this->collider->pendingToDelete = true;
+	app->collisions->RemoveCollider(this->collider);
 }
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "CollisionKernels.h"
+
+#include "Defs.h"
+
+#include "SDL/include/SDL_cpuinfo.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define COLLISION_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// MSVC takes AVX2 intrinsics anywhere, GCC and Clang only in functions built for it
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+void ColliderArrays::Reserve(int count)
+{
+	if (count <= capacity) return;
+
+	Release();
+	capacity = count;
+	cellX = new int[capacity];
+	cellY = new int[capacity];
+	slot = new int[capacity];
+	left = new int[capacity];
+	top = new int[capacity];
+	right = new int[capacity];
+	bottom = new int[capacity];
+	category = new int[capacity];
+	mask = new int[capacity];
+}
+
+void ColliderArrays::Release()
+{
+	RELEASE_ARRAY(cellX);
+	RELEASE_ARRAY(cellY);
+	RELEASE_ARRAY(slot);
+	RELEASE_ARRAY(left);
+	RELEASE_ARRAY(top);
+	RELEASE_ARRAY(right);
+	RELEASE_ARRAY(bottom);
+	RELEASE_ARRAY(category);
+	RELEASE_ARRAY(mask);
+	capacity = 0;
+}
+
+int OverlapScalar(const ColliderArrays& a, int i, int begin, int end, int* hits)
+{
+	int count = 0;
+	for (int j = begin; j < end; ++j)
+	{
+		if (a.cellX[j] != a.cellX[i] || a.cellY[j] != a.cellY[i]) continue;
+		if (a.left[i] >= a.right[j] || a.right[i] <= a.left[j] || a.top[i] >= a.bottom[j] || a.bottom[i] <= a.top[j]) continue;
+
+		bool accepted = (a.slot[i] < a.slot[j]) ? (a.mask[i] & a.category[j]) != 0 : (a.mask[j] & a.category[i]) != 0;
+		if (accepted) hits[count++] = j;
+	}
+	return count;
+}
+
+#ifdef COLLISION_SIMD
+
+int OverlapSSE2(const ColliderArrays& a, int i, int begin, int end, int* hits)
+{
+	const __m128i cellX = _mm_set1_epi32(a.cellX[i]);
+	const __m128i cellY = _mm_set1_epi32(a.cellY[i]);
+	const __m128i slot = _mm_set1_epi32(a.slot[i]);
+	const __m128i left = _mm_set1_epi32(a.left[i]);
+	const __m128i top = _mm_set1_epi32(a.top[i]);
+	const __m128i right = _mm_set1_epi32(a.right[i]);
+	const __m128i bottom = _mm_set1_epi32(a.bottom[i]);
+	const __m128i category = _mm_set1_epi32(a.category[i]);
+	const __m128i mask = _mm_set1_epi32(a.mask[i]);
+	const __m128i zero = _mm_setzero_si128();
+
+	int count = 0;
+	int j = begin;
+	for (; j + 4 <= end; j += 4)
+	{
+		__m128i hit = _mm_and_si128(
+			_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a.cellX + j)), cellX),
+			_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a.cellY + j)), cellY));
+
+		hit = _mm_and_si128(hit, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(a.right + j)), left));
+		hit = _mm_and_si128(hit, _mm_cmpgt_epi32(right, _mm_loadu_si128((const __m128i*)(a.left + j))));
+		hit = _mm_and_si128(hit, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(a.bottom + j)), top));
+		hit = _mm_and_si128(hit, _mm_cmpgt_epi32(bottom, _mm_loadu_si128((const __m128i*)(a.top + j))));
+
+		// The mask of the lower slot decides
+		__m128i lower = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(a.slot + j)), slot);
+		__m128i rejectedByI = _mm_cmpeq_epi32(_mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(a.category + j))), zero);
+		__m128i rejectedByJ = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(a.mask + j)), category), zero);
+		__m128i rejected = _mm_or_si128(_mm_and_si128(lower, rejectedByI), _mm_andnot_si128(lower, rejectedByJ));
+		hit = _mm_andnot_si128(rejected, hit);
+
+		int bits = _mm_movemask_ps(_mm_castsi128_ps(hit));
+		for (; bits != 0; bits &= bits - 1)
+		{
+			int lane = 0;
+			while (((bits >> lane) & 1) == 0) ++lane;
+			hits[count++] = j + lane;
+		}
+	}
+
+	return count + OverlapScalar(a, i, j, end, hits + count);
+}
+
+TARGET_AVX2 int OverlapAVX2(const ColliderArrays& a, int i, int begin, int end, int* hits)
+{
+	const __m256i cellX = _mm256_set1_epi32(a.cellX[i]);
+	const __m256i cellY = _mm256_set1_epi32(a.cellY[i]);
+	const __m256i slot = _mm256_set1_epi32(a.slot[i]);
+	const __m256i left = _mm256_set1_epi32(a.left[i]);
+	const __m256i top = _mm256_set1_epi32(a.top[i]);
+	const __m256i right = _mm256_set1_epi32(a.right[i]);
+	const __m256i bottom = _mm256_set1_epi32(a.bottom[i]);
+	const __m256i category = _mm256_set1_epi32(a.category[i]);
+	const __m256i mask = _mm256_set1_epi32(a.mask[i]);
+	const __m256i zero = _mm256_setzero_si256();
+
+	int count = 0;
+	int j = begin;
+	for (; j + 8 <= end; j += 8)
+	{
+		__m256i hit = _mm256_and_si256(
+			_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a.cellX + j)), cellX),
+			_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a.cellY + j)), cellY));
+
+		hit = _mm256_and_si256(hit, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(a.right + j)), left));
+		hit = _mm256_and_si256(hit, _mm256_cmpgt_epi32(right, _mm256_loadu_si256((const __m256i*)(a.left + j))));
+		hit = _mm256_and_si256(hit, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(a.bottom + j)), top));
+		hit = _mm256_and_si256(hit, _mm256_cmpgt_epi32(bottom, _mm256_loadu_si256((const __m256i*)(a.top + j))));
+
+		__m256i lower = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(a.slot + j)), slot);
+		__m256i rejectedByI = _mm256_cmpeq_epi32(_mm256_and_si256(mask, _mm256_loadu_si256((const __m256i*)(a.category + j))), zero);
+		__m256i rejectedByJ = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a.mask + j)), category), zero);
+		__m256i rejected = _mm256_or_si256(_mm256_and_si256(lower, rejectedByI), _mm256_andnot_si256(lower, rejectedByJ));
+		hit = _mm256_andnot_si256(rejected, hit);
+
+		int bits = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+		for (; bits != 0; bits &= bits - 1)
+		{
+			int lane = 0;
+			while (((bits >> lane) & 1) == 0) ++lane;
+			hits[count++] = j + lane;
+		}
+	}
+
+	return count + OverlapSSE2(a, i, j, end, hits + count);
+}
+
+#else
+
+int OverlapSSE2(const ColliderArrays& a, int i, int begin, int end, int* hits) { return OverlapScalar(a, i, begin, end, hits); }
+int OverlapAVX2(const ColliderArrays& a, int i, int begin, int end, int* hits) { return OverlapScalar(a, i, begin, end, hits); }
+
+#endif
+
+OverlapKernel SelectOverlapKernel(const char** name)
+{
+#ifdef COLLISION_SIMD
+	if (SDL_HasAVX2())
+	{
+		*name = "AVX2";
+		return OverlapAVX2;
+	}
+	if (SDL_HasSSE2())
+	{
+		*name = "SSE2";
+		return OverlapSSE2;
+	}
+#endif
+	*name = "scalar";
+	return OverlapScalar;
+}
@@ -0,0 +1,42 @@
+#ifndef __COLLISIONKERNELS_H__
+#define __COLLISIONKERNELS_H__
+
+// ---------------------------------------------------------------------
+// Narrowphase of the collision grid. Every entry of the grid, a collider
+// in one of the cells it covers, is laid out as structure of arrays so
+// one entry can be tested against 4 (SSE2) or 8 (AVX2) others at once
+// ---------------------------------------------------------------------
+struct ColliderArrays
+{
+	ColliderArrays() : cellX(nullptr), cellY(nullptr), slot(nullptr), left(nullptr), top(nullptr), right(nullptr), bottom(nullptr),
+		category(nullptr), mask(nullptr), capacity(0) {}
+	~ColliderArrays() { Release(); }
+
+	// Grows the arrays to hold count entries, the content is lost
+	void Reserve(int count);
+	void Release();
+
+	int* cellX;
+	int* cellY;
+	int* slot;		// pool slot of the collider
+	int* left;
+	int* top;
+	int* right;		// left + w
+	int* bottom;	// top + h
+	int* category;	// bit of the collider type
+	int* mask;		// types the collider type collides with
+	int capacity;
+};
+
+// Writes to hits the entries j in [begin, end) in the same cell as entry i that overlap it
+// and that the mask of the collider in the lower slot accepts. Returns how many there are
+typedef int (*OverlapKernel)(const ColliderArrays& arrays, int i, int begin, int end, int* hits);
+
+int OverlapScalar(const ColliderArrays& arrays, int i, int begin, int end, int* hits);
+int OverlapSSE2(const ColliderArrays& arrays, int i, int begin, int end, int* hits);
+int OverlapAVX2(const ColliderArrays& arrays, int i, int begin, int end, int* hits);
+
+// Widest kernel the CPU runs, name gets its name for the log
+OverlapKernel SelectOverlapKernel(const char** name);
+
+#endif // __COLLISIONKERNELS_H__
@@ -1,159 +1,772 @@
 #include "Collisions.h"
 
 #include "App.h"
+#include "Map.h"
 
-Collisions::Collisions() {
+#include "Defs.h"
+#include "Log.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+Collisions::Collisions() : firstFree(-1), cellSize(COLLISION_CELL_SIZE), cellEntries(nullptr), hits(nullptr), entryCount(0), entryCapacity(0), overlap(OverlapScalar), staticCategories(0), staticDirty(false) {
 
 	name.Create("collisions");
 
-	for (uint i = 0; i < MAX_COLLIDERS; ++i)
-	{
-		colliders[i] = nullptr;
-	}
-
-	matrix[Collider::Type::SOLID][Collider::Type::AIR] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::PLAYER] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::COIN] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::CHECKPOINT] = false;
-	//matrix[Collider::Type::SOLID][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::ATTACK] = false;
-	matrix[Collider::Type::SOLID][Collider::Type::BOX] = false;
-
-	matrix[Collider::Type::PAIN][Collider::Type::AIR] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::PLAYER] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::COIN] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::CHECKPOINT] = false;
-	//matrix[Collider::Type::PAIN][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::ATTACK] = false;
-	matrix[Collider::Type::PAIN][Collider::Type::BOX] = false;
-
-	matrix[Collider::Type::PLAYER][Collider::Type::AIR] = false;
-	matrix[Collider::Type::PLAYER][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::PLAYER][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::PLAYER][Collider::Type::PLAYER] = false;
-	matrix[Collider::Type::PLAYER][Collider::Type::COIN] = true;
-	matrix[Collider::Type::PLAYER][Collider::Type::CHECKPOINT] = false;
-	//matrix[Collider::Type::PLAYER][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::PLAYER][Collider::Type::ENEMY] = true;
-	matrix[Collider::Type::PLAYER][Collider::Type::ATTACK] = false;
-
-	matrix[Collider::Type::COIN][Collider::Type::AIR] = false;
-	matrix[Collider::Type::COIN][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::COIN][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::COIN][Collider::Type::PLAYER] = false;
-	matrix[Collider::Type::COIN][Collider::Type::COIN] = false;
-	matrix[Collider::Type::COIN][Collider::Type::CHECKPOINT] = false;
-	//matrix[Collider::Type::COIN][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::COIN][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::COIN][Collider::Type::ATTACK] = false;
-
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::AIR] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::PLAYER] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::COIN] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::CHECKPOINT] = false;
-	/*matrix[Collider::Type::CHECKPOINT][Collider::Type::GOAL] = false;*/
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::CHECKPOINT][Collider::Type::ATTACK] = false;
-
-	/*matrix[Collider::Type::GOAL][Collider::Type::AIR] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::PLAYER] = true;
-	matrix[Collider::Type::GOAL][Collider::Type::COIN] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::CHECKPOINT] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::GOAL][Collider::Type::ATTACK] = false;*/
-
-	matrix[Collider::Type::ENEMY][Collider::Type::AIR] = false;
-	matrix[Collider::Type::ENEMY][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::ENEMY][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::ENEMY][Collider::Type::PLAYER] = true;
-	/*matrix[Collider::Type::ENEMY][Collider::Type::FRUIT] = false;*/
-	matrix[Collider::Type::ENEMY][Collider::Type::CHECKPOINT] = false;
-	//matrix[Collider::Type::ENEMY][Collider::Type::GOAL] = false;
-	matrix[Collider::Type::ENEMY][Collider::Type::ENEMY] = false;
-	matrix[Collider::Type::ENEMY][Collider::Type::ATTACK] = true;
-
-	matrix[Collider::Type::ATTACK][Collider::Type::AIR] = false;
-	matrix[Collider::Type::ATTACK][Collider::Type::SOLID] = false;
-	matrix[Collider::Type::ATTACK][Collider::Type::PAIN] = false;
-	matrix[Collider::Type::ATTACK][Collider::Type::PLAYER] = false;
-	/*matrix[Collider::Type::ATTACK][Collider::Type::FRUIT] = false;*/
-	matrix[Collider::Type::ATTACK][Collider::Type::CHECKPOINT] = false;
-	/*matrix[Collider::Type::ATTACK][Collider::Type::GOAL] = false;*/
-	matrix[Collider::Type::ATTACK][Collider::Type::ENEMY] = true;
-	matrix[Collider::Type::ATTACK][Collider::Type::ATTACK] = false;
-
-
-
-}
-
-Collisions::~Collisions() {}
+	// Defaults, <matrix> in config.xml replaces them. Pairs not listed never collide
+	memset(typeMask, 0, sizeof(typeMask));
+	typeMask[Collider::Type::PLAYER] = TypeBit(Collider::Type::COIN) | TypeBit(Collider::Type::ENEMY);
+	typeMask[Collider::Type::ENEMY] = TypeBit(Collider::Type::PLAYER) | TypeBit(Collider::Type::ATTACK);
+	typeMask[Collider::Type::ATTACK] = TypeBit(Collider::Type::ENEMY);
+
+	BuildPairMasks();
+	memset(bucketStart, 0, sizeof(bucketStart));
+}
+
+Collisions::~Collisions()
+{
+	CleanUp();
+	for (uint i = 0; i < slabs.Count(); ++i) RELEASE_ARRAY(slabs[i]);
+	RELEASE_ARRAY(cellEntries);
+	RELEASE_ARRAY(hits);
+}
 
 void Collisions::Init() {}
 
 bool Collisions::Start() { return true; }
 
-bool Collisions::Awake(pugi::xml_node&) { return true; }
+bool Collisions::Awake(pugi::xml_node& config)
+{
+	cellSize = config.child("grid").attribute("cell").as_int(COLLISION_CELL_SIZE);
+	if (cellSize < 1) cellSize = COLLISION_CELL_SIZE;
+
+	pugi::xml_node matrix = config.child("matrix");
+	if (matrix) LoadMatrix(matrix);
+
+	const char* kernel;
+	overlap = SelectOverlapKernel(&kernel);
+	LOG("Collision narrowphase: %s", kernel);
+
+	return true;
+}
 
 bool Collisions::PreUpdate() {
-	// Remove all colliders scheduled for deletion
-	for (uint i = 0; i < MAX_COLLIDERS; ++i)
+	// Remove all colliders scheduled for deletion, backwards since the last live one fills the gap
+	for (int i = (int)active.Count() - 1; i >= 0; --i)
+	{
+		if (Slot(active[i]).pendingToDelete == true) FreeSlot(active[i]);
+	}
+
+	if (staticDirty) BuildStaticTree();
+	BuildGrid();
+
+	// Only colliders sharing a cell are tested against each other
+	contacts.Clear();
+	for (int b = 0; b < COLLISION_BUCKETS; ++b)
+	{
+		if (bucketStart[(b + 1) * Collider::Type::MAX] - bucketStart[b * Collider::Type::MAX] > 1) TestCell(b);
+	}
+
+	// Moving colliders against the static ones, static pairs are never reported
+	if (staticNodes.Count() > 0)
+	{
+		for (uint i = 0; i < active.Count(); ++i)
+		{
+			const Collider& collider = Slot(active[i]);
+			if (collider.isStatic || collider.type <= Collider::Type::NONE || collider.type >= Collider::Type::MAX) continue;
+			if (pairMask[collider.type] & staticCategories) QueryStatic(active[i]);
+		}
+	}
+
+	DispatchContacts();
+
+	return true;
+}
+
+// Floor division, colliders can be left of or above the origin
+int Collisions::CellOf(int coordinate) const
+{
+	return (coordinate >= 0) ? coordinate / cellSize : -((-coordinate + cellSize - 1) / cellSize);
+}
+
+int Collisions::BucketOf(int x, int y) const
+{
+	return (int)(((uint)x * 73856093u) ^ ((uint)y * 19349663u)) & (COLLISION_BUCKETS - 1);
+}
+
+void Collisions::BuildGrid()
+{
+	entryCount = 0;
+	for (uint i = 0; i < active.Count(); ++i)
+	{
+		// Static colliders are in their tree. Types nothing collides with are kept for the queries,
+		// TestCell leaves their groups alone
+		const Collider& collider = Slot(active[i]);
+		if (collider.isStatic || collider.type <= Collider::Type::NONE || collider.type >= Collider::Type::MAX) continue;
+
+		const SDL_Rect& rect = collider.rect;
+		int left = CellOf(rect.x), right = CellOf(rect.x + MAX(rect.w, 1) - 1);
+		int top = CellOf(rect.y), bottom = CellOf(rect.y + MAX(rect.h, 1) - 1);
+
+		int needed = entryCount + (right - left + 1) * (bottom - top + 1);
+		if (needed > entryCapacity)
+		{
+			int capacity = MAX(needed, entryCapacity * 2);
+			CellEntry* grown = new CellEntry[capacity];
+			if (entryCount > 0) memcpy(grown, cellEntries, entryCount * sizeof(CellEntry));
+
+			RELEASE_ARRAY(cellEntries);
+			RELEASE_ARRAY(hits);
+			cellEntries = grown;
+			hits = new int[capacity];
+			sorted.Reserve(capacity);
+			entryCapacity = capacity;
+		}
+
+		for (int y = top; y <= bottom; ++y)
+		{
+			for (int x = left; x <= right; ++x)
+			{
+				CellEntry& entry = cellEntries[entryCount++];
+				entry.x = x;
+				entry.y = y;
+				entry.collider = active[i];
+			}
+		}
+	}
+
+	// Counting sort by bucket and, inside every bucket, by type
+	const int keys = COLLISION_BUCKETS * Collider::Type::MAX;
+	memset(bucketStart, 0, sizeof(bucketStart));
+	for (int i = 0; i < entryCount; ++i) ++bucketStart[EntryKey(cellEntries[i]) + 1];
+	for (int key = 0; key < keys; ++key) bucketStart[key + 1] += bucketStart[key];
+
+	int fill[keys];
+	memcpy(fill, bucketStart, sizeof(fill));
+	for (int i = 0; i < entryCount; ++i)
+	{
+		const CellEntry& entry = cellEntries[i];
+		const Collider& collider = Slot(entry.collider);
+		int k = fill[EntryKey(entry)]++;
+
+		sorted.cellX[k] = entry.x;
+		sorted.cellY[k] = entry.y;
+		sorted.slot[k] = entry.collider;
+		sorted.left[k] = collider.rect.x;
+		sorted.top[k] = collider.rect.y;
+		sorted.right[k] = collider.rect.x + collider.rect.w;
+		sorted.bottom[k] = collider.rect.y + collider.rect.h;
+		sorted.category[k] = collider.category;
+		sorted.mask[k] = collider.mask;
+	}
+}
+
+int Collisions::EntryKey(const CellEntry& entry) const
+{
+	return BucketOf(entry.x, entry.y) * Collider::Type::MAX + Slot(entry.collider).type;
+}
+
+// Two types interact if either mask has the other, the lower slot decides which one applies
+void Collisions::BuildPairMasks()
+{
+	for (int a = 0; a < Collider::Type::MAX; ++a)
+	{
+		pairMask[a] = typeMask[a];
+		for (int b = 0; b < Collider::Type::MAX; ++b) if (typeMask[b] & TypeBit((Collider::Type)a)) pairMask[a] |= TypeBit((Collider::Type)b);
+	}
+}
+
+// <type name="player" collides="coin enemy"/> per type with collisions, the rest collide with nothing
+void Collisions::LoadMatrix(pugi::xml_node& matrix)
+{
+	static const char* names[Collider::Type::MAX] = { "air", "solid", "pain", "coin", "box", "checkpoint", "player", "enemy", "attack" };
+
+	memset(typeMask, 0, sizeof(typeMask));
+	for (pugi::xml_node type = matrix.child("type"); type; type = type.next_sibling("type"))
+	{
+		int row = -1;
+		for (int t = 0; t < Collider::Type::MAX; ++t) if (strcmp(type.attribute("name").as_string(), names[t]) == 0) row = t;
+		if (row == -1)
+		{
+			LOG("Unknown collider type in the collision matrix: %s", type.attribute("name").as_string());
+			continue;
+		}
+
+		const char* list = type.attribute("collides").as_string();
+		while (*list != '\0')
+		{
+			while (*list == ' ') ++list;
+			int length = 0;
+			while (list[length] != ' ' && list[length] != '\0') ++length;
+			if (length == 0) break;
+
+			int column = -1;
+			for (int t = 0; t < Collider::Type::MAX; ++t) if ((int)strlen(names[t]) == length && strncmp(list, names[t], length) == 0) column = t;
+			if (column != -1) typeMask[row] |= TypeBit((Collider::Type)column);
+			else LOG("Unknown collider type in the collision matrix: %.*s", length, list);
+
+			list += length;
+		}
+	}
+
+	BuildPairMasks();
+
+	// Colliders already in the pool take the new masks of their type
+	for (uint i = 0; i < active.Count(); ++i)
+	{
+		Collider& collider = Slot(active[i]);
+		if (collider.category != 0) collider.mask = typeMask[collider.type];
+	}
+}
+
+// Entries of a bucket are grouped by type, only the groups of types that interact are
+// tested. The kernel lets through the pairs the mask of the lower slot accepts, as the
+// matrix row in the old slot by slot loop. Two colliders sharing several cells are only
+// reported from the cell holding the top left corner of their overlap
+void Collisions::TestCell(int bucket)
+{
+	const int* typeStart = bucketStart + bucket * Collider::Type::MAX;
+
+	for (int a = 0; a < Collider::Type::MAX; ++a)
+	{
+		for (int i = typeStart[a]; i < typeStart[a + 1]; ++i)
+		{
+			for (int b = a; b < Collider::Type::MAX; ++b)
+			{
+				if ((pairMask[a] & TypeBit((Collider::Type)b)) == 0) continue;
+
+				int begin = (b == a) ? i + 1 : typeStart[b];
+				int count = overlap(sorted, i, begin, typeStart[b + 1], hits);
+				for (int h = 0; h < count; ++h)
+				{
+					int j = hits[h];
+					if (CellOf(MAX(sorted.left[i], sorted.left[j])) != sorted.cellX[i] || CellOf(MAX(sorted.top[i], sorted.top[j])) != sorted.cellY[i]) continue;
+
+					Contact contact;
+					contact.first = MIN(sorted.slot[i], sorted.slot[j]);
+					contact.second = MAX(sorted.slot[i], sorted.slot[j]);
+					contacts.PushBack(contact);
+				}
+			}
+		}
+	}
+}
+
+int Collisions::CompareContacts(const void* a, const void* b)
+{
+	const Contact* c1 = (const Contact*)a;
+	const Contact* c2 = (const Contact*)b;
+	if (c1->first != c2->first) return c1->first - c2->first;
+	return c1->second - c2->second;
+}
+
+// Listeners are called in slot order, not in the order of the hashed buckets, and each
+// pair only once. Nothing is freed before the next PreUpdate, so the listeners may
+// remove, move or add colliders without invalidating the pairs still to be reported
+void Collisions::DispatchContacts()
+{
+	if (contacts.Count() == 0) return;
+
+	qsort(&contacts[0], contacts.Count(), sizeof(Contact), CompareContacts);
+
+	for (uint i = 0; i < contacts.Count(); ++i)
+	{
+		const Contact& contact = contacts[i];
+		if (i > 0 && contact.first == contacts[i - 1].first && contact.second == contacts[i - 1].second) continue;
+
+		Collider* c1 = &Slot(contact.first);
+		Collider* c2 = &Slot(contact.second);
+
+		if (c1->listener)
+		{
+			c1->listener->OnCollision(c1, c2);
+		}
+		if (c2->listener)
+		{
+			c2->listener->OnCollision(c2, c1);
+		}
+	}
+}
+
+void Collisions::BuildStaticTree()
+{
+	staticNodes.Clear();
+	staticSlots.Clear();
+	staticCategories = 0;
+	staticDirty = false;
+
+	for (uint i = 0; i < active.Count(); ++i)
+	{
+		const Collider& collider = Slot(active[i]);
+		if (collider.isStatic == false || collider.type <= Collider::Type::NONE || collider.type >= Collider::Type::MAX) continue;
+
+		staticSlots.PushBack(active[i]);
+		staticCategories |= collider.category;
+	}
+
+	if (staticSlots.Count() == 0) return;
+
+	StaticNode root;
+	staticNodes.PushBack(root);
+	BuildStaticNode(0, 0, staticSlots.Count());
+}
+
+// Splits at the median centre along the longer side of the node, so the tree stays balanced
+void Collisions::BuildStaticNode(int node, int begin, int end)
+{
+	StaticNode bounds;
+	bounds.left = bounds.top = INT_MAX;
+	bounds.right = bounds.bottom = INT_MIN;
+	for (int i = begin; i < end; ++i)
+	{
+		const SDL_Rect& rect = Slot(staticSlots[i]).rect;
+		bounds.left = MIN(bounds.left, rect.x);
+		bounds.top = MIN(bounds.top, rect.y);
+		bounds.right = MAX(bounds.right, rect.x + rect.w);
+		bounds.bottom = MAX(bounds.bottom, rect.y + rect.h);
+	}
+	bounds.first = begin;
+	bounds.count = end - begin;
+
+	if (end - begin <= STATIC_LEAF_SIZE)
+	{
+		staticNodes[node] = bounds;
+		return;
+	}
+
+	int axis = (bounds.right - bounds.left >= bounds.bottom - bounds.top) ? 0 : 1;
+	int middle = (begin + end) / 2;
+	SelectStatic(begin, end, middle, axis);
+
+	// Pushing may move the array, the node is written by index
+	int child = staticNodes.Count();
+	bounds.first = child;
+	bounds.count = 0;
+	staticNodes[node] = bounds;
+	staticNodes.PushBack(bounds);
+	staticNodes.PushBack(bounds);
+
+	BuildStaticNode(child, begin, middle);
+	BuildStaticNode(child + 1, middle, end);
+}
+
+// Quickselect: leaves in nth the entry that goes there in centre order, smaller ones before it
+void Collisions::SelectStatic(int begin, int end, int nth, int axis)
+{
+	while (end - begin > 1)
+	{
+		int pivot = StaticCentre(staticSlots[(begin + end) / 2], axis);
+		int i = begin, j = end - 1;
+		while (i <= j)
+		{
+			while (StaticCentre(staticSlots[i], axis) < pivot) ++i;
+			while (StaticCentre(staticSlots[j], axis) > pivot) --j;
+			if (i <= j)
+			{
+				SWAP(staticSlots[i], staticSlots[j]);
+				++i;
+				--j;
+			}
+		}
+
+		if (nth <= j) end = j + 1;
+		else if (nth >= i) begin = i;
+		else return;
+	}
+}
+
+// Twice the centre, to stay in integers
+int Collisions::StaticCentre(int slot, int axis) const
+{
+	const SDL_Rect& rect = Slot(slot).rect;
+	return (axis == 0) ? 2 * rect.x + rect.w : 2 * rect.y + rect.h;
+}
+
+// Same overlap and matrix rules as the grid kernels
+void Collisions::QueryStatic(int slot)
+{
+	const Collider& collider = Slot(slot);
+	const SDL_Rect& rect = collider.rect;
+	int left = rect.x, top = rect.y, right = rect.x + rect.w, bottom = rect.y + rect.h;
+
+	int stack[STATIC_TREE_DEPTH];
+	int count = 0;
+	stack[count++] = 0;
+
+	while (count > 0)
 	{
-		if (colliders[i] != nullptr && colliders[i]->pendingToDelete == true)
+		const StaticNode& node = staticNodes[stack[--count]];
+		if (left >= node.right || right <= node.left || top >= node.bottom || bottom <= node.top) continue;
+
+		if (node.count == 0)
 		{
-			delete colliders[i];
-			colliders[i] = nullptr;
+			stack[count++] = node.first;
+			stack[count++] = node.first + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			int other = staticSlots[i];
+			const Collider& target = Slot(other);
+			if (left >= target.rect.x + target.rect.w || right <= target.rect.x || top >= target.rect.y + target.rect.h || bottom <= target.rect.y) continue;
+
+			bool accepted = (slot < other) ? (collider.mask & target.category) != 0 : (target.mask & collider.category) != 0;
+			if (accepted == false) continue;
+
+			Contact contact;
+			contact.first = MIN(slot, other);
+			contact.second = MAX(slot, other);
+			contacts.PushBack(contact);
 		}
 	}
+}
 
-	Collider* c1;
-	Collider* c2;
+static int FloorDiv(int value, int size)
+{
+	return (value >= 0) ? value / size : -((-value + size - 1) / size);
+}
+
+// Fraction of the segment where it enters the box, false if it misses it
+static bool RayBox(float startX, float startY, float deltaX, float deltaY, const SDL_Rect& box, float& fraction)
+{
+	float enter = 0.0f, leave = 1.0f;
+	float start[2] = { startX, startY }, delta[2] = { deltaX, deltaY };
+	float low[2] = { (float)box.x, (float)box.y }, high[2] = { (float)(box.x + box.w), (float)(box.y + box.h) };
 
-	for (uint i = 0; i < MAX_COLLIDERS; ++i)
+	for (int axis = 0; axis < 2; ++axis)
 	{
-		// skip empty colliders
-		if (colliders[i] == nullptr)
+		if (delta[axis] == 0.0f)
 		{
+			if (start[axis] < low[axis] || start[axis] >= high[axis]) return false;
 			continue;
 		}
 
-		c1 = colliders[i];
+		float t1 = (low[axis] - start[axis]) / delta[axis];
+		float t2 = (high[axis] - start[axis]) / delta[axis];
+		enter = MAX(enter, MIN(t1, t2));
+		leave = MIN(leave, MAX(t1, t2));
+		if (enter > leave) return false;
+	}
 
-		// avoid checking collisions already checked
-		for (uint k = i + 1; k < MAX_COLLIDERS; ++k) {
-			// skip empty colliders
-			if (colliders[k] == nullptr)
+	fraction = enter;
+	return true;
+}
+
+static long long DistanceToRect(const iPoint& pos, int left, int top, int right, int bottom)
+{
+	long long dx = MAX(MAX(left - pos.x, pos.x - right), 0);
+	long long dy = MAX(MAX(top - pos.y, pos.y - bottom), 0);
+	return dx * dx + dy * dy;
+}
+
+int Collisions::OverlapBox(const SDL_Rect& rect, int typeMask, Collider** results, int max) const
+{
+	int left = rect.x, top = rect.y, right = rect.x + rect.w, bottom = rect.y + rect.h;
+	int cellLeft = CellOf(left), cellRight = CellOf(left + MAX(rect.w, 1) - 1);
+	int cellTop = CellOf(top), cellBottom = CellOf(top + MAX(rect.h, 1) - 1);
+
+	int count = 0;
+	for (int y = cellTop; y <= cellBottom; ++y)
+	{
+		for (int x = cellLeft; x <= cellRight; ++x)
+		{
+			for (int type = 0; type < Collider::Type::MAX; ++type)
 			{
-				continue;
+				if ((typeMask & TypeBit((Collider::Type)type)) == 0) continue;
+
+				int key = GroupKey(x, y, type);
+				for (int k = bucketStart[key]; k < bucketStart[key + 1]; ++k)
+				{
+					if (sorted.cellX[k] != x || sorted.cellY[k] != y) continue;
+					if (left >= sorted.right[k] || right <= sorted.left[k] || top >= sorted.bottom[k] || bottom <= sorted.top[k]) continue;
+
+					// A collider in several cells of the box is reported from the first of them
+					if (MAX(CellOf(sorted.left[k]), cellLeft) != x || MAX(CellOf(sorted.top[k]), cellTop) != y) continue;
+
+					Collider& collider = Slot(sorted.slot[k]);
+					if (collider.pendingToDelete) continue;
+
+					if (count < max) results[count] = &collider;
+					++count;
+				}
 			}
+		}
+	}
+
+	if (staticNodes.Count() > 0 && (typeMask & staticCategories) != 0) count = OverlapStatic(left, top, right, bottom, typeMask, results, count, max);
+	return count;
+}
+
+int Collisions::OverlapStatic(int left, int top, int right, int bottom, int typeMask, Collider** results, int count, int max) const
+{
+	int stack[STATIC_TREE_DEPTH];
+	int size = 0;
+	stack[size++] = 0;
+
+	while (size > 0)
+	{
+		const StaticNode& node = staticNodes[stack[--size]];
+		if (left >= node.right || right <= node.left || top >= node.bottom || bottom <= node.top) continue;
+
+		if (node.count == 0)
+		{
+			stack[size++] = node.first;
+			stack[size++] = node.first + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			Collider& collider = Slot(staticSlots[i]);
+			const SDL_Rect& rect = collider.rect;
+			if ((typeMask & collider.category) == 0 || collider.pendingToDelete) continue;
+			if (left >= rect.x + rect.w || right <= rect.x || top >= rect.y + rect.h || bottom <= rect.y) continue;
+
+			if (count < max) results[count] = &collider;
+			++count;
+		}
+	}
+	return count;
+}
+
+// Tiles and grid cells are walked in the order the segment crosses them (Amanatides & Woo),
+// each search stops at the first hit closer than what the previous ones found
+bool Collisions::Raycast(const iPoint& start, const iPoint& end, int typeMask, RaycastHit& hit, const Collider* ignore) const
+{
+	float startX = (float)start.x, startY = (float)start.y;
+	float deltaX = (float)(end.x - start.x), deltaY = (float)(end.y - start.y);
+
+	hit = RaycastHit();
+
+	float limit = RaycastTiles(startX, startY, deltaX, deltaY, typeMask, hit);
+	limit = RaycastCells(startX, startY, deltaX, deltaY, typeMask, ignore, limit, hit);
+	if (staticNodes.Count() > 0 && (typeMask & staticCategories) != 0) RaycastStatic(startX, startY, deltaX, deltaY, typeMask, ignore, hit);
+
+	if (hit.type == Collider::Type::NONE) return false;
+
+	hit.point = fPoint(startX + deltaX * hit.fraction, startY + deltaY * hit.fraction);
+	return true;
+}
+
+float Collisions::RaycastTiles(float startX, float startY, float deltaX, float deltaY, int typeMask, RaycastHit& hit) const
+{
+	int tileSize = (app != nullptr && app->map != nullptr) ? app->map->data.tileWidth : 0;
+	if (tileSize <= 0) return FLT_MAX;
+
+	int x = FloorDiv((int)floorf(startX), tileSize), y = FloorDiv((int)floorf(startY), tileSize);
+	int lastX = FloorDiv((int)floorf(startX + deltaX), tileSize), lastY = FloorDiv((int)floorf(startY + deltaY), tileSize);
+	int stepX = (deltaX > 0.0f) ? 1 : -1, stepY = (deltaY > 0.0f) ? 1 : -1;
+
+	// Fraction of the segment at the next tile line on each axis, and between two of them
+	float nextX = (deltaX != 0.0f) ? ((x + (stepX > 0)) * tileSize - startX) / deltaX : FLT_MAX;
+	float nextY = (deltaY != 0.0f) ? ((y + (stepY > 0)) * tileSize - startY) / deltaY : FLT_MAX;
+	float strideX = (deltaX != 0.0f) ? tileSize / fabsf(deltaX) : FLT_MAX;
+	float strideY = (deltaY != 0.0f) ? tileSize / fabsf(deltaY) : FLT_MAX;
+
+	float enter = 0.0f;
+	while (enter <= 1.0f)
+	{
+		Collider::Type type = app->map->GetColliderType(x, y);
+		if (typeMask & TypeBit(type))
+		{
+			hit.type = type;
+			hit.tile = iPoint(x, y);
+			hit.fraction = enter;
+			return enter;
+		}
+
+		if (x == lastX && y == lastY) break;
 
-			c2 = colliders[k];
+		if (nextX < nextY)
+		{
+			enter = nextX;
+			nextX += strideX;
+			x += stepX;
+		}
+		else
+		{
+			enter = nextY;
+			nextY += strideY;
+			y += stepY;
+		}
+	}
+	return FLT_MAX;
+}
+
+float Collisions::RaycastCells(float startX, float startY, float deltaX, float deltaY, int typeMask, const Collider* ignore, float limit, RaycastHit& hit) const
+{
+	int x = FloorDiv((int)floorf(startX), cellSize), y = FloorDiv((int)floorf(startY), cellSize);
+	int lastX = FloorDiv((int)floorf(startX + deltaX), cellSize), lastY = FloorDiv((int)floorf(startY + deltaY), cellSize);
+	int stepX = (deltaX > 0.0f) ? 1 : -1, stepY = (deltaY > 0.0f) ? 1 : -1;
 
-			if (c1->Intersects(c2->rect) && matrix[c1->type][c2->type])
+	float nextX = (deltaX != 0.0f) ? ((x + (stepX > 0)) * cellSize - startX) / deltaX : FLT_MAX;
+	float nextY = (deltaY != 0.0f) ? ((y + (stepY > 0)) * cellSize - startY) / deltaY : FLT_MAX;
+	float strideX = (deltaX != 0.0f) ? cellSize / fabsf(deltaX) : FLT_MAX;
+	float strideY = (deltaY != 0.0f) ? cellSize / fabsf(deltaY) : FLT_MAX;
+
+	float enter = 0.0f;
+	while (enter <= MIN(limit, 1.0f))
+	{
+		for (int type = 0; type < Collider::Type::MAX; ++type)
+		{
+			if ((typeMask & TypeBit((Collider::Type)type)) == 0) continue;
+
+			int key = GroupKey(x, y, type);
+			for (int k = bucketStart[key]; k < bucketStart[key + 1]; ++k)
 			{
-				if (c1->listener)
+				if (sorted.cellX[k] != x || sorted.cellY[k] != y) continue;
+
+				Collider& collider = Slot(sorted.slot[k]);
+				if (&collider == ignore || collider.pendingToDelete) continue;
+
+				float fraction;
+				if (RayBox(startX, startY, deltaX, deltaY, collider.rect, fraction) && fraction < limit)
 				{
-					c1->listener->OnCollision(c1, c2);
+					limit = fraction;
+					hit.collider = &collider;
+					hit.type = collider.type;
+					hit.fraction = fraction;
 				}
-				if (c2->listener)
+			}
+		}
+
+		// Later cells are all further than a hit inside this one
+		float exit = MIN(nextX, nextY);
+		if (limit <= exit || (x == lastX && y == lastY)) break;
+
+		if (nextX < nextY)
+		{
+			enter = nextX;
+			nextX += strideX;
+			x += stepX;
+		}
+		else
+		{
+			enter = nextY;
+			nextY += strideY;
+			y += stepY;
+		}
+	}
+	return limit;
+}
+
+void Collisions::RaycastStatic(float startX, float startY, float deltaX, float deltaY, int typeMask, const Collider* ignore, RaycastHit& hit) const
+{
+	float limit = (hit.type == Collider::Type::NONE) ? FLT_MAX : hit.fraction;
+
+	int stack[STATIC_TREE_DEPTH];
+	int size = 0;
+	stack[size++] = 0;
+
+	while (size > 0)
+	{
+		const StaticNode& node = staticNodes[stack[--size]];
+		SDL_Rect bounds = { node.left, node.top, node.right - node.left, node.bottom - node.top };
+
+		float fraction;
+		if (RayBox(startX, startY, deltaX, deltaY, bounds, fraction) == false || fraction >= limit) continue;
+
+		if (node.count == 0)
+		{
+			stack[size++] = node.first;
+			stack[size++] = node.first + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			Collider& collider = Slot(staticSlots[i]);
+			if ((typeMask & collider.category) == 0 || &collider == ignore || collider.pendingToDelete) continue;
+
+			if (RayBox(startX, startY, deltaX, deltaY, collider.rect, fraction) && fraction < limit)
+			{
+				limit = fraction;
+				hit.collider = &collider;
+				hit.type = collider.type;
+				hit.fraction = fraction;
+			}
+		}
+	}
+}
+
+// Rings of cells around the one of pos, until the next ring can only hold colliders further than the best
+Collider* Collisions::QueryNearest(Collider::Type type, const iPoint& pos, int radius) const
+{
+	if (type <= Collider::Type::NONE || type >= Collider::Type::MAX || radius < 0) return nullptr;
+
+	Collider* best = nullptr;
+	long long bestDistance = (long long)radius * radius + 1;
+	int centreX = CellOf(pos.x), centreY = CellOf(pos.y);
+
+	for (int ring = 0; ; ++ring)
+	{
+		long long gap = (long long)MAX(ring - 1, 0) * cellSize;
+		if (gap * gap >= bestDistance) break;
+
+		for (int y = centreY - ring; y <= centreY + ring; ++y)
+		{
+			int step = (ring == 0 || y == centreY - ring || y == centreY + ring) ? 1 : 2 * ring;
+			for (int x = centreX - ring; x <= centreX + ring; x += step)
+			{
+				int key = GroupKey(x, y, type);
+				for (int k = bucketStart[key]; k < bucketStart[key + 1]; ++k)
 				{
-					c2->listener->OnCollision(c2, c1);
+					if (sorted.cellX[k] != x || sorted.cellY[k] != y) continue;
+
+					Collider& collider = Slot(sorted.slot[k]);
+					if (collider.pendingToDelete) continue;
+
+					long long distance = DistanceToRect(pos, sorted.left[k], sorted.top[k], sorted.right[k], sorted.bottom[k]);
+					if (distance < bestDistance)
+					{
+						bestDistance = distance;
+						best = &collider;
+					}
 				}
 			}
 		}
 	}
 
-	return true;
+	if (staticNodes.Count() > 0 && (staticCategories & TypeBit(type)) != 0) NearestStatic(type, pos, bestDistance, best);
+	return best;
+}
+
+void Collisions::NearestStatic(Collider::Type type, const iPoint& pos, long long& bestDistance, Collider*& best) const
+{
+	int stack[STATIC_TREE_DEPTH];
+	int size = 0;
+	stack[size++] = 0;
+
+	while (size > 0)
+	{
+		const StaticNode& node = staticNodes[stack[--size]];
+		if (DistanceToRect(pos, node.left, node.top, node.right, node.bottom) >= bestDistance) continue;
+
+		if (node.count == 0)
+		{
+			stack[size++] = node.first;
+			stack[size++] = node.first + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			Collider& collider = Slot(staticSlots[i]);
+			if (collider.type != type || collider.pendingToDelete) continue;
+
+			const SDL_Rect& rect = collider.rect;
+			long long distance = DistanceToRect(pos, rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+			if (distance < bestDistance)
+			{
+				bestDistance = distance;
+				best = &collider;
+			}
+		}
+	}
 }
 
 bool Collisions::Update(float dt) { return true; }
@@ -162,14 +775,8 @@ bool Collisions::PostUpdate() { return true; }
 
 bool Collisions::CleanUp()
 { 
-	for (uint i = 0; i < MAX_COLLIDERS; ++i)
-	{
-		if (colliders[i] != nullptr)
-		{
-			delete colliders[i];
-			colliders[i] = nullptr;
-		}
-	}
+	while (active.Count() > 0) FreeSlot(active[active.Count() - 1]);
+
 	return true;
 }
 
@@ -177,19 +784,76 @@ bool Collisions::Load(pugi::xml_node&) { return true; }
 
 bool Collisions::Save(pugi::xml_node&) { return true; }
 
-Collider* Collisions::AddCollider(SDL_Rect rect, Collider::Type type, Module* listener)
+ColliderHandle Collisions::AddCollider(SDL_Rect rect, Collider::Type type, Module* listener, Entity* owner, bool isStatic)
 {
-	Collider* ret = nullptr;
+	if (firstFree == -1)
+	{
+		// New slab, its slots chained in order so they are handed out lowest first
+		int first = slabs.Count() * COLLIDER_SLAB_SIZE;
+		Collider* slab = new Collider[COLLIDER_SLAB_SIZE];
+		for (int i = 0; i < COLLIDER_SLAB_SIZE; ++i) slab[i].nextFree = (i + 1 < COLLIDER_SLAB_SIZE) ? first + i + 1 : -1;
+
+		slabs.PushBack(slab);
+		firstFree = first;
+	}
+
+	int index = firstFree;
+	Collider& collider = Slot(index);
+	firstFree = collider.nextFree;
+
+	uint generation = collider.generation + 1;
+	if (generation == 0) generation = 1;
 
-	for (uint i = 0; i < MAX_COLLIDERS; ++i)
+	collider = Collider(rect, type, listener);
+	collider.generation = generation;
+	collider.owner = owner;
+	collider.isStatic = isStatic;
+	if (isStatic) staticDirty = true;
+	if (type > Collider::Type::NONE && type < Collider::Type::MAX)
 	{
-		if (colliders[i] == nullptr)
-		{
-			ret = colliders[i] = new Collider(rect, type, listener);
-			break;
-		}
+		collider.category = TypeBit(type);
+		collider.mask = typeMask[type];
 	}
-	return ret;
+	collider.dense = active.Count();
+	active.PushBack(index);
+
+	ColliderHandle handle;
+	handle.index = index;
+	handle.generation = generation;
+	return handle;
+}
+
+Collider* Collisions::GetCollider(const ColliderHandle& handle) const
+{
+	if (handle.generation == 0 || handle.index >= slabs.Count() * COLLIDER_SLAB_SIZE) return nullptr;
+
+	Collider& collider = Slot(handle.index);
+	return (collider.generation == handle.generation && collider.dense != -1) ? &collider : nullptr;
+}
+
+void Collisions::RemoveCollider(const ColliderHandle& handle)
+{
+	Collider* collider = GetCollider(handle);
+	if (collider != nullptr) collider->pendingToDelete = true;
+}
+
+void Collisions::FreeSlot(int index)
+{
+	Collider& collider = Slot(index);
+
+	// The last live collider takes its place in the dense list
+	int last = active[active.Count() - 1];
+	active[collider.dense] = last;
+	Slot(last).dense = collider.dense;
+	active.Pop(last);
+
+	if (collider.isStatic) staticDirty = true;
+
+	collider.dense = -1;
+	collider.listener = nullptr;
+	collider.owner = nullptr;
+	collider.nextFree = firstFree;
+	firstFree = index;
 }
 
 void Collider::SetPos(int _x, int _y, int _w, int _h)
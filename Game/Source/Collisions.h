@@ -1,12 +1,32 @@
 #ifndef __COLLISIONS_H__
 #define __COLLISIONS_H__
 
-#define MAX_COLLIDERS 75
+#define COLLIDER_SLAB_SIZE 64
+#define COLLISION_CELL_SIZE 128
+#define COLLISION_BUCKETS 256
+#define STATIC_LEAF_SIZE 4
+#define STATIC_TREE_DEPTH 64
 
 #include "Module.h"
+#include "Point.h"
+#include "DynArray.h"
+#include "CollisionKernels.h"
 
 #include "SDL/include/SDL.h"
 
+class Entity;
+
+// Reference to a pooled collider. It goes stale when the collider is removed,
+// even if its slot is reused, instead of dangling
+struct ColliderHandle
+{
+	uint index = 0;
+	uint generation = 0;	// 0 is never given to a live collider
+
+	bool operator ==(const ColliderHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator !=(const ColliderHandle& other) const { return !(*this == other); }
+};
+
 class Collider
 {
 public:
@@ -35,6 +55,7 @@ public:
 		MAX
 	};
 
+	Collider() : rect({ 0, 0, 0, 0 }), type(NONE) {}
 	Collider(SDL_Rect _rect, Type _type, Module* _listener = nullptr) : rect(_rect), type(_type), listener(_listener) {}
 
 	void SetPos(int _x, int _y, int _w, int _h);
@@ -45,6 +66,34 @@ public:
 	bool pendingToDelete = false;
 	Type type;
 	Module* listener = nullptr;
+	Entity* owner = nullptr;	// entity the collisions are forwarded to, if any
+
+	// Bit of its type and the types it collides with, from the collision matrix
+	int category = 0;
+	int mask = 0;
+
+private:
+	friend class Collisions;
+
+	// Static colliders are kept in a tree instead of the grid, they must not move
+	bool isStatic = false;
+
+	// Pool bookkeeping: position in the dense list while alive, next free slot while not
+	uint generation = 0;
+	int dense = -1;
+	int nextFree = -1;
+};
+
+inline int TypeBit(Collider::Type type) { return 1 << type; }
+
+// Where a raycast stopped
+struct RaycastHit
+{
+	Collider* collider = nullptr;	// nullptr when it was a tile
+	Collider::Type type = Collider::Type::NONE;
+	iPoint tile;					// tile that stopped the ray, when it was a tile
+	fPoint point;
+	float fraction = 1.0f;			// of the way from start to end
 };
 
 class Collisions : public Module
@@ -74,17 +123,117 @@ public:
 	bool Load(pugi::xml_node&);
 	bool Save(pugi::xml_node&);
 
-	// Adds a new collider to the list
-	Collider* AddCollider(SDL_Rect rect, Collider::Type type, Module* listener = nullptr);
+	// Adds a new collider to the pool. Static ones never move and are only tested against the rest
+	ColliderHandle AddCollider(SDL_Rect rect, Collider::Type type, Module* listener = nullptr, Entity* owner = nullptr, bool isStatic = false);
+
+	// Collider of a handle, nullptr once it has been removed
+	Collider* GetCollider(const ColliderHandle& handle) const;
+
+	// Removes the collider on the next PreUpdate, its handle goes stale then
+	void RemoveCollider(const ColliderHandle& handle);
+
+	inline int GetColliderCount() const { return active.Count(); }
+
+	// Spatial queries, over the colliders as they were on the last PreUpdate. typeMask is made of TypeBit
+
+	// Colliders of the types in typeMask overlapping rect, the first max of them written to results.
+	// Returns how many there are
+	int OverlapBox(const SDL_Rect& rect, int typeMask, Collider** results, int max) const;
+
+	// First collider, or tile of the map's collision grid, of the types in typeMask
+	// on the segment from start to end. ignore is left out, usually the caster
+	bool Raycast(const iPoint& start, const iPoint& end, int typeMask, RaycastHit& hit, const Collider* ignore = nullptr) const;
+
+	// Collider of type closest to pos, measured to its nearest edge, no further than radius
+	Collider* QueryNearest(Collider::Type type, const iPoint& pos, int radius) const;
 
 private:
-	// All existing colliders in the scene
-	Collider* colliders[MAX_COLLIDERS] = { nullptr };
+	// Broadphase: every collider goes to the grid cells it covers, hashed into buckets
+	struct CellEntry
+	{
+		int x;
+		int y;
+		int collider;	// pool slot
+	};
 
+	// Node of the static tree. Children are stored next to each other, leaves hold a run of staticSlots
+	struct StaticNode
+	{
+		int left;
+		int top;
+		int right;
+		int bottom;
+		int first;	// first child or, in a leaf, first entry of staticSlots
+		int count;	// 0 for inner nodes
+	};
 
-	// The collision matrix. Defines the interaction for two collider types
-	// If set two false, collider 1 will ignore collider 2
-	bool matrix[Collider::Type::MAX][Collider::Type::MAX];
+	// Pair found this frame, by pool slot, first is the lower one
+	struct Contact
+	{
+		int first;
+		int second;
+	};
+
+	void LoadMatrix(pugi::xml_node& matrix);
+	void BuildPairMasks();
+	void BuildGrid();
+	void TestCell(int bucket);
+	void DispatchContacts();
+	static int CompareContacts(const void* a, const void* b);
+
+	void BuildStaticTree();
+	void BuildStaticNode(int node, int begin, int end);
+	void SelectStatic(int begin, int end, int nth, int axis);
+	int StaticCentre(int slot, int axis) const;
+	void QueryStatic(int slot);
+	int OverlapStatic(int left, int top, int right, int bottom, int typeMask, Collider** results, int count, int max) const;
+	void RaycastStatic(float startX, float startY, float deltaX, float deltaY, int typeMask, const Collider* ignore, RaycastHit& hit) const;
+	void NearestStatic(Collider::Type type, const iPoint& pos, long long& bestDistance, Collider*& best) const;
+	float RaycastTiles(float startX, float startY, float deltaX, float deltaY, int typeMask, RaycastHit& hit) const;
+	float RaycastCells(float startX, float startY, float deltaX, float deltaY, int typeMask, const Collider* ignore, float limit, RaycastHit& hit) const;
+
+	// Key in bucketStart of the entries of a type in a cell, shared with the cells hashed to the same bucket
+	inline int GroupKey(int x, int y, int type) const { return BucketOf(x, y) * Collider::Type::MAX + type; }
+	int EntryKey(const CellEntry& entry) const;
+	int CellOf(int coordinate) const;
+	int BucketOf(int x, int y) const;
+
+	inline Collider& Slot(int index) const { return slabs[index / COLLIDER_SLAB_SIZE][index % COLLIDER_SLAB_SIZE]; }
+	void FreeSlot(int index);
+
+private:
+	// Pool of colliders: slabs that never move once allocated, the live slots
+	// packed in active for iteration and the rest chained from firstFree
+	DynArray<Collider*> slabs;
+	DynArray<int> active;
+	int firstFree;
+
+
+	// The collision matrix, compiled to one bit per type. A collider reports the types in
+	// the mask of its type, pairMask has the types that interact with it either way
+	int typeMask[Collider::Type::MAX];
+	int pairMask[Collider::Type::MAX];
+
+	// Uniform grid rebuilt every frame. Entries are gathered in cellEntries and
+	// then laid out by bucket in sorted for the narrowphase kernel
+	int cellSize;
+	int bucketStart[COLLISION_BUCKETS * Collider::Type::MAX + 1];
+	CellEntry* cellEntries;
+	ColliderArrays sorted;
+	int* hits;
+	int entryCount;
+	int entryCapacity;
+	OverlapKernel overlap;
+
+	// Bounding volume tree over the static colliders, built again only when they change.
+	// Every other collider is looked up in it once per frame
+	DynArray<StaticNode> staticNodes;
+	DynArray<int> staticSlots;
+	int staticCategories;	// types present in the tree
+	bool staticDirty;
+
+	// Pairs are gathered while testing and reported once the whole grid is done
+	DynArray<Contact> contacts;
 };
 
 #endif // !__COLLISIONS_H__
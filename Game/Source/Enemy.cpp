@@ -22,35 +22,44 @@ Enemy::Enemy(int x, int y, EnemyType eType, Entity* playerPointer) : Entity(x, y
 	physics.axisX = true;
 	physics.axisY = true;
 	path.Create(DEFAULT_PATH_LENGTH);
+	flowPath.Create(DEFAULT_PATH_LENGTH);
+	pathTicket = 0;
+	pathTarget = { -1,-1 };
+	sightClear = false;
+	sightVersion = 0;
+	flowType = (eType == FLYING) ? FLOW_FLYING : FLOW_GROUND;
 }
 
 Enemy::~Enemy()
 {
-	if (collider != nullptr)
-		collider->pendingToDelete = true;
+	app->collisions->RemoveCollider(collider);
+	app->pathfinding->CancelPath(pathTicket);
 	path.Clear();
 }
 
 bool Enemy::Update(float dt)
 {
-	ListItem<Entity*>* e = app->entityManager->entities.start;
-	while (e != nullptr)
+	// Only a player in chasing range is of interest, nobody is chased otherwise
+	iPoint centre(entityRect.x + enemySize / 2, entityRect.y + enemySize / 2);
+	Collider* nearest = app->collisions->QueryNearest(Collider::Type::PLAYER, centre, ENEMY_CHASE_RANGE * enemySize);
+	player = (nearest != nullptr) ? nearest->owner : nullptr;
+
+	// Dead enemies do not wait for their path
+	if (hurtChange && pathTicket != 0)
 	{
-		if (e->data->type == EntityType::PLAYER)
-		{
-			player = e->data;
-		}
-		e = e->next;
+		app->pathfinding->CancelPath(pathTicket);
+		pathTicket = 0;
 	}
 
 	if (currentAnim != nullptr)
 		currentAnim->Update();
 
 	physics.UpdatePhysics(nextPos, dt);
-	physics.ResolveCollisions(entityRect, nextPos, invert);
+	physics.ResolveCollisions(entityRect, nextPos);
 
-	if (collider != nullptr)
-		collider->SetPos(entityRect.x, entityRect.y, currentAnim->GetCurrentFrame().w, currentAnim->GetCurrentFrame().h);
+	Collider* c = app->collisions->GetCollider(collider);
+	if (c != nullptr)
+		c->SetPos(entityRect.x, entityRect.y, currentAnim->GetCurrentFrame().w, currentAnim->GetCurrentFrame().h);
 
 	return true;
 }
@@ -70,11 +79,98 @@ bool Enemy::Draw()
 	{
 		app->render->DrawRectangle({ entityRect.x, entityRect.y, 64,64 }, 255, 255, 0, 100);
 
-		app->pathfinding->DrawPath(&path);
+		if (app->pathfinding->GetFlowPath(flowType, iPoint(entityRect.x / 64, entityRect.y / 64), GetChaseTarget(), flowPath) != -1)
+			app->pathfinding->DrawPath(&flowPath);
+		else
+			app->pathfinding->DrawPath(&path);
 	}
 	return true;
 }
 
+iPoint Enemy::GetChaseTarget() const
+{
+	if (player == nullptr) return iPoint(entityRect.x / 64, entityRect.y / 64);
+
+	iPoint target(player->entityRect.x / 64, player->entityRect.y / 64);
+	if (target.y < 0)
+	{
+		target.y = 0;
+	}
+	return target;
+}
+
+bool Enemy::GetChaseStep(const iPoint& origin, iPoint& next, bool* jump)
+{
+	iPoint target = GetChaseTarget();
+
+	// Out of range nobody chases, whatever the field reaches
+	if (player == nullptr || abs(target.x - origin.x) >= ENEMY_CHASE_RANGE || abs(target.y - origin.y) >= ENEMY_CHASE_RANGE)
+	{
+		app->pathfinding->CancelPath(pathTicket);
+		pathTicket = 0;
+		pathTarget = { -1,-1 };
+		path.Clear();
+		return false;
+	}
+
+	// Flying enemies head straight for a player in sight, without a field or a path
+	if (flowType == FLOW_FLYING && GetSightStep(origin, target, next))
+	{
+		app->pathfinding->CancelPath(pathTicket);
+		pathTicket = 0;
+		pathTarget = { -1,-1 };
+		return true;
+	}
+
+	if (app->pathfinding->GetFlowStep(flowType, origin, target, next, jump)) return true;
+
+	// The surface graph covers every route a ground enemy can follow, a tile path would only
+	// send it where it can not go. Flying ones chase with a path from the workers instead
+	if (flowType == FLOW_GROUND && app->pathfinding->HasSurfaces()) return false;
+
+	// Ask again only when the player changes tile, the old path is followed meanwhile
+	if (target != pathTarget)
+	{
+		app->pathfinding->CancelPath(pathTicket);
+		pathTicket = app->pathfinding->RequestPath(origin, target);
+		pathTarget = target;
+	}
+
+	if (pathTicket != 0)
+	{
+		PathStatus status = app->pathfinding->PollPath(pathTicket, path);
+		if (status != PATH_PENDING) pathTicket = 0;
+		if (status == PATH_FAILED) path.Clear();
+	}
+
+	for (uint i = 0; i + 1 < path.Count(); ++i)
+	{
+		if (path[i] == origin)
+		{
+			next = path[i + 1];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Enemy::GetSightStep(const iPoint& origin, const iPoint& target, iPoint& next)
+{
+	if (origin == target) return false;
+
+	uint version = app->pathfinding->GetMapVersion();
+	if (sightVersion != version || sightFrom != origin || sightTo != target)
+	{
+		sightClear = app->pathfinding->HasLineOfSight(origin, target, &sightNext);
+		sightFrom = origin;
+		sightTo = target;
+		sightVersion = version;
+	}
+
+	if (sightClear) next = sightNext;
+	return sightClear;
+}
+
 void Enemy::OnCollision(Collider* c1, Collider* c2)
 {
 
@@ -82,7 +178,7 @@ void Enemy::OnCollision(Collider* c1, Collider* c2)
 	{
 
 		hurtChange = true;
-		collider->pendingToDelete = true;
+		app->collisions->RemoveCollider(collider);
 		app->audio->PlayFx(app->entityManager->deathSFX, 0);
 	}
 
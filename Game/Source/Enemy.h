@@ -5,6 +5,10 @@
 #include "Animation.h"
 #include "Physics.h"
 #include "DynArray.h"
+#include "PathFinding.h"
+
+// Tiles away the player can be for enemies to chase it, about a screen and a half
+#define ENEMY_CHASE_RANGE 24
 
 #include "Entity.h"
 
@@ -41,9 +45,10 @@ public:
 
 
 
-	int pathCount = 0;
-	// The enemy's path
+	// Path from the pathfinding workers, followed where the flow field does not reach
 	DynArray<iPoint> path;
+	// Path along the flow field, only traced to draw it for debug
+	DynArray<iPoint> flowPath;
 
 
 	// Sound fx when destroyed
@@ -62,6 +67,19 @@ protected:
 	/*Animation* currentAnim = nullptr;
 	bool invert = false;*/
 	Entity* player;
+	// Flow field of the pathfinding module that fits how the enemy moves
+	FlowFieldType flowType;
+
+	// Pending path request and the player tile it was made for
+	uint pathTicket;
+	iPoint pathTarget;
+
+	// Last line of sight worked out, valid for those two tiles until the walkability changes
+	iPoint sightFrom;
+	iPoint sightTo;
+	iPoint sightNext;
+	bool sightClear;
+	uint sightVersion;
 
 	int enemySize = 64;
 
@@ -69,10 +87,15 @@ protected:
 	// Original spawn position. Stored for movement calculations
 	iPoint spawnPos;
 
-	iPoint pastDest;
-	int i;
-	int counterTile;
-	DynArray<iPoint> currentPath;
+	// Tile the enemy chases, its own tile when there is no player
+	iPoint GetChaseTarget() const;
+
+	// Next tile towards the player, false if the enemy should not move.
+	// jump is set when the ground route needs a jump to reach next
+	bool GetChaseStep(const iPoint& origin, iPoint& next, bool* jump = NULL);
+
+	// Next tile straight towards target, false if something is in between
+	bool GetSightStep(const iPoint& origin, const iPoint& target, iPoint& next);
 
 	// State changes
 
@@ -17,7 +17,7 @@ EnemyFly::EnemyFly(int x, int y, EnemyType typeOfEnemy, Entity* playerPointer) :
 
 	entityRect = { x, y, 64, 64 };
 
-	collider = app->collisions->AddCollider(entityRect, Collider::Type::ENEMY, (Module*)app->entityManager);
+	collider = app->collisions->AddCollider(entityRect, Collider::Type::ENEMY, (Module*)app->entityManager, this);
 
 
 	//Fly animations
@@ -65,60 +65,20 @@ bool EnemyFly::Update(float dt)
 
 
 
-	if (app->map->GetTileProperty(nextPos.x / 64, nextPos.y / 64 + 1, "Collider") == Collider::Type::PAIN)
+	if (app->map->GetColliderType(nextPos.x / 64, nextPos.y / 64 + 1) == Collider::Type::PAIN)
 	{
 		hurtChange = true;
-		collider->pendingToDelete = true;
+		app->collisions->RemoveCollider(collider);
 		app->audio->PlayFx(app->entityManager->deathSFX, 0);
 	}
 
+	// One step towards the player
 	iPoint origin = { nextPos.x / 64,nextPos.y / 64 };
+	iPoint next;
 
-	iPoint destination;
-	if (player != nullptr) {
-		destination = { player->entityRect.x / 64,player->entityRect.y / 64 };
-	}
-	else
-	{
-		destination = origin;
-	}
-	iPoint diffTiles = { abs(destination.x - origin.x), abs(destination.y - origin.y) };
-	if (destination.y < 0)
-	{
-		destination.y = 0;
-	}
-	if (pastDest != destination)
-	{
-		pastDest = destination;
-		if (diffTiles.x < 10 && diffTiles.y < 10)
-		{
-			if (origin.x != destination.x || origin.y != destination.y)
-			{
-				path.Clear();
-				pathCount = app->pathfinding->CreatePath(path, origin, destination);
-				if (pathCount != -1)
-				{
-					i = 0;
-				}
-			}
-		}
-		else if (path.Count() != 0)
-		{
-			path.Clear();
-		}
-	}
-
-	if (path.Count() != 0 && pathCount < 12 && pathCount > 1 && !hurtChange)
+	if (!hurtChange && GetChaseStep(origin, next))
 	{
-		if (i >= (pathCount - 2))
-		{
-			i = pathCount - 2;
-		}
-
-		iPoint pos = app->map->MapToWorld(path.At(i)->x, path.At(i)->y);
-		iPoint dest = app->map->MapToWorld(path.At(i + 1)->x, path.At(i + 1)->y);
-		iPoint dif = { dest.x - pos.x,dest.y - pos.y };
-		//LOG("dif: %d, %d\n", dif.x, dif.y);
+		iPoint dif = { next.x - origin.x,next.y - origin.y };
 		if (dif.x > 0)
 		{
 			physics.speed.x = 180.0f;
@@ -126,13 +86,11 @@ bool EnemyFly::Update(float dt)
 		}
 		else if (dif.x < 0)
 		{
-			origin.x = (nextPos.x + entityRect.w) / 64;
 			physics.speed.x = -65.0f;
 			invert = true;
 		}
 		else if (dif.y < 0)
 		{
-			origin.y = (nextPos.y + entityRect.h) / 64;
 			physics.speed.y = -65.0f;
 		}
 		else if (dif.y > 0)
@@ -141,13 +99,6 @@ bool EnemyFly::Update(float dt)
 		}
 	}
 
-	counterTile++;
-	if (counterTile == 64 / 2)
-	{
-		i++;
-		counterTile = 0;
-	}
-
 	// Call to the base class. It must be called at the end
 	// It will update the collider depending on the position
 	Enemy::Update(dt);
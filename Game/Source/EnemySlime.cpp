@@ -18,7 +18,7 @@ EnemySlime::EnemySlime(int x, int y, EnemyType typeOfEnemy, Entity* playerPointe
 
 	entityRect = { x, y, 64, 64 };
 
-	collider = app->collisions->AddCollider(entityRect, Collider::Type::ENEMY, (Module*)app->entityManager);
+	collider = app->collisions->AddCollider(entityRect, Collider::Type::ENEMY, (Module*)app->entityManager, this);
 
 	//Slime Animations
 	for (int i = 0; i < 5; i++)
@@ -45,7 +45,9 @@ EnemySlime::EnemySlime(int x, int y, EnemyType typeOfEnemy, Entity* playerPointe
 
 	currentAnim = &slimeIdle;
 
-
+	// Routes only use the jumps and falls the slime can make, it is slower going left
+	SurfaceMotion motion = { physics.gravity, SLIME_JUMP_SPEED, SLIME_SPEED_LEFT, SLIME_SPEED_RIGHT, 64 };
+	app->pathfinding->SetGroundMotion(motion);
 }
 
 bool EnemySlime::Update(float dt)
@@ -82,72 +84,48 @@ bool EnemySlime::Update(float dt)
 		}
 	}
 
-	if (app->map->GetTileProperty(nextPos.x / 64, nextPos.y / 64 + 1, "Collider") == Collider::Type::PAIN)
+	if (app->map->GetColliderType(nextPos.x / 64, nextPos.y / 64 + 1) == Collider::Type::PAIN)
 	{
 		hurtChange = true;
-		collider->pendingToDelete = true;
+		app->collisions->RemoveCollider(collider);
 		app->audio->PlayFx(app->entityManager->deathSFX, 0);
 	}
 
+	// One step towards the player
 	iPoint origin = { nextPos.x / 64,nextPos.y / 64 };
-	iPoint destination = { player->entityRect.x / 64,player->entityRect.y / 64 };
-	iPoint diffTiles = { abs(destination.x - origin.x), abs(destination.y - origin.y) };
-	if (destination.y < 0)
-	{
-		destination.y = 0;
-	}
-	if (pastDest != destination)
+	iPoint next;
+
+	bool jump = false;
+
+	if (physics.speed.y == 0.0f) airSpeed = 0.0f;
+
+	if (!hurtChange && airSpeed != 0.0f)
 	{
-		pastDest = destination;
-		if (diffTiles.x < 10 && diffTiles.y < 10)
-		{
-			if (origin.x != destination.x || origin.y != destination.y)
-			{
-				path.Clear();
-				pathCount = app->pathfinding->CreatePath(path, origin, destination);
-				if (pathCount != -1)
-				{
-					i = 0;
-				}
-			}
-		}
-		else if (path.Count() != 0)
-		{
-			path.Clear();
-		}
+		// Jumping or falling along a link of the surface graph
+		physics.speed.x = airSpeed;
 	}
-
-	if (path.Count() != 0 && pathCount < 12 && pathCount > 1 && !hurtChange)
+	else if (!hurtChange && GetChaseStep(origin, next, &jump))
 	{
-		if (i >= (pathCount - 2))
-		{
-			i = pathCount - 2;
-		}
-
-		iPoint pos = app->map->MapToWorld(path.At(i)->x, path.At(i)->y);
-		iPoint dest = app->map->MapToWorld(path.At(i + 1)->x, path.At(i + 1)->y);
-		iPoint dif = { dest.x - pos.x,dest.y - pos.y };
-		//LOG("dif: %d, %d\n", dif.x, dif.y);
+		iPoint dif = { next.x - origin.x,next.y - origin.y };
 		if (dif.x > 0)
 		{
 
 			currentAnim = &slimeMoving;
-			physics.speed.x = 150.0f;
+			physics.speed.x = SLIME_SPEED_RIGHT;
 			invert = false;
 		}
 		else if (dif.x < 0)
 		{
 			currentAnim = &slimeMoving;
-			origin.x = (nextPos.x + entityRect.w) / 64;
-			physics.speed.x = -75.0f;
+			physics.speed.x = -SLIME_SPEED_LEFT;
 			invert = true;
 		}
 
-		if (dif.y < 0)
+		if (jump || dif.y < 0)
 		{
 			if (physics.speed.y == 0)
 			{
-				physics.speed.y = -250.0f;
+				physics.speed.y = -SLIME_JUMP_SPEED;
 			}
 			physics.positiveSpeedY = false;
 		}
@@ -156,16 +134,8 @@ bool EnemySlime::Update(float dt)
 			physics.positiveSpeedY = true;
 		}
 
-		counterTile++;
-		if (counterTile >= 32)
-		{
-			counterTile = 32;
-		}
-		if (counterTile == 64 / 2 && physics.speed.y == 0)
-		{
-			i++;
-			counterTile = 0;
-		}
+		// Leaving the span: keep going the same way until it lands
+		if (physics.speed.y != 0.0f || dif.y != 0) airSpeed = physics.speed.x;
 	}
 
 	// Call to the base class. It must be called at the end
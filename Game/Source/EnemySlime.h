@@ -3,6 +3,11 @@
 
 #include "Enemy.h"
 
+// Movement of the slime in pixels per second, the surface graph is built from it
+#define SLIME_SPEED_RIGHT 150.0f
+#define SLIME_SPEED_LEFT 75.0f
+#define SLIME_JUMP_SPEED 250.0f
+
 class EnemySlime : public Enemy
 {
 public:
@@ -22,6 +27,9 @@ private:
 	Animation slimeDed;
 	Animation slimeIdle;
 	Animation* currentSlimeAnimation = &slimeIdle;
+
+	// Horizontal speed kept while in the air, the route is only replanned on landing
+	float airSpeed = 0.0f;
 };
 
 #endif // __ENEMY_GROUND_H__
\ No newline at end of file
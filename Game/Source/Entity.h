@@ -54,7 +54,7 @@ public:
 
     EntityType type;
     SDL_Rect entityRect;
-    Collider* collider;
+    ColliderHandle collider;
     Physics physics;
     iPoint nextPos;
 
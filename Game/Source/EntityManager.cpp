@@ -185,25 +185,17 @@ bool EntityManager::PostUpdate()
 
 void EntityManager::DestroyEntity(Entity* entity)
 {
-	if (entity->collider != nullptr)
-	{
-		entity->collider->pendingToDelete = true;
-	}
+	app->collisions->RemoveCollider(entity->collider);
 	int i = entities.Find(entity);
 	delete entities[i];
 	entities.Del(entities.At(i));
 }
 
 
+// Only the collider an entity was created with is forwarded to it, attack boxes have no owner
 void EntityManager::OnCollision(Collider* c1, Collider* c2)
 {
-	for (int i = 0; i < entities.Count(); i++)
-	{
-		if (c1 == entities[i]->collider)
-		{
-			entities[i]->OnCollision(c1, c2);
-		}
-	}
+	if (c1->owner != nullptr) c1->owner->OnCollision(c1, c2);
 }
 
 
@@ -0,0 +1,341 @@
+#include "Inflate.h"
+
+#include <string.h>
+
+#define MAX_BITS 15
+#define MAX_LCODES 286
+#define MAX_DCODES 30
+#define FIX_LCODES 288
+
+struct InflateState
+{
+	const uchar* src;
+	uint srcSize;
+	uint srcPos;
+
+	uchar* dst;
+	uint dstSize;
+	uint dstPos;
+
+	uint bitBuffer;
+	int bitCount;
+
+	bool error;
+};
+
+// Canonical Huffman table: number of codes of each length and symbols ordered by code
+struct Huffman
+{
+	short count[MAX_BITS + 1];
+	short symbol[FIX_LCODES];
+};
+
+static const short lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Reads need bits from the stream, least significant bit first
+static int Bits(InflateState* s, int need)
+{
+	uint value = s->bitBuffer;
+	while (s->bitCount < need)
+	{
+		if (s->srcPos == s->srcSize)
+		{
+			s->error = true;
+			return 0;
+		}
+		value |= (uint)s->src[s->srcPos++] << s->bitCount;
+		s->bitCount += 8;
+	}
+
+	s->bitBuffer = value >> need;
+	s->bitCount -= need;
+	return (int)(value & ((1u << need) - 1));
+}
+
+// Decodes one symbol, returns -1 on error
+static int Decode(InflateState* s, const Huffman* h)
+{
+	int code = 0;
+	int first = 0;
+	int index = 0;
+
+	for (int len = 1; len <= MAX_BITS; ++len)
+	{
+		code |= Bits(s, 1);
+		if (s->error) return -1;
+
+		int count = h->count[len];
+		if (code - count < first) return h->symbol[index + (code - first)];
+
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+// Builds a table from the code lengths, returns < 0 if the code is over-subscribed
+static int BuildHuffman(Huffman* h, const short* length, int n)
+{
+	short offsets[MAX_BITS + 1];
+
+	for (int len = 0; len <= MAX_BITS; ++len) h->count[len] = 0;
+	for (int symbol = 0; symbol < n; ++symbol) h->count[length[symbol]]++;
+	if (h->count[0] == n) return 0;
+
+	int left = 1;
+	for (int len = 1; len <= MAX_BITS; ++len)
+	{
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0) return left;
+	}
+
+	offsets[1] = 0;
+	for (int len = 1; len < MAX_BITS; ++len) offsets[len + 1] = offsets[len] + h->count[len];
+
+	for (int symbol = 0; symbol < n; ++symbol)
+	{
+		if (length[symbol] != 0) h->symbol[offsets[length[symbol]]++] = (short)symbol;
+	}
+	return left;
+}
+
+static bool Stored(InflateState* s)
+{
+	// Stored blocks start at a byte boundary
+	s->bitBuffer = 0;
+	s->bitCount = 0;
+
+	if (s->srcPos + 4 > s->srcSize) return false;
+	uint len = s->src[s->srcPos] | (s->src[s->srcPos + 1] << 8);
+	uint nlen = s->src[s->srcPos + 2] | (s->src[s->srcPos + 3] << 8);
+	s->srcPos += 4;
+
+	if (len != (~nlen & 0xffff) || s->srcPos + len > s->srcSize || s->dstPos + len > s->dstSize) return false;
+
+	memcpy(s->dst + s->dstPos, s->src + s->srcPos, len);
+	s->srcPos += len;
+	s->dstPos += len;
+	return true;
+}
+
+static bool Codes(InflateState* s, const Huffman* lencode, const Huffman* distcode)
+{
+	int symbol;
+	do
+	{
+		symbol = Decode(s, lencode);
+		if (symbol < 0) return false;
+
+		if (symbol < 256)
+		{
+			if (s->dstPos == s->dstSize) return false;
+			s->dst[s->dstPos++] = (uchar)symbol;
+		}
+		else if (symbol > 256)
+		{
+			symbol -= 257;
+			if (symbol >= 29) return false;
+			uint len = lengthBase[symbol] + Bits(s, lengthExtra[symbol]);
+
+			symbol = Decode(s, distcode);
+			if (symbol < 0 || symbol >= 30) return false;
+			uint dist = distBase[symbol] + Bits(s, distExtra[symbol]);
+
+			if (s->error || dist > s->dstPos || s->dstPos + len > s->dstSize) return false;
+
+			// Byte by byte, the copy can overlap its own output
+			for (; len > 0; --len, ++s->dstPos) s->dst[s->dstPos] = s->dst[s->dstPos - dist];
+		}
+	} while (symbol != 256);
+
+	return true;
+}
+
+// Tables of the fixed code, built by the first thread that needs them
+struct FixedTables
+{
+	FixedTables()
+	{
+		short lengths[FIX_LCODES];
+		int symbol = 0;
+		for (; symbol < 144; ++symbol) lengths[symbol] = 8;
+		for (; symbol < 256; ++symbol) lengths[symbol] = 9;
+		for (; symbol < 280; ++symbol) lengths[symbol] = 7;
+		for (; symbol < FIX_LCODES; ++symbol) lengths[symbol] = 8;
+		BuildHuffman(&lencode, lengths, FIX_LCODES);
+
+		for (symbol = 0; symbol < MAX_DCODES; ++symbol) lengths[symbol] = 5;
+		BuildHuffman(&distcode, lengths, MAX_DCODES);
+	}
+
+	Huffman lencode;
+	Huffman distcode;
+};
+
+static bool Fixed(InflateState* s)
+{
+	// Function local statics are initialized once even if the loader thread and PageIn race here
+	static const FixedTables tables;
+
+	return Codes(s, &tables.lencode, &tables.distcode);
+}
+
+static bool Dynamic(InflateState* s)
+{
+	static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	short lengths[MAX_LCODES + MAX_DCODES];
+	Huffman lencode;
+	Huffman distcode;
+
+	int nlen = Bits(s, 5) + 257;
+	int ndist = Bits(s, 5) + 1;
+	int ncode = Bits(s, 4) + 4;
+	if (s->error || nlen > MAX_LCODES || ndist > MAX_DCODES) return false;
+
+	// Code length code lengths
+	int index = 0;
+	for (; index < ncode; ++index) lengths[order[index]] = (short)Bits(s, 3);
+	for (; index < 19; ++index) lengths[order[index]] = 0;
+	if (s->error || BuildHuffman(&lencode, lengths, 19) != 0) return false;
+
+	// Literal/length and distance code lengths
+	index = 0;
+	while (index < nlen + ndist)
+	{
+		int symbol = Decode(s, &lencode);
+		if (symbol < 0) return false;
+
+		if (symbol < 16)
+		{
+			lengths[index++] = (short)symbol;
+		}
+		else
+		{
+			short len = 0;
+			if (symbol == 16)
+			{
+				if (index == 0) return false;
+				len = lengths[index - 1];
+				symbol = 3 + Bits(s, 2);
+			}
+			else if (symbol == 17) symbol = 3 + Bits(s, 3);
+			else symbol = 11 + Bits(s, 7);
+
+			if (s->error || index + symbol > nlen + ndist) return false;
+			while (symbol--) lengths[index++] = len;
+		}
+	}
+
+	// Without an end of block code the data could never finish
+	if (lengths[256] == 0) return false;
+
+	if (BuildHuffman(&lencode, lengths, nlen) < 0) return false;
+	if (BuildHuffman(&distcode, lengths + nlen, ndist) < 0) return false;
+
+	return Codes(s, &lencode, &distcode);
+}
+
+// Decodes the deflate blocks starting at srcPos, returns the position after the last one or -1
+static int InflateBlocks(const uchar* src, uint srcSize, uint srcPos, uchar* dst, uint dstSize, int& written)
+{
+	InflateState s;
+	s.src = src;
+	s.srcSize = srcSize;
+	s.srcPos = srcPos;
+	s.dst = dst;
+	s.dstSize = dstSize;
+	s.dstPos = 0;
+	s.bitBuffer = 0;
+	s.bitCount = 0;
+	s.error = false;
+
+	int last;
+	do
+	{
+		last = Bits(&s, 1);
+		int type = Bits(&s, 2);
+		if (s.error) return -1;
+
+		bool ok = false;
+		switch (type)
+		{
+		case 0: ok = Stored(&s); break;
+		case 1: ok = Fixed(&s); break;
+		case 2: ok = Dynamic(&s); break;
+		default: break;
+		}
+		if (!ok || s.error) return -1;
+	} while (!last);
+
+	written = (int)s.dstPos;
+	return (int)s.srcPos;
+}
+
+int Inflate(const uchar* src, uint srcSize, uchar* dst, uint dstSize)
+{
+	int written = -1;
+	if (InflateBlocks(src, srcSize, 0, dst, dstSize, written) < 0) return -1;
+	return written;
+}
+
+int ZlibDecompress(const uchar* src, uint srcSize, uchar* dst, uint dstSize)
+{
+	// CMF and FLG: deflate method, no preset dictionary, valid check bits
+	if (srcSize < 6 || (src[0] & 0x0f) != 8 || (src[1] & 0x20) != 0 || ((src[0] << 8) | src[1]) % 31 != 0) return -1;
+
+	int written = -1;
+	int end = InflateBlocks(src, srcSize, 2, dst, dstSize, written);
+	if (end < 0 || (uint)end + 4 > srcSize) return -1;
+
+	uint a = 1;
+	uint b = 0;
+	for (int i = 0; i < written; ++i)
+	{
+		a = (a + dst[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	uint adler = ((uint)src[end] << 24) | ((uint)src[end + 1] << 16) | ((uint)src[end + 2] << 8) | (uint)src[end + 3];
+	return (adler == ((b << 16) | a)) ? written : -1;
+}
+
+int GzipDecompress(const uchar* src, uint srcSize, uchar* dst, uint dstSize)
+{
+	if (srcSize < 18 || src[0] != 0x1f || src[1] != 0x8b || src[2] != 8) return -1;
+
+	uchar flags = src[3];
+	uint pos = 10;
+
+	// FEXTRA, FNAME, FCOMMENT and FHCRC optional fields
+	if (flags & 0x04)
+	{
+		if (pos + 2 > srcSize) return -1;
+		pos += 2 + (src[pos] | (src[pos + 1] << 8));
+	}
+	if (flags & 0x08)
+	{
+		while (pos < srcSize && src[pos] != 0) ++pos;
+		++pos;
+	}
+	if (flags & 0x10)
+	{
+		while (pos < srcSize && src[pos] != 0) ++pos;
+		++pos;
+	}
+	if (flags & 0x02) pos += 2;
+	if (pos >= srcSize) return -1;
+
+	int written = -1;
+	int end = InflateBlocks(src, srcSize, pos, dst, dstSize, written);
+	if (end < 0 || (uint)end + 8 > srcSize) return -1;
+
+	// ISIZE, the uncompressed size modulo 2^32
+	uint size = (uint)src[end + 4] | ((uint)src[end + 5] << 8) | ((uint)src[end + 6] << 16) | ((uint)src[end + 7] << 24);
+	return (size == (uint)written) ? written : -1;
+}
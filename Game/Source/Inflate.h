@@ -0,0 +1,22 @@
+#ifndef __INFLATE_H__
+#define __INFLATE_H__
+
+#include "Defs.h"
+
+// --------------------------------------------------
+// Minimal DEFLATE decoder (RFC 1951) for the compressed
+// layer data of Tiled maps. Based on Mark Adler's puff.
+// All functions return the number of bytes written to
+// dst or -1 if the stream is invalid or does not fit.
+// --------------------------------------------------
+
+// Raw deflate stream
+int Inflate(const uchar* src, uint srcSize, uchar* dst, uint dstSize);
+
+// Deflate stream with zlib header and Adler-32 trailer (RFC 1950)
+int ZlibDecompress(const uchar* src, uint srcSize, uchar* dst, uint dstSize);
+
+// Deflate stream with gzip header and trailer (RFC 1952)
+int GzipDecompress(const uchar* src, uint srcSize, uchar* dst, uint dstSize);
+
+#endif // __INFLATE_H__
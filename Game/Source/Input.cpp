@@ -78,6 +78,9 @@ bool Input::PreUpdate()
 			MouseButtons[i] = KEY_IDLE;
 	}
 
+	// Render target resets only last for the frame they happen
+	windowEvents[WE_TARGETS_RESET] = false;
+
 	while(SDL_PollEvent(&event) != 0)
 	{
 		switch(event.type)
@@ -106,6 +109,11 @@ bool Input::PreUpdate()
 				}
 			break;
 
+			case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET:
+				windowEvents[WE_TARGETS_RESET] = true;
+			break;
+
 			case SDL_MOUSEBUTTONDOWN:
 				MouseButtons[event.button.button - 1] = KEY_DOWN;
 				//LOG("Mouse button %d down", event.button.button-1);
@@ -14,6 +14,7 @@ enum EventWindow
 	WE_QUIT = 0,
 	WE_HIDE = 1,
 	WE_SHOW = 2,
+	WE_TARGETS_RESET = 3,
 	WE_COUNT
 };
 
@@ -5,9 +5,10 @@
 
 void Log(const char file[], int line, const char* format, ...)
 {
-	static char tmpString[4096];
-	static char tmpString2[4096];
-	static va_list  ap;
+	// Maps load on a worker thread, each thread formats in its own buffers
+	static thread_local char tmpString[4096];
+	static thread_local char tmpString2[4096];
+	va_list  ap;
 
 	// Construct the string from variable arguments
 	va_start(ap, format);
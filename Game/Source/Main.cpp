@@ -14,6 +14,7 @@ enum MainState
 	AWAKE,
 	START,
 	LOOP,
+	BAKE,
 	CLEAN,
 	FAIL,
 	EXIT
@@ -49,7 +50,7 @@ int main(int argc, char* args[])
 			case AWAKE:
 			LOG("AWAKE PHASE ===============================");
 			if(app->Awake() == true)
-				state = START;
+				state = (app->IsBaking() == true) ? BAKE : START;
 			else
 			{
 				LOG("ERROR: Awake failed");
@@ -79,6 +80,15 @@ int main(int argc, char* args[])
 				state = CLEAN;
 			break;
 
+			// Compile maps and quit, "Game -bake level.tmx ..." -------------
+			case BAKE:
+			LOG("BAKE PHASE ===============================");
+			if(app->BakeMaps() == true)
+				state = CLEAN;
+			else
+				state = FAIL;
+			break;
+
 			// Cleanup allocated memory -----------------------------------------
 			case CLEAN:
 			LOG("CLEANUP PHASE ===============================");
@@ -1,15 +1,72 @@
 #include "App.h"
 #include "Render.h"
 #include "Textures.h"
+#include "Window.h"
+#include "Input.h"
 #include "Map.h"
+#include "Inflate.h"
+#include "PerfTimer.h"
+#include "PathFinding.h"
+
+#include "SDL_image/include/SDL_image.h"
 
 
 #include "Defs.h"
 #include "Log.h"
 
 #include <math.h>
+#include <limits.h>
+#include <stdlib.h>
+
+// Bytes pugi holds and the most it held since the last reset, to measure the DOM of a map load.
+// Atomic since maps are parsed on the loader thread while the main thread may parse other files
+static SDL_atomic_t xmlBytes;
+static SDL_atomic_t xmlPeak;
+
+// Every block starts with its size, 16 bytes keep the rest aligned like malloc
+#define XML_BLOCK_HEADER 16
+
+static void* XmlAllocate(size_t size)
+{
+	uchar* block = (uchar*)malloc(size + XML_BLOCK_HEADER);
+	if (block == NULL) return NULL;
+	*(size_t*)block = size;
+
+	int used = SDL_AtomicAdd(&xmlBytes, (int)size) + (int)size;
+	int peak = SDL_AtomicGet(&xmlPeak);
+	while (used > peak && SDL_AtomicCAS(&xmlPeak, peak, used) == SDL_FALSE) peak = SDL_AtomicGet(&xmlPeak);
+
+	return block + XML_BLOCK_HEADER;
+}
+
+static void XmlDeallocate(void* ptr)
+{
+	if (ptr == NULL) return;
+
+	uchar* block = (uchar*)ptr - XML_BLOCK_HEADER;
+	SDL_AtomicAdd(&xmlBytes, -(int)*(size_t*)block);
+	free(block);
+}
+
+Map::Map() : Module(), tileDrawTable(NULL), tileDrawCount(0), tilesetTextures(NULL), colliderGrid(NULL), colliderGridWidth(0), colliderGridHeight(0), collisionLayer(NULL), metadataTileset(NULL),
+	navigationGrid(NULL), navigationGridWidth(0), navigationGridHeight(0), navigationLayer(NULL), streamRadius(MAP_STREAM_RADIUS), streamBudget(MAP_STREAM_BUDGET), streamFrame(0), navigationWindowDirty(false), streamFile(NULL),
+	bakeMode(false), chunkSize(MAP_CHUNK_SIZE), loadThread(NULL), loadStage(LOAD_IDLE), tilesetsUploaded(0), chunksToBake(0), chunksBaked(0), loadBudget(4.0), mapLoaded(false), loadFailed(false)
+{
+	name.Create("map");
+
+	SDL_AtomicSet(&parseResult, 0);
+	SDL_AtomicSet(&itemsToParse, 0);
+	SDL_AtomicSet(&itemsParsed, 0);
+
+	drawableKey = Properties::Intern("Drawable");
+	colliderKey = Properties::Intern("Collider");
+	navigationKey = Properties::Intern("Navigation");
 
-Map::Map() : Module(), mapLoaded(false) { name.Create("map"); }
+	// Before any document allocates, blocks have to be freed by the functions that allocated them
+	SDL_AtomicSet(&xmlBytes, 0);
+	SDL_AtomicSet(&xmlPeak, 0);
+	pugi::set_memory_management_functions(XmlAllocate, XmlDeallocate);
+}
 
 // Destructor
 Map::~Map() {}
@@ -22,41 +79,132 @@ bool Map::Awake(pugi::xml_node& config)
 	LOG("Loading Map Parser");
 	bool ret = true;
 	folder.Create(config.child("folder").child_value());
+	chunkSize = config.child("chunks").attribute("size").as_int(MAP_CHUNK_SIZE);
+	loadBudget = config.child("loading").attribute("budget_ms").as_double(4.0);
+	streamRadius = config.child("streaming").attribute("radius").as_int(MAP_STREAM_RADIUS);
+	streamBudget = config.child("streaming").attribute("budget").as_int(MAP_STREAM_BUDGET);
 	return ret;
 }
 
+// Main thread part of an asynchronous load
+bool Map::Update(float dt)
+{
+	if (loadStage == LOAD_IDLE)
+	{
+		if (mapLoaded && data.infinite) UpdateStreaming();
+		return true;
+	}
+
+	PerfTimer slice;
+
+	if (loadStage == LOAD_PARSING)
+	{
+		int result = SDL_AtomicGet(&parseResult);
+		if (result == 0) return true;
+
+		SDL_WaitThread(loadThread, NULL);
+		loadThread = NULL;
+
+		if (result < 0)
+		{
+			LOG("Could not load map %s", loadingFile.GetString());
+			loadStage = LOAD_IDLE;
+			loadFailed = true;
+			return true;
+		}
+		loadStage = LOAD_UPLOADING;
+	}
+
+	if (loadStage == LOAD_UPLOADING)
+	{
+		if (UploadTilesets(slice, loadBudget) == false) return true;
+
+		ListItem<MapLayer*>* item;
+		for (item = data.layers.start; item != NULL; item = item->next) BuildChunks(item->data);
+		loadStage = LOAD_BAKING;
+	}
+
+	if (loadStage == LOAD_BAKING)
+	{
+		if (BakeDirtyChunks(slice, loadBudget) == false) return true;
+
+		// Streamed maps hand their walkability window once they start streaming
+		if (navigationGrid != NULL) app->pathfinding->LoadMap(navigationGridWidth, navigationGridHeight, navigationGrid);
+		loadStage = LOAD_NAVIGATION;
+	}
+
+	if (loadStage == LOAD_NAVIGATION)
+	{
+		// Enemies spawned with the level search it right away
+		if (navigationGrid != NULL && app->pathfinding->IsMapReady() == false) return true;
+
+		loadStage = LOAD_IDLE;
+		mapLoaded = true;
+		LOG("Map %s ready in %.2f ms", loadingFile.GetString(), loadTimer.ReadMs());
+	}
+
+	return true;
+}
+
 // Draw the map (all requried layers)
 
 void Map::Draw()
 {
 	if (mapLoaded == false) return;
 
+	// Render targets lose their contents when the device is reset
+	bool targetsReset = app->input->GetWindowEvent(WE_TARGETS_RESET);
+
 	ListItem <MapLayer*>* layer;
 	layer = data.layers.start;
-	TileSet* currentTileset;
 
 	while (layer != NULL)
 	{
+		MapLayer* mapLayer = layer->data;
+
+		if (targetsReset)
+		{
+			for (int i = 0; i < mapLayer->chunksWidth * mapLayer->chunksHeight; ++i) mapLayer->chunks[i].dirty = true;
+			for (uint i = 0; i < mapLayer->streamed.Count(); ++i) mapLayer->streamed[i]->textureDirty = (mapLayer->streamed[i]->gids != NULL);
+		}
 
-		if (layer->data->properties.GetProperty("Drawable") == 1 || app->render->drawLayerColliders)
+		if (mapLayer->properties.GetProperty(drawableKey) == 1 || app->render->drawLayerColliders)
 		{
-			
-			for (int y = 0; y < data.height; ++y)
+			// Only the chunks inside the camera are drawn
+			iPoint min, max;
+			GetVisibleTileRange(mapLayer, min, max);
+			if (min.x > max.x || min.y > max.y)
 			{
-				for (int x = 0; x < data.width; ++x)
+				layer = layer->next;
+				continue;
+			}
+
+			if (mapLayer->IsStreamed())
+			{
+				DrawStreamedTiles(mapLayer, min, max);
+				layer = layer->next;
+				continue;
+			}
+
+			for (int cy = min.y / chunkSize; cy <= max.y / chunkSize; ++cy)
+			{
+				for (int cx = min.x / chunkSize; cx <= max.x / chunkSize; ++cx)
 				{
-					int tileId = layer->data->Get(x, y);
-					if (tileId > 0)
+					MapChunk& chunk = mapLayer->chunks[cy * mapLayer->chunksWidth + cx];
+					if (chunk.dirty) BakeChunk(mapLayer, cx, cy);
+					if (chunk.empty) continue;
+
+					iPoint pos = MapToWorld(cx * chunkSize, cy * chunkSize);
+					if (chunk.texture != NULL)
+					{
+						app->render->DrawTexture(chunk.texture, pos.x, pos.y, NULL, false, mapLayer->parallax);
+					}
+					else
 					{
-						// Complete the draw function
-						currentTileset = GetTilesetFromTileId(tileId);
-						SDL_Rect tileRec = currentTileset->GetTileRect(tileId);
-						iPoint pos = MapToWorld(x, y);
-						
-						//if (currentTileset->GetPropList(tileId - currentTileset->firstgid)->properties.GetProperty("Drawable") == 1)
-						//{
-						app->render->DrawTexture(currentTileset->texture, pos.x, pos.y, &tileRec);
-						//}
+						// No render target available, draw the visible part of the chunk tile by tile
+						iPoint chunkMin(MAX(min.x, cx * chunkSize), MAX(min.y, cy * chunkSize));
+						iPoint chunkMax(MIN(max.x, (cx + 1) * chunkSize - 1), MIN(max.y, (cy + 1) * chunkSize - 1));
+						DrawTiles(mapLayer, chunkMin, chunkMax);
 					}
 				}
 			}
@@ -65,6 +213,49 @@ void Map::Draw()
 	}
 }
 
+// Draws the tiles of a layer one by one
+void Map::DrawTiles(const MapLayer* layer, const iPoint& min, const iPoint& max) const
+{
+	for (int y = min.y; y <= max.y; ++y)
+	{
+		const uint* row = &layer->data[y * layer->width];
+		int posY = y * data.tileHeight;
+
+		for (int x = min.x, posX = min.x * data.tileWidth; x <= max.x; ++x, posX += data.tileWidth)
+		{
+			uint tileId = row[x];
+			if (tileId > 0 && tileId < tileDrawCount)
+			{
+				const TileDrawInfo& tile = tileDrawTable[tileId];
+				app->render->DrawTexture(tilesetTextures[tile.tileset], posX, posY, &tile.rect, false, layer->parallax);
+			}
+		}
+	}
+}
+
+// Visible tile range of a layer, taking its parallax speed into account
+void Map::GetVisibleTileRange(const MapLayer* layer, iPoint& min, iPoint& max) const
+{
+	const SDL_Rect& camera = app->render->camera;
+	int scale = (int)app->win->GetScale();
+	int tileW = data.tileWidth * scale;
+	int tileH = data.tileHeight * scale;
+
+	// Screen position of the layer origin, as computed by Render::DrawTexture
+	int originX = (int)(camera.x * layer->parallax);
+	int originY = (int)(camera.y * layer->parallax);
+
+	min.x = (int)floorf((float)-originX / tileW);
+	min.y = (int)floorf((float)-originY / tileH);
+	max.x = (int)floorf((float)(camera.w - 1 - originX) / tileW);
+	max.y = (int)floorf((float)(camera.h - 1 - originY) / tileH);
+
+	min.x = MAX(min.x, 0);
+	min.y = MAX(min.y, 0);
+	max.x = MIN(max.x, layer->width - 1);
+	max.y = MIN(max.y, layer->height - 1);
+}
+
 
 
 // method that translates x,y coordinates from map positions to world positions
@@ -95,6 +286,16 @@ bool Map::CleanUp()
 {
 	LOG("Unloading map");
 
+	// A load in progress owns the map data until its thread finishes
+	if (loadThread != NULL)
+	{
+		SDL_WaitThread(loadThread, NULL);
+		loadThread = NULL;
+	}
+	loadStage = LOAD_IDLE;
+	loadFailed = false;
+	tilesetsUploaded = chunksToBake = chunksBaked = 0;
+
 	// Make sure you clean up any memory allocated from tilesets/map
 	// Remove all tilesets
 	ListItem<TileSet*>* item;
@@ -113,188 +314,1612 @@ bool Map::CleanUp()
 	ListItem<MapLayer*>* item2;
 	item2 = data.layers.start;
 
-	while (item2 != NULL)
-	{
-		RELEASE(item2->data);
-		item2 = item2->next;
+	while (item2 != NULL)
+	{
+		RELEASE(item2->data);
+		item2 = item2->next;
+	}
+	data.layers.Clear();
+
+	// Tables of a baked map live inside the mapping
+	if (bakedFile.IsOpen())
+	{
+		tileDrawTable = NULL;
+		colliderGrid = NULL;
+		navigationGrid = NULL;
+		bakedFile.Close();
+	}
+	else
+	{
+		RELEASE_ARRAY(tileDrawTable);
+		RELEASE_ARRAY(colliderGrid);
+		RELEASE_ARRAY(navigationGrid);
+	}
+	RELEASE_ARRAY(tilesetTextures);
+	tileDrawCount = 0;
+	colliderGridWidth = colliderGridHeight = 0;
+	navigationGridWidth = navigationGridHeight = 0;
+	collisionLayer = NULL;
+	metadataTileset = NULL;
+	navigationLayer = NULL;
+	residentChunks.Clear();
+	navigationWindowDirty = false;
+	if (streamFile != NULL) SDL_RWclose(streamFile);
+	streamFile = NULL;
+	mapLoaded = false;
+
+	return true;
+}
+
+// Loads a map blocking until it can be drawn
+bool Map::Load(const char* filename)
+{
+	PerfTimer timer;
+
+	if (data.layers.Count() > 0 || data.tilesets.Count() > 0 || loadStage != LOAD_IDLE) CleanUp();
+
+	bool ret = LoadData(filename);
+
+	if (ret == true && bakeMode == false)
+	{
+		PerfTimer slice;
+		UploadTilesets(slice, 0);
+
+		ListItem<MapLayer*>* item;
+		for (item = data.layers.start; item != NULL; item = item->next) BuildChunks(item->data);
+		BakeDirtyChunks(slice, 0);
+
+		mapLoaded = true;
+		LOG("Map %s ready in %.2f ms", filename, timer.ReadMs());
+	}
+
+	return ret;
+}
+
+bool Map::LoadAsync(const char* filename)
+{
+	if (data.layers.Count() > 0 || data.tilesets.Count() > 0 || loadStage != LOAD_IDLE) CleanUp();
+
+	loadingFile.Create(filename);
+	loadTimer.Start();
+	SDL_AtomicSet(&parseResult, 0);
+	SDL_AtomicSet(&itemsToParse, 0);
+	SDL_AtomicSet(&itemsParsed, 0);
+	tilesetsUploaded = chunksToBake = chunksBaked = 0;
+
+	loadFailed = false;
+	loadStage = LOAD_PARSING;
+	loadThread = SDL_CreateThread(LoadThread, "MapLoader", this);
+
+	// Update goes on with the rest of the stages as if the thread had parsed it
+	if (loadThread == NULL)
+	{
+		LOG("Could not create the map loading thread, parsing %s now. SDL_Error: %s", filename, SDL_GetError());
+		SDL_AtomicSet(&parseResult, LoadData(filename) ? 1 : -1);
+		return SDL_AtomicGet(&parseResult) > 0;
+	}
+	return true;
+}
+
+int Map::LoadThread(void* param)
+{
+	Map* map = (Map*)param;
+	SDL_AtomicSet(&map->parseResult, map->LoadData(map->loadingFile.GetString()) ? 1 : -1);
+	return 0;
+}
+
+float Map::GetLoadProgress() const
+{
+	// Parsing and decoding take about half of a load, uploading and baking the rest
+	switch (loadStage)
+	{
+	case LOAD_PARSING:
+	{
+		int total = SDL_AtomicGet(&itemsToParse);
+		return (total > 0) ? 0.5f * SDL_AtomicGet(&itemsParsed) / total : 0.0f;
+	}
+	case LOAD_UPLOADING:
+		return 0.5f + 0.2f * tilesetsUploaded / MAX((int)data.tilesets.Count(), 1);
+	case LOAD_BAKING:
+		return 0.7f + 0.25f * chunksBaked / MAX(chunksToBake, 1);
+	case LOAD_NAVIGATION:
+		return 0.95f;
+	default:
+		return mapLoaded ? 1.0f : 0.0f;
+	}
+}
+
+// Uploads the decoded tileset images
+bool Map::UploadTilesets(const PerfTimer& slice, double budget)
+{
+	ListItem<TileSet*>* item;
+	for (item = data.tilesets.start; item != NULL; item = item->next)
+	{
+		TileSet* set = item->data;
+		if (set->surface == NULL) continue;
+		if (budget > 0 && slice.ReadMs() >= budget) return false;
+
+		set->texture = app->tex->LoadSurface(set->surface);
+		SDL_FreeSurface(set->surface);
+		set->surface = NULL;
+		++tilesetsUploaded;
+	}
+
+	CacheTilesetTextures();
+	return true;
+}
+
+// Bakes the chunks of the drawable layers left dirty by BuildChunks
+bool Map::BakeDirtyChunks(const PerfTimer& slice, double budget)
+{
+	ListItem<MapLayer*>* item;
+	for (item = data.layers.start; item != NULL; item = item->next)
+	{
+		MapLayer* layer = item->data;
+		if (layer->chunks == NULL || layer->properties.GetProperty(drawableKey) != 1) continue;
+
+		for (int i = 0; i < layer->chunksWidth * layer->chunksHeight; ++i)
+		{
+			if (layer->chunks[i].dirty == false) continue;
+			if (budget > 0 && slice.ReadMs() >= budget) return false;
+
+			BakeChunk(layer, i % layer->chunksWidth, i / layer->chunksWidth);
+			++chunksBaked;
+		}
+	}
+	return true;
+}
+
+// Reads the baked map or the tmx, decodes the tileset images and builds the lookup tables
+bool Map::LoadData(const char* filename)
+{
+	bool ret = true;
+	PerfTimer timer;
+	SString tmp("%s%s", folder.GetString(), filename);
+
+	const char* extension = strrchr(filename, '.');
+	int nameLength = (extension != NULL) ? (int)(extension - filename) : (int)strlen(filename);
+	SString bakedPath("%s%.*s%s", folder.GetString(), nameLength, filename, BAKED_MAP_EXTENSION);
+
+	if (bakeMode == false && IsBakedMapOutdated(bakedPath.GetString(), tmp.GetString()) == false && LoadBaked(bakedPath.GetString()))
+	{
+		LOG("Map %s loaded from %s in %.2f ms, %u KB mapped", filename, bakedPath.GetString(), timer.ReadMs(), bakedFile.size / 1024);
+		return true;
+	}
+
+	// The file is parsed in place and the document is discarded before returning,
+	// only the decoded map data stays in memory
+	char* source = NULL;
+	uint sourceSize = 0;
+	pugi::xml_document mapFile;
+
+	// Highest of source, DOM and decoded data held at once, sampled after every stage
+	int xmlBase = SDL_AtomicGet(&xmlBytes);
+	SDL_AtomicSet(&xmlPeak, xmlBase);
+	uint peak = 0;
+
+	SDL_RWops* file = SDL_RWFromFile(tmp.GetString(), "rb");
+	if (file == NULL)
+	{
+		LOG("Could not open map file %s. SDL_Error: %s", filename, SDL_GetError());
+		ret = false;
+	}
+	else
+	{
+		sourceSize = (uint)SDL_RWsize(file);
+		source = new char[sourceSize];
+		if (SDL_RWread(file, source, 1, sourceSize) != sourceSize)
+		{
+			LOG("Could not read map file %s. SDL_Error: %s", filename, SDL_GetError());
+			ret = false;
+		}
+		SDL_RWclose(file);
+		peak = sourceSize;
+	}
+
+	if (ret == true)
+	{
+		// Line ends are kept so the text of every element is byte for byte the one in the file
+		pugi::xml_parse_result result = mapFile.load_buffer_inplace(source, sourceSize, pugi::parse_default & ~pugi::parse_eol);
+		peak = MAX(peak, sourceSize + (uint)(SDL_AtomicGet(&xmlPeak) - xmlBase));
+
+		if (result == NULL)
+		{
+			LOG("Could not load map xml file %s. pugi error: %s", filename, result.description());
+			ret = false;
+		}
+		else if (result.encoding == pugi::encoding_utf8 && mapFile.child("map").attribute("infinite").as_int() == 1)
+		{
+			// Offsets inside the parsed text are offsets in the file only if it was not converted
+			streamFile = SDL_RWFromFile(tmp.GetString(), "rb");
+			if (streamFile == NULL) LOG("Could not reopen %s to stream its chunks, keeping them in memory. SDL_Error: %s", filename, SDL_GetError());
+		}
+	}
+
+	if(ret == true)
+	{
+		pugi::xml_node mapNode = mapFile.child("map");
+		ret = LoadMap(mapNode);
+
+		int items = 0;
+		for (pugi::xml_node node = mapNode.first_child(); node; node = node.next_sibling())
+		{
+			if (strcmp(node.name(), "tileset") == 0 || strcmp(node.name(), "layer") == 0) ++items;
+		}
+		SDL_AtomicSet(&itemsToParse, items);
+
+		pugi::xml_node tileset;
+		for (tileset = mapNode.child("tileset"); tileset && ret; tileset = tileset.next_sibling("tileset"))
+		{
+			TileSet* set = new TileSet();
+			if (ret == true) ret = LoadTilesetDetails(tileset, set);
+			if (ret == true) ret = LoadTilesetImage(tileset, set);
+			if (ret == true) ret = LoadTilesetProperties(tileset, set);
+			data.tilesets.Add(set);
+			SDL_AtomicIncRef(&itemsParsed);
+			peak = MAX(peak, sourceSize + (uint)(SDL_AtomicGet(&xmlPeak) - xmlBase) + GetMemoryUsage());
+		}
+
+		//Iterate all layers and load each of them
+
+		for (pugi::xml_node layer = mapNode.child("layer"); layer && ret; layer = layer.next_sibling("layer"))
+		{
+			MapLayer* lay = new MapLayer();
+							
+			ret = LoadLayer(layer, lay);
+			if (ret == true) data.layers.Add(lay);
+			else RELEASE(lay);
+			SDL_AtomicIncRef(&itemsParsed);
+			peak = MAX(peak, sourceSize + (uint)(SDL_AtomicGet(&xmlPeak) - xmlBase) + GetMemoryUsage());
+		}
+
+		if (ret == true)
+		{
+			if (data.infinite) BuildStreamGrids();
+			BuildTileDrawTable();
+			BuildColliderGrid();
+			BuildNavigationGrid();
+			peak = MAX(peak, sourceSize + (uint)(SDL_AtomicGet(&xmlPeak) - xmlBase) + GetMemoryUsage());
+		}
+		LogInfo();
+	}
+
+	mapFile.reset();
+	RELEASE_ARRAY(source);
+
+	if (ret == true) LOG("Map %s loaded in %.2f ms. Peak memory %u KB", filename, timer.ReadMs(), peak / 1024);
+
+	return ret;
+}
+
+//Load map general properties
+bool Map::LoadMap(pugi::xml_node& map)
+{
+	bool ret = true;
+	if (map == NULL)
+	{
+		LOG("Error parsing map xml file: Cannot find 'map' tag.");
+		ret = false;
+	}
+	else
+	{
+		data.height = map.attribute("height").as_int();
+		data.width = map.attribute("width").as_int();
+		SString type(map.attribute("orientation").as_string());
+		data.type = StrToMapType(type);
+		data.tileHeight = map.attribute("tileheight").as_int();
+		data.tileWidth = map.attribute("tilewidth").as_int();
+		data.infinite = map.attribute("infinite").as_int(0) == 1;
+	}
+	return ret;
+}
+
+// Bytes held by the decoded map
+uint Map::GetMemoryUsage() const
+{
+	uint ret = tileDrawCount * sizeof(TileDrawInfo) + colliderGridWidth * colliderGridHeight + navigationGridWidth * navigationGridHeight;
+
+	for (ListItem<MapLayer*>* item = data.layers.start; item != NULL; item = item->next)
+	{
+		ret += sizeof(MapLayer) + item->data->width * item->data->height * sizeof(uint);
+		ret += item->data->chunksWidth * item->data->chunksHeight * sizeof(MapChunk);
+		ret += item->data->streamWidth * item->data->streamHeight * sizeof(MapStreamChunk*);
+
+		for (uint i = 0; i < item->data->streamed.Count(); ++i)
+		{
+			const MapStreamChunk* chunk = item->data->streamed[i];
+			ret += sizeof(MapStreamChunk) + chunk->payloadSize;
+			if (chunk->gids != NULL) ret += chunk->width * chunk->height * sizeof(uint);
+			if (chunk->colliders != NULL) ret += chunk->width * chunk->height;
+			if (chunk->walkability != NULL) ret += chunk->width * chunk->height;
+		}
+	}
+
+	for (ListItem<TileSet*>* item = data.tilesets.start; item != NULL; item = item->next)
+	{
+		ret += sizeof(TileSet) + item->data->tileCount * sizeof(Tile*);
+		for (int i = 0; i < item->data->tileCount; ++i)
+		{
+			if (item->data->tiles[i] != NULL) ret += sizeof(Tile) + item->data->tiles[i]->properties.list.GetCapacity() * sizeof(Properties::Property);
+		}
+	}
+	return ret;
+}
+
+bool Map::Bake(const char* filename)
+{
+	PerfTimer bakeTimer;
+
+	bakeMode = true;
+	bool ret = Load(filename);
+	bakeMode = false;
+
+	if (ret == true && data.infinite)
+	{
+		LOG("Infinite maps are streamed from the tmx, %s can not be baked", filename);
+		ret = false;
+	}
+
+	const char* extension = strrchr(filename, '.');
+	int nameLength = (extension != NULL) ? (int)(extension - filename) : (int)strlen(filename);
+	SString bakedPath("%s%.*s%s", folder.GetString(), nameLength, filename, BAKED_MAP_EXTENSION);
+
+	if (ret == true) ret = WriteBaked(bakedPath.GetString());
+	CleanUp();
+
+	if (ret == true) LOG("Baked %s into %s in %.2f ms", filename, bakedPath.GetString(), bakeTimer.ReadMs());
+	else LOG("Could not bake map %s", filename);
+
+	return ret;
+}
+
+// Names are stored as strings, keys are only valid for the run that interned them
+static BakedPropertyList BakeProperties(const Properties& properties, BakedSection& strings, BakedSection& records)
+{
+	BakedPropertyList ret;
+	ret.first = records.size / sizeof(BakedProperty);
+	ret.count = properties.list.Count();
+
+	for (uint i = 0; i < properties.list.Count(); ++i)
+	{
+		BakedProperty property;
+		property.name = strings.WriteString(Properties::GetName(properties.list[i].key));
+		property.value = properties.list[i].value;
+		records.Write(&property, sizeof(BakedProperty));
+	}
+	return ret;
+}
+
+static void LoadBakedProperties(const BakedPropertyList& list, const BakedProperty* records, const char* strings, Properties& properties)
+{
+	for (uint i = list.first; i < list.first + list.count; ++i)
+	{
+		properties.AddProperty(Properties::Intern(strings + records[i].name), records[i].value);
+	}
+}
+
+// True if count records of recordSize bytes starting at offset fit in size bytes, 4 byte aligned
+static bool IsBakedRangeValid(uint64 offset, uint64 count, uint64 recordSize, uint64 size)
+{
+	return (offset % 4) == 0 && offset + count * recordSize <= size;
+}
+
+static bool IsBakedPropertyListValid(const BakedPropertyList& list, const BakedProperty* records, uint recordCount, uint stringsSize)
+{
+	if ((uint64)list.first + list.count > recordCount) return false;
+
+	for (uint i = list.first; i < list.first + list.count; ++i)
+	{
+		if (records[i].name >= stringsSize) return false;
+	}
+	return true;
+}
+
+// Checks every offset, count and index of a mapped baked map before anything points into it.
+// Strings only need a valid offset since the section ends with a terminator
+static bool IsBakedMapValid(const uchar* file, uint size)
+{
+	if (size < sizeof(BakedMapHeader)) return false;
+
+	const BakedMapHeader* header = (const BakedMapHeader*)file;
+	if (header->magic != BAKED_MAP_MAGIC || header->version != BAKED_MAP_VERSION || header->fileSize != size) return false;
+
+	// Sections follow each other in this order
+	uint sections[7] = { sizeof(BakedMapHeader), header->strings, header->properties, header->tiles, header->tilesets, header->layers, header->blob };
+	for (int i = 1; i < 7; ++i)
+	{
+		if (sections[i] < sections[i - 1] || sections[i] > size || (sections[i] % 4) != 0) return false;
+	}
+
+	uint stringsSize = header->properties - header->strings;
+	uint propertyCount = (header->tiles - header->properties) / sizeof(BakedProperty);
+	uint tileCount = (header->tilesets - header->tiles) / sizeof(BakedTile);
+	uint blobSize = size - header->blob;
+	if (stringsSize > 0 && file[header->properties - 1] != '\0') return false;
+	if (IsBakedRangeValid(header->tilesets, header->tilesetCount, sizeof(BakedTileset), header->layers) == false ||
+		IsBakedRangeValid(header->layers, header->layerCount, sizeof(BakedLayer), header->blob) == false) return false;
+
+	const BakedProperty* properties = (const BakedProperty*)(file + header->properties);
+	const BakedTile* tiles = (const BakedTile*)(file + header->tiles);
+	const BakedTileset* tilesets = (const BakedTileset*)(file + header->tilesets);
+	const BakedLayer* layers = (const BakedLayer*)(file + header->layers);
+
+	for (uint i = 0; i < header->tilesetCount; ++i)
+	{
+		const BakedTileset& record = tilesets[i];
+		if (record.name >= stringsSize || record.image >= stringsSize || record.tileCount < 0) return false;
+		if ((uint64)record.firstTile + record.tileRecords > tileCount) return false;
+
+		for (uint t = record.firstTile; t < record.firstTile + record.tileRecords; ++t)
+		{
+			if (IsBakedPropertyListValid(tiles[t].properties, properties, propertyCount, stringsSize) == false) return false;
+		}
+	}
+
+	for (uint i = 0; i < header->layerCount; ++i)
+	{
+		const BakedLayer& record = layers[i];
+		if (record.name >= stringsSize || record.width < 0 || record.height < 0) return false;
+		if (IsBakedRangeValid(record.data, (uint64)record.width * record.height, sizeof(uint), blobSize) == false) return false;
+		if (IsBakedPropertyListValid(record.properties, properties, propertyCount, stringsSize) == false) return false;
+	}
+
+	if (header->colliderGridWidth < 0 || header->colliderGridHeight < 0 || header->navigationGridWidth < 0 || header->navigationGridHeight < 0) return false;
+	if (IsBakedRangeValid(header->tileDrawTable, header->tileDrawCount, sizeof(TileDrawInfo), blobSize) == false ||
+		IsBakedRangeValid(header->colliderGrid, (uint64)header->colliderGridWidth * header->colliderGridHeight, 1, blobSize) == false ||
+		IsBakedRangeValid(header->navigationGrid, (uint64)header->navigationGridWidth * header->navigationGridHeight, 1, blobSize) == false) return false;
+
+	// Draw indexes the tileset textures with these
+	const TileDrawInfo* tileDrawTable = (const TileDrawInfo*)(file + header->blob + header->tileDrawTable);
+	for (uint i = 0; i < header->tileDrawCount; ++i)
+	{
+		if (tileDrawTable[i].tileset < 0 || tileDrawTable[i].tileset >= (int)header->tilesetCount) return false;
+	}
+
+	return true;
+}
+
+bool Map::WriteBaked(const char* path) const
+{
+	BakedSection strings, properties, tiles, tilesets, layers, blob;
+
+	BakedMapHeader header;
+	memset(&header, 0, sizeof(BakedMapHeader));
+	header.magic = BAKED_MAP_MAGIC;
+	header.version = BAKED_MAP_VERSION;
+	header.width = data.width;
+	header.height = data.height;
+	header.tileWidth = data.tileWidth;
+	header.tileHeight = data.tileHeight;
+	header.type = data.type;
+
+	ListItem<TileSet*>* setItem;
+	for (setItem = data.tilesets.start; setItem != NULL; setItem = setItem->next)
+	{
+		TileSet* set = setItem->data;
+
+		BakedTileset record;
+		record.name = strings.WriteString(set->name.GetString());
+		record.image = strings.WriteString(set->image.GetString());
+		record.firstgid = set->firstgid;
+		record.margin = set->margin;
+		record.spacing = set->spacing;
+		record.tileWidth = set->tileWidth;
+		record.tileHeight = set->tileHeight;
+		record.texWidth = set->texWidth;
+		record.texHeight = set->texHeight;
+		record.numTilesWidth = set->numTilesWidth;
+		record.numTilesHeight = set->numTilesHeight;
+		record.tileCount = set->tileCount;
+		record.firstTile = tiles.size / sizeof(BakedTile);
+		record.tileRecords = 0;
+
+		for (int i = 0; i < set->tileCount; ++i)
+		{
+			if (set->tiles[i] == NULL) continue;
+
+			BakedTile tile;
+			tile.id = set->tiles[i]->id;
+			tile.properties = BakeProperties(set->tiles[i]->properties, strings, properties);
+			tiles.Write(&tile, sizeof(BakedTile));
+			++record.tileRecords;
+		}
+
+		tilesets.Write(&record, sizeof(BakedTileset));
+		++header.tilesetCount;
+	}
+
+	ListItem<MapLayer*>* layerItem;
+	for (layerItem = data.layers.start; layerItem != NULL; layerItem = layerItem->next)
+	{
+		MapLayer* layer = layerItem->data;
+
+		BakedLayer record;
+		record.name = strings.WriteString(layer->name.GetString());
+		record.width = layer->width;
+		record.height = layer->height;
+		record.parallax = layer->parallax;
+		record.properties = BakeProperties(layer->properties, strings, properties);
+		record.data = blob.Write(layer->data, layer->width * layer->height * sizeof(uint));
+
+		layers.Write(&record, sizeof(BakedLayer));
+		++header.layerCount;
+	}
+
+	header.tileDrawCount = tileDrawCount;
+	header.tileDrawTable = blob.Write(tileDrawTable, tileDrawCount * sizeof(TileDrawInfo));
+	header.colliderGridWidth = colliderGridWidth;
+	header.colliderGridHeight = colliderGridHeight;
+	header.colliderGrid = blob.Write(colliderGrid, colliderGridWidth * colliderGridHeight);
+	header.navigationGridWidth = navigationGridWidth;
+	header.navigationGridHeight = navigationGridHeight;
+	header.navigationGrid = blob.Write(navigationGrid, navigationGridWidth * navigationGridHeight);
+
+	header.strings = sizeof(BakedMapHeader);
+	header.properties = header.strings + strings.size;
+	header.tiles = header.properties + properties.size;
+	header.tilesets = header.tiles + tiles.size;
+	header.layers = header.tilesets + tilesets.size;
+	header.blob = header.layers + layers.size;
+	header.fileSize = header.blob + blob.size;
+
+	SDL_RWops* file = SDL_RWFromFile(path, "wb");
+	if (file == NULL)
+	{
+		LOG("Could not create baked map %s. SDL_Error: %s", path, SDL_GetError());
+		return false;
+	}
+
+	uint written = SDL_RWwrite(file, &header, 1, sizeof(BakedMapHeader));
+	written += SDL_RWwrite(file, strings.bytes, 1, strings.size);
+	written += SDL_RWwrite(file, properties.bytes, 1, properties.size);
+	written += SDL_RWwrite(file, tiles.bytes, 1, tiles.size);
+	written += SDL_RWwrite(file, tilesets.bytes, 1, tilesets.size);
+	written += SDL_RWwrite(file, layers.bytes, 1, layers.size);
+	written += SDL_RWwrite(file, blob.bytes, 1, blob.size);
+	SDL_RWclose(file);
+
+	if (written != header.fileSize)
+	{
+		LOG("Could not write baked map %s. SDL_Error: %s", path, SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+// Maps a baked map and points the layers and tables inside it, only tilesets and
+// properties are rebuilt since they hold textures and interned keys
+bool Map::LoadBaked(const char* path)
+{
+	if (bakedFile.Open(path) == false) return false;
+
+	if (IsBakedMapValid(bakedFile.data, bakedFile.size) == false)
+	{
+		LOG("Baked map %s is outdated or corrupted, loading the tmx instead", path);
+		bakedFile.Close();
+		return false;
+	}
+
+	const BakedMapHeader* header = (const BakedMapHeader*)bakedFile.data;
+
+	const char* strings = (const char*)(bakedFile.data + header->strings);
+	const BakedProperty* properties = (const BakedProperty*)(bakedFile.data + header->properties);
+	const BakedTile* tiles = (const BakedTile*)(bakedFile.data + header->tiles);
+	const BakedTileset* tilesets = (const BakedTileset*)(bakedFile.data + header->tilesets);
+	const BakedLayer* layers = (const BakedLayer*)(bakedFile.data + header->layers);
+	uchar* blob = bakedFile.data + header->blob;
+
+	SDL_AtomicSet(&itemsToParse, header->tilesetCount + header->layerCount);
+
+	data.width = header->width;
+	data.height = header->height;
+	data.tileWidth = header->tileWidth;
+	data.tileHeight = header->tileHeight;
+	data.type = (MapTypes)header->type;
+	data.infinite = false;
+
+	for (uint i = 0; i < header->tilesetCount; ++i)
+	{
+		const BakedTileset& record = tilesets[i];
+
+		TileSet* set = new TileSet();
+		set->name.Create(strings + record.name);
+		set->image.Create(strings + record.image);
+		set->firstgid = record.firstgid;
+		set->margin = record.margin;
+		set->spacing = record.spacing;
+		set->tileWidth = record.tileWidth;
+		set->tileHeight = record.tileHeight;
+		set->texWidth = record.texWidth;
+		set->texHeight = record.texHeight;
+		set->numTilesWidth = record.numTilesWidth;
+		set->numTilesHeight = record.numTilesHeight;
+		set->offsetX = 0;
+		set->offsetY = 0;
+		set->tileCount = record.tileCount;
+
+		DecodeTilesetImage(set);
+
+		set->tiles = new Tile*[set->tileCount];
+		memset(set->tiles, 0, set->tileCount * sizeof(Tile*));
+		for (uint t = record.firstTile; t < record.firstTile + record.tileRecords; ++t)
+		{
+			if (tiles[t].id < 0 || tiles[t].id >= set->tileCount) continue;
+
+			Tile* tile = new Tile;
+			tile->id = tiles[t].id;
+			LoadBakedProperties(tiles[t].properties, properties, strings, tile->properties);
+			set->tiles[tile->id] = tile;
+		}
+
+		data.tilesets.Add(set);
+		SDL_AtomicIncRef(&itemsParsed);
+	}
+
+	for (uint i = 0; i < header->layerCount; ++i)
+	{
+		const BakedLayer& record = layers[i];
+
+		MapLayer* layer = new MapLayer();
+		layer->name.Create(strings + record.name);
+		layer->width = record.width;
+		layer->height = record.height;
+		layer->parallax = record.parallax;
+		layer->data = (uint*)(blob + record.data);
+		layer->ownsData = false;
+		LoadBakedProperties(record.properties, properties, strings, layer->properties);
+
+		data.layers.Add(layer);
+		SDL_AtomicIncRef(&itemsParsed);
+	}
+
+	tileDrawTable = (TileDrawInfo*)(blob + header->tileDrawTable);
+	tileDrawCount = header->tileDrawCount;
+
+	colliderGridWidth = header->colliderGridWidth;
+	colliderGridHeight = header->colliderGridHeight;
+	colliderGrid = (colliderGridWidth > 0) ? blob + header->colliderGrid : NULL;
+	collisionLayer = GetLayer("Collisions");
+	metadataTileset = GetTileset("Metadata");
+
+	navigationGridWidth = header->navigationGridWidth;
+	navigationGridHeight = header->navigationGridHeight;
+	navigationGrid = (navigationGridWidth > 0) ? blob + header->navigationGrid : NULL;
+
+	// Edits of the navigation layer keep the grid up to date
+	ListItem<MapLayer*>* layer;
+	for (layer = data.layers.start; layer != NULL && navigationLayer == NULL; layer = layer->next)
+	{
+		if (layer->data->properties.GetProperty(navigationKey, 0) != 0) navigationLayer = layer->data;
+	}
+
+	return true;
+}
+
+//Load Tileset attributes
+bool Map::LoadTilesetDetails(pugi::xml_node& tilesetNode, TileSet* set)
+{
+	bool ret = true;
+	LOG("filling TilesetDetails");
+
+	set->name.Create(tilesetNode.attribute("name").as_string());
+	set->firstgid = tilesetNode.attribute("firstgid").as_int();
+	set->tileWidth = tilesetNode.attribute("tilewidth").as_int();
+	set->tileHeight = tilesetNode.attribute("tileheight").as_int();
+	set->spacing = tilesetNode.attribute("spacing").as_int();
+	set->margin = tilesetNode.attribute("margin").as_int();
+
+	return ret;
+}
+
+//Load Tileset image
+bool Map::LoadTilesetImage(pugi::xml_node& tilesetNode, TileSet* set)
+{
+	bool ret = true;
+	pugi::xml_node image = tilesetNode.child("image");
+
+	if (image == NULL)
+	{
+		LOG("Error parsing tileset xml file: Cannot find 'image' tag.");
+		ret = false;
+	}
+	else
+	{
+
+		//SString path = folder.GetString();
+		//path += image.attribute("source").as_string();
+
+		set->image.Create(image.attribute("source").as_string());
+
+		// Baking only needs the layout of the tileset
+		if (bakeMode == false) DecodeTilesetImage(set);
+		set->texWidth = image.attribute("width").as_int();
+		set->texHeight = image.attribute("height").as_int();
+
+		set->numTilesWidth = set->texWidth / set->tileWidth;
+		set->numTilesHeight = set->texHeight / set->tileHeight;
+		set->offsetX = 0;
+		set->offsetY = 0;
+		set->tileCount = tilesetNode.attribute("tilecount").as_int(set->numTilesWidth * set->numTilesHeight);
+	}
+	return ret;
+}
+
+// Resolves the texture and rectangle of every gid so Draw does not have to search the tilesets
+void Map::BuildTileDrawTable()
+{
+	RELEASE_ARRAY(tileDrawTable);
+	tileDrawCount = 0;
+
+	ListItem<TileSet*>* item;
+	for (item = data.tilesets.start; item != NULL; item = item->next)
+	{
+		uint lastGid = item->data->firstgid + item->data->tileCount;
+		if (lastGid > tileDrawCount) tileDrawCount = lastGid;
+	}
+
+	tileDrawTable = new TileDrawInfo[tileDrawCount];
+	memset(tileDrawTable, 0, tileDrawCount * sizeof(TileDrawInfo));
+
+	// Tilesets are sorted by firstgid, same resolution as GetTilesetFromTileId
+	int index = 0;
+	for (item = data.tilesets.start; item != NULL; item = item->next, ++index)
+	{
+		TileSet* set = item->data;
+		for (int i = 0; i < set->tileCount; ++i)
+		{
+			uint gid = set->firstgid + i;
+			tileDrawTable[gid].tileset = index;
+			tileDrawTable[gid].rect = set->GetTileRect(gid);
+		}
+	}
+}
+
+// Decodes the tileset image, the texture is created from it on the main thread
+void Map::DecodeTilesetImage(TileSet* set)
+{
+	SString path("%s%s", folder.GetString(), set->image.GetString());
+	set->surface = IMG_Load(path.GetString());
+
+	if (set->surface == NULL) LOG("Could not load surface with path: %s. IMG_Load: %s", path.GetString(), IMG_GetError());
+}
+
+// Texture of each tileset by its position in the list, as referenced by the draw table
+void Map::CacheTilesetTextures()
+{
+	RELEASE_ARRAY(tilesetTextures);
+	tilesetTextures = new SDL_Texture*[MAX(data.tilesets.Count(), 1)];
+
+	int index = 0;
+	ListItem<TileSet*>* item;
+	for (item = data.tilesets.start; item != NULL; item = item->next) tilesetTextures[index++] = item->data->texture;
+}
+
+// Stores the "Collider" property of every cell of the Collisions layer so physics can read it directly
+void Map::BuildColliderGrid()
+{
+	RELEASE_ARRAY(colliderGrid);
+	colliderGridWidth = colliderGridHeight = 0;
+
+	collisionLayer = GetLayer("Collisions");
+	metadataTileset = GetTileset("Metadata");
+	if (collisionLayer == NULL || metadataTileset == NULL)
+	{
+		LOG("Map has no Collisions layer or Metadata tileset, collision grid left empty");
+		return;
+	}
+
+	colliderGridWidth = collisionLayer->width;
+	colliderGridHeight = collisionLayer->height;
+
+	// Infinite layers resolve their colliders per chunk when paged in
+	if (collisionLayer->IsStreamed()) return;
+
+	// Resolve each Metadata tile once instead of once per cell
+	uchar* typeById = new uchar[metadataTileset->tileCount];
+	for (int i = 0; i < metadataTileset->tileCount; ++i) typeById[i] = ResolveColliderType(metadataTileset->firstgid + i);
+
+	colliderGrid = new uchar[colliderGridWidth * colliderGridHeight];
+
+	for (int i = 0; i < colliderGridWidth * colliderGridHeight; ++i)
+	{
+		int id = (int)collisionLayer->data[i] - metadataTileset->firstgid;
+		colliderGrid[i] = (id >= 0 && id < metadataTileset->tileCount) ? typeById[id] : ResolveColliderType(collisionLayer->data[i]);
+	}
+
+	RELEASE_ARRAY(typeById);
+}
+
+// Collider type of a gid of the Collisions layer, same lookup as GetTileProperty
+uchar Map::ResolveColliderType(uint gid) const
+{
+	int id = (int)gid - metadataTileset->firstgid;
+	if (id < 0) return (uchar)Collider::Type::AIR;
+
+	Tile* tile = metadataTileset->GetPropList(id);
+	return (tile != NULL) ? (uchar)tile->properties.GetProperty(colliderKey, 0) : (uchar)Collider::Type::AIR;
+}
+
+// Splits a layer in chunks, the drawable ones are baked by BakeDirtyChunks and the rest the first time they are drawn
+void Map::BuildChunks(MapLayer* layer)
+{
+	layer->ReleaseChunks();
+
+	// Infinite layers bake their resident stream chunks instead
+	if (layer->IsStreamed()) return;
+	layer->chunksWidth = (layer->width + chunkSize - 1) / chunkSize;
+	layer->chunksHeight = (layer->height + chunkSize - 1) / chunkSize;
+	layer->chunks = new MapChunk[layer->chunksWidth * layer->chunksHeight];
+
+	for (int i = 0; i < layer->chunksWidth * layer->chunksHeight; ++i)
+	{
+		layer->chunks[i].texture = NULL;
+		layer->chunks[i].dirty = true;
+		layer->chunks[i].empty = false;
+	}
+
+	if (layer->properties.GetProperty(drawableKey) == 1) chunksToBake += layer->chunksWidth * layer->chunksHeight;
+}
+
+// Renders all the tiles of a chunk into its texture
+void Map::BakeChunk(MapLayer* layer, int cx, int cy)
+{
+	MapChunk& chunk = layer->chunks[cy * layer->chunksWidth + cx];
+
+	int startX = cx * chunkSize;
+	int startY = cy * chunkSize;
+	int endX = MIN(startX + chunkSize, layer->width);
+	int endY = MIN(startY + chunkSize, layer->height);
+
+	chunk.dirty = false;
+	chunk.empty = (RenderTiles(layer, startX, startY, endX, endY, chunk.texture) == false);
+}
+
+// Renders the tiles of an area into texture, creating it the first time. Returns false if the area
+// has no tiles, texture is left NULL then or when there are no render targets
+bool Map::RenderTiles(MapLayer* layer, int startX, int startY, int endX, int endY, SDL_Texture*& texture)
+{
+	SDL_Renderer* renderer = app->render->renderer;
+
+	bool empty = true;
+	for (int y = startY; y < endY && empty; ++y)
+	{
+		for (int x = startX; x < endX; ++x)
+		{
+			uint tileId = layer->Get(x, y);
+			if (tileId > 0 && tileId < tileDrawCount)
+			{
+				empty = false;
+				break;
+			}
+		}
+	}
+
+	if (empty || SDL_RenderTargetSupported(renderer) == SDL_FALSE)
+	{
+		if (texture != NULL) SDL_DestroyTexture(texture);
+		texture = NULL;
+		return !empty;
+	}
+
+	if (texture == NULL)
+	{
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, (endX - startX) * data.tileWidth, (endY - startY) * data.tileHeight);
+		if (texture == NULL)
+		{
+			LOG("Could not create chunk texture, layer %s will be drawn tile by tile. SDL_Error: %s", layer->name.GetString(), SDL_GetError());
+			return true;
+		}
+		SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+	}
+
+	SDL_Texture* previousTarget = SDL_GetRenderTarget(renderer);
+	SDL_SetRenderTarget(renderer, texture);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+
+	SDL_Rect dest = { 0, 0, data.tileWidth, data.tileHeight };
+	for (int y = startY; y < endY; ++y)
+	{
+		dest.y = (y - startY) * data.tileHeight;
+		for (int x = startX; x < endX; ++x)
+		{
+			uint tileId = layer->Get(x, y);
+			if (tileId > 0 && tileId < tileDrawCount)
+			{
+				dest.x = (x - startX) * data.tileWidth;
+				const TileDrawInfo& tile = tileDrawTable[tileId];
+				SDL_RenderCopy(renderer, tilesetTextures[tile.tileset], &tile.rect, &dest);
+			}
+		}
+	}
+
+	SDL_SetRenderTarget(renderer, previousTarget);
+	return true;
+}
+
+// Schedules the chunks containing a tile to be baked again in every layer
+void Map::InvalidateChunks(int x, int y)
+{
+	ListItem<MapLayer*>* item;
+	for (item = data.layers.start; item != NULL; item = item->next)
+	{
+		MapLayer* layer = item->data;
+		if (layer->chunks == NULL || x < 0 || y < 0 || x >= layer->width || y >= layer->height) continue;
+
+		layer->chunks[(y / chunkSize) * layer->chunksWidth + (x / chunkSize)].dirty = true;
+	}
+}
+
+void Map::SetTileId(MapLayer* layer, int x, int y, uint gid)
+{
+	if (layer == NULL || x < 0 || y < 0 || x >= layer->width || y >= layer->height) return;
+
+	if (layer->IsStreamed())
+	{
+		MapStreamChunk* chunk = layer->GetStreamChunk(x, y);
+		if (chunk == NULL) return;
+
+		PageIn(layer, chunk);
+		int i = (y - chunk->y) * chunk->width + (x - chunk->x);
+		chunk->gids[i] = gid;
+		if (chunk->colliders != NULL) chunk->colliders[i] = ResolveColliderType(gid);
+		if (chunk->walkability != NULL)
+		{
+			chunk->walkability[i] = ResolveWalkability(gid);
+			navigationWindowDirty = true;
+		}
+		chunk->modified = true;
+		chunk->textureDirty = true;
+		return;
+	}
+
+	layer->data[(y * layer->width) + x] = gid;
+	if (layer == collisionLayer && colliderGrid != NULL) colliderGrid[(y * colliderGridWidth) + x] = ResolveColliderType(gid);
+	if (layer == navigationLayer && navigationGrid != NULL)
+	{
+		navigationGrid[(y * navigationGridWidth) + x] = ResolveWalkability(gid);
+		app->pathfinding->SetTileWalkability(iPoint(x, y), navigationGrid[(y * navigationGridWidth) + x]);
+	}
+	if (layer->chunks != NULL) layer->chunks[(y / chunkSize) * layer->chunksWidth + (x / chunkSize)].dirty = true;
+}
+
+MapLayer* Map::GetLayer(const char* name) const
+{
+	ListItem<MapLayer*>* item;
+	for (item = data.layers.start; item != NULL; item = item->next)
+	{
+		if (item->data->name == name) return item->data;
+	}
+	return NULL;
+}
+
+TileSet* Map::GetTileset(const char* name) const
+{
+	ListItem<TileSet*>* item;
+	for (item = data.tilesets.start; item != NULL; item = item->next)
+	{
+		if (item->data->name == name) return item->data;
+	}
+	return NULL;
+}
+
+bool Map::LoadTilesetProperties(pugi::xml_node& node, TileSet* set)
+{
+	bool ret = true;
+
+	set->tiles = new Tile*[set->tileCount];
+	memset(set->tiles, 0, set->tileCount * sizeof(Tile*));
+
+	for (pugi::xml_node tileNode = node.child("tile"); tileNode && ret; tileNode = tileNode.next_sibling("tile"))
+	{
+		int id = tileNode.attribute("id").as_int();
+		if (id < 0 || id >= set->tileCount || set->tiles[id] != NULL)
+		{
+			LOG("Ignoring properties of tile %d in tileset %s", id, set->name.GetString());
+			continue;
+		}
+
+		Tile* tileProperties = new Tile;
+		tileProperties->id = id;
+
+		ret = LoadProperties(tileNode.child("properties"), tileProperties->properties);
+		set->tiles[id] = tileProperties;
+	}
+	return ret;
+}
+
+bool Map::StoreId(pugi::xml_node& node, MapLayer* layer, int index)
+{
+	bool ret = true;
+
+	layer->data[index] = node.attribute("gid").as_uint(0);
+
+	return ret;
+}
+
+//Create the definition for a function that loads a single layer
+bool Map::LoadLayer(pugi::xml_node& node, MapLayer* layer)
+{
+	bool ret = true;
+
+	//Load a single layer
+	layer->name.Create(node.attribute("name").as_string());
+	layer->width = node.attribute("width").as_int();
+	layer->height = node.attribute("height").as_int();
+	layer->parallax = node.attribute("parallaxx").as_float(1.0f);
+
+	pugi::xml_node layerData = node.child("data");
+
+	if (layerData == NULL)
+	{
+		LOG("Error loading node child data, inside LoadLayer");
+		ret = false;
+	}
+	else if (data.infinite || layerData.child("chunk"))
+	{
+		ret = LoadStreamChunks(layerData, layerData.attribute("encoding").as_string(), layerData.attribute("compression").as_string(), layer);
+	}
+	else
+	{
+		layer->data = new uint[layer->width * layer->height];
+		memset(layer->data, 0, layer->width * layer->height * sizeof(uint));
+
+		const char* encoding = layerData.attribute("encoding").as_string();
+
+		if (strcmp(encoding, "csv") == 0)
+		{
+			ret = DecodeCsv(layerData.child_value(), layer);
+		}
+		else if (strcmp(encoding, "base64") == 0)
+		{
+			ret = DecodeBase64(layerData.child_value(), layerData.attribute("compression").as_string(), layer);
+		}
+		else if (encoding[0] == '\0')
+		{
+			pugi::xml_node gidNode;
+
+			int i = 0;
+			for (gidNode = layerData.child("tile"); gidNode && ret && i < layer->width * layer->height; gidNode = gidNode.next_sibling("tile"))
+			{
+				if (ret == true) ret = StoreId(gidNode, layer, i);
+				++i;
+			}
+			LOG("Layer <<%s>> has loaded %d tiles", layer->name.GetString(), i);
+		}
+		else
+		{
+			LOG("Layer <<%s>> uses unknown encoding %s", layer->name.GetString(), encoding);
+			ret = false;
+		}
+	}
+	if (ret == true) ret = LoadProperties(node.child("properties"), layer->properties);
+	return ret;
+}
+
+// Reads up to count comma separated gids, returns how many were read
+static int ParseCsv(const char* text, uint* gids, int count)
+{
+	int i = 0;
+
+	while (*text != '\0' && i < count)
+	{
+		if (*text < '0' || *text > '9')
+		{
+			++text;
+			continue;
+		}
+
+		char* end = NULL;
+		gids[i++] = (uint)strtoul(text, &end, 10);
+		text = end;
+	}
+	return i;
+}
+
+// Layer data stored as comma separated gids
+bool Map::DecodeCsv(const char* text, MapLayer* layer)
+{
+	int count = layer->width * layer->height;
+	int i = ParseCsv(text, layer->data, count);
+
+	if (i != count) LOG("Layer <<%s>> csv data has %d tiles, expected %d", layer->name.GetString(), i, count);
+	return i == count;
+}
+
+// Value of a base64 digit, -1 for characters outside the alphabet
+static int Base64Value(char c)
+{
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+// Decodes base64 text into dst, whitespace is skipped. Returns the number of bytes or -1 if they do not fit
+static int Base64Decode(const char* text, uchar* dst, uint dstSize)
+{
+	uint written = 0;
+	uint accumulator = 0;
+	int bits = 0;
+
+	for (; *text != '\0' && *text != '='; ++text)
+	{
+		int value = Base64Value(*text);
+		if (value < 0) continue;
+
+		accumulator = (accumulator << 6) | (uint)value;
+		bits += 6;
+		if (bits >= 8)
+		{
+			bits -= 8;
+			if (written == dstSize) return -1;
+			dst[written++] = (uchar)(accumulator >> bits);
+		}
+	}
+	return (int)written;
+}
+
+// Layer data stored as little endian gids in base64, optionally zlib or gzip compressed.
+// Gids are decoded straight into the layer data
+bool Map::DecodeBase64(const char* text, const char* compression, MapLayer* layer)
+{
+	uint size = layer->width * layer->height * sizeof(uint);
+	uchar* gids = (uchar*)layer->data;
+	int decoded = -1;
+
+	if (compression[0] == '\0')
+	{
+		decoded = Base64Decode(text, gids, size);
+	}
+	else if (strcmp(compression, "zlib") == 0 || strcmp(compression, "gzip") == 0)
+	{
+		uint textLength = strlen(text);
+		uchar* compressed = new uchar[textLength * 3 / 4 + 1];
+		int compressedSize = Base64Decode(text, compressed, textLength * 3 / 4 + 1);
+
+		if (compressedSize > 0)
+		{
+			if (compression[0] == 'z') decoded = ZlibDecompress(compressed, compressedSize, gids, size);
+			else decoded = GzipDecompress(compressed, compressedSize, gids, size);
+		}
+		RELEASE_ARRAY(compressed);
+	}
+	else
+	{
+		LOG("Layer <<%s>> uses unsupported compression %s", layer->name.GetString(), compression);
+		return false;
+	}
+
+	if (decoded != (int)size)
+	{
+		LOG("Layer <<%s>> base64 data is corrupted or has the wrong size", layer->name.GetString());
+		return false;
+	}
+
+	for (int i = 0; i < layer->width * layer->height; ++i) layer->data[i] = SDL_SwapLE32(layer->data[i]);
+
+	LOG("Layer <<%s>> has loaded %d tiles", layer->name.GetString(), layer->width * layer->height);
+	return true;
+}
+
+// Encoding of a layer data element, false if it can not be streamed
+static bool GetChunkEncoding(const char* encoding, const char* compression, MapChunkEncoding& ret)
+{
+	if (strcmp(encoding, "csv") == 0) ret = CHUNK_CSV;
+	else if (strcmp(encoding, "base64") != 0) return false;
+	else if (compression[0] == '\0') ret = CHUNK_RAW;
+	else if (strcmp(compression, "zlib") == 0) ret = CHUNK_ZLIB;
+	else if (strcmp(compression, "gzip") == 0) ret = CHUNK_GZIP;
+	else return false;
+
+	return true;
+}
+
+// Turns the little endian bytes of a chunk, raw or compressed, into exactly count gids
+static bool DecodeGids(const uchar* bytes, uint size, MapChunkEncoding encoding, uint* gids, int count)
+{
+	uint gidsSize = count * sizeof(uint);
+	int decoded = -1;
+
+	switch (encoding)
+	{
+	case CHUNK_RAW:
+		if (size == gidsSize)
+		{
+			memcpy(gids, bytes, size);
+			decoded = (int)size;
+		}
+		break;
+	case CHUNK_ZLIB:
+		decoded = ZlibDecompress(bytes, size, (uchar*)gids, gidsSize);
+		break;
+	case CHUNK_GZIP:
+		decoded = GzipDecompress(bytes, size, (uchar*)gids, gidsSize);
+		break;
+	default:
+		break;
+	}
+
+	if (decoded != (int)gidsSize) return false;
+
+	for (int i = 0; i < count; ++i) gids[i] = SDL_SwapLE32(gids[i]);
+	return true;
+}
+
+// Decodes the text of a chunk element, csv or base64 with its compression
+static bool DecodeChunkText(const char* text, uint length, MapChunkEncoding encoding, uint* gids, int count)
+{
+	if (encoding == CHUNK_CSV) return ParseCsv(text, gids, count) == count;
+
+	uchar* bytes = new uchar[length * 3 / 4 + 1];
+	int size = Base64Decode(text, bytes, length * 3 / 4 + 1);
+	bool ret = (size > 0) && DecodeGids(bytes, (uint)size, encoding, gids, count);
+	RELEASE_ARRAY(bytes);
+
+	return ret;
+}
+
+// Reads the text of a chunk element back from the tmx, NULL if it can not be read
+static char* ReadChunkText(SDL_RWops* file, const MapStreamChunk* chunk)
+{
+	if (file == NULL || SDL_RWseek(file, chunk->fileOffset, RW_SEEK_SET) < 0) return NULL;
+
+	char* text = new char[chunk->fileSize + 1];
+	if (SDL_RWread(file, text, 1, chunk->fileSize) != chunk->fileSize)
+	{
+		RELEASE_ARRAY(text);
+		return NULL;
+	}
+	text[chunk->fileSize] = '\0';
+
+	return text;
+}
+
+// Records where the text of every chunk of an infinite layer is in the tmx, they are read back
+// and decoded when paged in. Without the file to read from base64 chunks are kept decoded and
+// csv ones as text
+bool Map::LoadStreamChunks(pugi::xml_node& dataNode, const char* encoding, const char* compression, MapLayer* layer)
+{
+	MapChunkEncoding chunkEncoding;
+	if (GetChunkEncoding(encoding, compression, chunkEncoding) == false)
+	{
+		LOG("Layer <<%s>> uses encoding '%s' and compression '%s', infinite layers need csv or base64", layer->name.GetString(), encoding, compression);
+		return false;
+	}
+
+	for (pugi::xml_node chunkNode = dataNode.child("chunk"); chunkNode; chunkNode = chunkNode.next_sibling("chunk"))
+	{
+		MapStreamChunk* chunk = new MapStreamChunk();
+		chunk->x = chunkNode.attribute("x").as_int();
+		chunk->y = chunkNode.attribute("y").as_int();
+		chunk->width = chunkNode.attribute("width").as_int();
+		chunk->height = chunkNode.attribute("height").as_int();
+		chunk->encoding = chunkEncoding;
+
+		const char* text = chunkNode.child_value();
+		uint textLength = strlen(text);
+		ptrdiff_t offset = chunkNode.first_child().offset_debug();
+
+		if (streamFile != NULL && offset >= 0)
+		{
+			chunk->fileOffset = (uint)offset;
+			chunk->fileSize = textLength;
+		}
+		else if (chunkEncoding == CHUNK_CSV)
+		{
+			chunk->payloadSize = textLength + 1;
+			chunk->payload = new uchar[chunk->payloadSize];
+			memcpy(chunk->payload, text, chunk->payloadSize);
+		}
+		else
+		{
+			chunk->payload = new uchar[textLength * 3 / 4 + 1];
+			int size = Base64Decode(text, chunk->payload, textLength * 3 / 4 + 1);
+			chunk->payloadSize = (size > 0) ? (uint)size : 0;
+		}
+
+		layer->streamed.PushBack(chunk);
 	}
-	data.layers.Clear();
-
-	// Clean up the pugui tree
-	mapFile.reset();
 
+	LOG("Layer <<%s>> has %u chunks to stream from %s", layer->name.GetString(), layer->streamed.Count(), (streamFile != NULL) ? "the tmx" : "memory");
 	return true;
 }
 
-// Load new map
-bool Map::Load(const char* filename)
+// Places the chunks of the infinite layers on grids. The map is moved so its
+// top left chunk starts at tile 0,0 and every layer covers the whole map
+void Map::BuildStreamGrids()
 {
-	bool ret = true;
-	SString tmp("%s%s", folder.GetString(), filename);
+	iPoint min(INT_MAX, INT_MAX);
+	iPoint max(INT_MIN, INT_MIN);
+	int chunkWidth = 0;
+	int chunkHeight = 0;
+
+	ListItem<MapLayer*>* item;
+	for (item = data.layers.start; item != NULL; item = item->next)
+	{
+		for (uint i = 0; i < item->data->streamed.Count(); ++i)
+		{
+			const MapStreamChunk* chunk = item->data->streamed[i];
+			min.x = MIN(min.x, chunk->x);
+			min.y = MIN(min.y, chunk->y);
+			max.x = MAX(max.x, chunk->x + chunk->width);
+			max.y = MAX(max.y, chunk->y + chunk->height);
 
-	pugi::xml_parse_result result = mapFile.load_file(tmp.GetString());
+			if (chunkWidth == 0)
+			{
+				chunkWidth = chunk->width;
+				chunkHeight = chunk->height;
+			}
+		}
+	}
 
-	if(result == NULL)
+	if (chunkWidth <= 0 || chunkHeight <= 0)
 	{
-		LOG("Could not load map xml file %s. pugi error: %s", filename, result.description());
-		ret = false;
+		LOG("Infinite map has no chunks");
+		data.width = data.height = 0;
+		return;
 	}
 
-	if(ret == true)
+	data.width = max.x - min.x;
+	data.height = max.y - min.y;
+	LOG("Infinite map is %dx%d tiles, origin moved by %d,%d", data.width, data.height, -min.x, -min.y);
+
+	for (item = data.layers.start; item != NULL; item = item->next)
 	{
-		ret = LoadMap();
-		pugi::xml_node tileset;
-		for (tileset = mapFile.child("map").child("tileset"); tileset && ret; tileset = tileset.next_sibling("tileset"))
+		MapLayer* layer = item->data;
+		layer->width = data.width;
+		layer->height = data.height;
+		layer->streamChunkWidth = chunkWidth;
+		layer->streamChunkHeight = chunkHeight;
+		layer->streamWidth = (data.width + chunkWidth - 1) / chunkWidth;
+		layer->streamHeight = (data.height + chunkHeight - 1) / chunkHeight;
+		layer->streamGrid = new MapStreamChunk*[layer->streamWidth * layer->streamHeight];
+		memset(layer->streamGrid, 0, layer->streamWidth * layer->streamHeight * sizeof(MapStreamChunk*));
+
+		for (uint i = 0; i < layer->streamed.Count(); ++i)
 		{
-			TileSet* set = new TileSet();
-			if (ret == true) ret = LoadTilesetDetails(tileset, set);
-			if (ret == true) ret = LoadTilesetImage(tileset, set);
-			ret = LoadTilesetProperties(tileset, set);
-			data.tilesets.Add(set);
+			MapStreamChunk* chunk = layer->streamed[i];
+			chunk->x -= min.x;
+			chunk->y -= min.y;
+
+			// Tiled writes every chunk with the same size and aligned to it
+			if (chunk->width != chunkWidth || chunk->height != chunkHeight || chunk->x % chunkWidth != 0 || chunk->y % chunkHeight != 0)
+			{
+				LOG("Ignoring chunk %d,%d of layer <<%s>>, it is not aligned to the chunk grid", chunk->x, chunk->y, layer->name.GetString());
+				continue;
+			}
+			layer->streamGrid[(chunk->y / chunkHeight) * layer->streamWidth + (chunk->x / chunkWidth)] = chunk;
 		}
+	}
+}
 
-		//Iterate all layers and load each of them
+// Pages in the chunks around the camera and evicts the least recently used ones over the budget
+void Map::UpdateStreaming()
+{
+	++streamFrame;
+
+	ListItem<MapLayer*>* item;
+	for (item = data.layers.start; item != NULL; item = item->next)
+	{
+		MapLayer* layer = item->data;
+		if (layer->IsStreamed() == false) continue;
+
+		iPoint min, max;
+		GetVisibleTileRange(layer, min, max);
+		if (min.x > max.x || min.y > max.y) continue;
 
-		for (pugi::xml_node layer = mapFile.child("map").child("layer"); layer && ret; layer = layer.next_sibling("layer"))
+		int startX = MAX(min.x / layer->streamChunkWidth - streamRadius, 0);
+		int startY = MAX(min.y / layer->streamChunkHeight - streamRadius, 0);
+		int endX = MIN(max.x / layer->streamChunkWidth + streamRadius, layer->streamWidth - 1);
+		int endY = MIN(max.y / layer->streamChunkHeight + streamRadius, layer->streamHeight - 1);
+
+		for (int cy = startY; cy <= endY; ++cy)
 		{
-			MapLayer* lay = new MapLayer();
-							
-			ret = LoadLayer(layer, lay);
-			if (ret == true) data.layers.Add(lay);
+			for (int cx = startX; cx <= endX; ++cx)
+			{
+				MapStreamChunk* chunk = layer->streamGrid[cy * layer->streamWidth + cx];
+				if (chunk != NULL) PageIn(layer, chunk);
+			}
 		}
-		LogInfo();
 	}
 
-	mapLoaded = ret;
+	// Chunks used this frame and chunks edited at runtime are never evicted
+	while (residentChunks.Count() > (uint)streamBudget)
+	{
+		int lru = -1;
+		for (uint i = 0; i < residentChunks.Count(); ++i)
+		{
+			const MapStreamChunk* chunk = residentChunks[i];
+			if (chunk->modified || chunk->lastUsed == streamFrame) continue;
+			if (lru < 0 || chunk->lastUsed < residentChunks[lru]->lastUsed) lru = i;
+		}
+		if (lru < 0) break;
 
-	return ret;
-}
+		Evict(residentChunks[lru]);
 
-//Load map general properties
-bool Map::LoadMap()
-{
-	bool ret = true;
-	pugi::xml_node map = mapFile.child("map");
-	if (map == NULL)
-	{
-		LOG("Error parsing map xml file: Cannot find 'map' tag.");
-		ret = false;
+		MapStreamChunk* last = NULL;
+		residentChunks.Pop(last);
+		if ((uint)lru < residentChunks.Count()) residentChunks[lru] = last;
 	}
-	else
+
+	if (navigationWindowDirty)
 	{
-		data.height = map.attribute("height").as_int();
-		data.width = map.attribute("width").as_int();
-		SString type(map.attribute("orientation").as_string());
-		data.type = StrToMapType(type);
-		data.tileHeight = map.attribute("tileheight").as_int();
-		data.tileWidth = map.attribute("tilewidth").as_int();
+		navigationWindowDirty = false;
+
+		iPoint origin;
+		int w, h;
+		uchar* buffer = NULL;
+		if (CreateWalkabilityWindow(origin, &w, &h, &buffer)) app->pathfinding->UpdateMap(w, h, buffer, origin);
+
+		RELEASE_ARRAY(buffer);
 	}
-	return ret;
 }
 
-//Load Tileset attributes
-bool Map::LoadTilesetDetails(pugi::xml_node& tilesetNode, TileSet* set)
+// Decodes a chunk if it was evicted and marks it as used this frame
+MapStreamChunk* Map::PageIn(MapLayer* layer, MapStreamChunk* chunk) const
 {
-	bool ret = true;
-	LOG("filling TilesetDetails");
-
-	set->name.Create(tilesetNode.attribute("name").as_string());
-	set->firstgid = tilesetNode.attribute("firstgid").as_int();
-	set->tileWidth = tilesetNode.attribute("tilewidth").as_int();
-	set->tileHeight = tilesetNode.attribute("tileheight").as_int();
-	set->spacing = tilesetNode.attribute("spacing").as_int();
-	set->margin = tilesetNode.attribute("margin").as_int();
+	chunk->lastUsed = streamFrame;
+	if (chunk->gids != NULL) return chunk;
 
-	return ret;
-}
+	int count = chunk->width * chunk->height;
+	chunk->gids = new uint[count];
 
-//Load Tileset image
-bool Map::LoadTilesetImage(pugi::xml_node& tilesetNode, TileSet* set)
-{
-	bool ret = true;
-	pugi::xml_node image = tilesetNode.child("image");
+	bool decoded = false;
+	if (chunk->payload == NULL)
+	{
+		char* text = ReadChunkText(streamFile, chunk);
+		if (text != NULL) decoded = DecodeChunkText(text, chunk->fileSize, chunk->encoding, chunk->gids, count);
+		RELEASE_ARRAY(text);
+	}
+	else if (chunk->encoding == CHUNK_CSV) decoded = ParseCsv((const char*)chunk->payload, chunk->gids, count) == count;
+	else decoded = DecodeGids(chunk->payload, chunk->payloadSize, chunk->encoding, chunk->gids, count);
 
-	if (image == NULL)
+	if (decoded == false)
 	{
-		LOG("Error parsing tileset xml file: Cannot find 'image' tag.");
-		ret = false;
+		LOG("Chunk %d,%d of layer <<%s>> is corrupted, leaving it empty", chunk->x, chunk->y, layer->name.GetString());
+		memset(chunk->gids, 0, count * sizeof(uint));
 	}
-	else
+	chunk->textureDirty = true;
+
+	if (layer == collisionLayer)
 	{
+		chunk->colliders = new uchar[count];
+		for (int i = 0; i < count; ++i) chunk->colliders[i] = ResolveColliderType(chunk->gids[i]);
+	}
 
-		//SString path = folder.GetString();
-		//path += image.attribute("source").as_string();
+	if (layer == navigationLayer)
+	{
+		chunk->walkability = new uchar[count];
+		for (int i = 0; i < count; ++i) chunk->walkability[i] = ResolveWalkability(chunk->gids[i]);
+		navigationWindowDirty = true;
+	}
 
-		SString path("%s%s", folder.GetString(), image.attribute("source").as_string());
+	residentChunks.PushBack(chunk);
+	return chunk;
+}
 
-		set->texture = app->tex->Load(path.GetString());
-		set->texWidth = image.attribute("width").as_int();
-		set->texHeight = image.attribute("height").as_int();
+// Drops the decoded data and texture of a chunk, it is read again when paged in
+void Map::Evict(MapStreamChunk* chunk)
+{
+	if (chunk->walkability != NULL) navigationWindowDirty = true;
 
-		set->numTilesWidth = set->texWidth / set->tileWidth;
-		set->numTilesHeight = set->texHeight / set->tileHeight;
-		set->offsetX = 0;
-		set->offsetY = 0;
-	}
-	return ret;
+	RELEASE_ARRAY(chunk->gids);
+	RELEASE_ARRAY(chunk->colliders);
+	RELEASE_ARRAY(chunk->walkability);
+	if (chunk->texture != NULL) SDL_DestroyTexture(chunk->texture);
+	chunk->texture = NULL;
 }
 
-bool Map::LoadTilesetProperties(pugi::xml_node& node, TileSet* set)
+// Draws the visible chunks of an infinite layer from their textures, paging in and baking the ones that are not resident yet
+void Map::DrawStreamedTiles(MapLayer* layer, const iPoint& min, const iPoint& max)
 {
-	bool ret = true;
-	for (pugi::xml_node tileNode = node.child("tile"); tileNode && ret; tileNode = tileNode.next_sibling("tile"))
+	for (int cy = min.y / layer->streamChunkHeight; cy <= max.y / layer->streamChunkHeight; ++cy)
 	{
-		Tile* tileProperties = new Tile;
-		tileProperties->id = tileNode.attribute("id").as_int();
+		for (int cx = min.x / layer->streamChunkWidth; cx <= max.x / layer->streamChunkWidth; ++cx)
+		{
+			MapStreamChunk* chunk = layer->streamGrid[cy * layer->streamWidth + cx];
+			if (chunk == NULL) continue;
 
-		ret = LoadProperties(tileNode.child("properties"), tileProperties->properties);
-		set->tilesetPropList.Add(tileProperties);
+			PageIn(layer, chunk);
+			if (chunk->textureDirty)
+			{
+				chunk->textureDirty = false;
+				chunk->empty = (RenderTiles(layer, chunk->x, chunk->y, chunk->x + chunk->width, chunk->y + chunk->height, chunk->texture) == false);
+			}
+			if (chunk->empty) continue;
+
+			if (chunk->texture != NULL)
+			{
+				iPoint pos = MapToWorld(chunk->x, chunk->y);
+				app->render->DrawTexture(chunk->texture, pos.x, pos.y, NULL, false, layer->parallax);
+				continue;
+			}
+
+			// No render target available, draw the visible part of the chunk tile by tile
+
+			int startX = MAX(min.x, chunk->x);
+			int startY = MAX(min.y, chunk->y);
+			int endX = MIN(max.x, chunk->x + chunk->width - 1);
+			int endY = MIN(max.y, chunk->y + chunk->height - 1);
+
+			for (int y = startY; y <= endY; ++y)
+			{
+				const uint* row = &chunk->gids[(y - chunk->y) * chunk->width];
+				for (int x = startX; x <= endX; ++x)
+				{
+					uint tileId = row[x - chunk->x];
+					if (tileId > 0 && tileId < tileDrawCount)
+					{
+						const TileDrawInfo& tile = tileDrawTable[tileId];
+						app->render->DrawTexture(tilesetTextures[tile.tileset], x * data.tileWidth, y * data.tileHeight, &tile.rect, false, layer->parallax);
+					}
+				}
+			}
+		}
 	}
-	return ret;
 }
 
-bool Map::StoreId(pugi::xml_node& node, MapLayer* layer, int index)
+Collider::Type Map::GetStreamedColliderType(int x, int y) const
 {
-	bool ret = true;
+	if (collisionLayer == NULL || collisionLayer->IsStreamed() == false) return Collider::Type::AIR;
 
-	layer->data[index] = node.attribute("gid").as_uint(0);
+	MapStreamChunk* chunk = collisionLayer->GetStreamChunk(x, y);
+	if (chunk == NULL) return Collider::Type::AIR;
 
-	return ret;
+	PageIn(collisionLayer, chunk);
+	return (Collider::Type)chunk->colliders[(y - chunk->y) * chunk->width + (x - chunk->x)];
 }
 
-//Create the definition for a function that loads a single layer
-bool Map::LoadLayer(pugi::xml_node& node, MapLayer* layer)
+bool Map::CreateWalkabilityWindow(iPoint& origin, int* width, int* height, uchar** buffer) const
 {
-	bool ret = true;
+	if (navigationLayer == NULL || navigationLayer->IsStreamed() == false) return false;
 
-	//Load a single layer
-	layer->name.Create(node.attribute("name").as_string());
-	layer->width = node.attribute("width").as_int();
-	layer->height = node.attribute("height").as_int();
-
-	pugi::xml_node layerData = node.child("data");
-
-	if (layerData == NULL)
+	// Bounding box, in chunks, of the resident navigation chunks
+	iPoint min(INT_MAX, INT_MAX);
+	iPoint max(INT_MIN, INT_MIN);
+	for (uint i = 0; i < residentChunks.Count(); ++i)
 	{
-		LOG("Error loading node child data, inside LoadLayer");
-		ret = false;
+		const MapStreamChunk* chunk = residentChunks[i];
+		if (chunk->walkability == NULL) continue;
+
+		min.x = MIN(min.x, chunk->x / navigationLayer->streamChunkWidth);
+		min.y = MIN(min.y, chunk->y / navigationLayer->streamChunkHeight);
+		max.x = MAX(max.x, chunk->x / navigationLayer->streamChunkWidth);
+		max.y = MAX(max.y, chunk->y / navigationLayer->streamChunkHeight);
 	}
-	else
-	{
-		layer->data = new uint[layer->width * layer->height];
-		memset(layer->data, 0, layer->width * layer->height * sizeof(uint));
-		pugi::xml_node gidNode;
+	if (min.x > max.x) return false;
+
+	int chunkW = navigationLayer->streamChunkWidth;
+	int chunkH = navigationLayer->streamChunkHeight;
+	int w = (max.x - min.x + 1) * chunkW;
+	int h = (max.y - min.y + 1) * chunkH;
+	uchar* map = new uchar[w * h];
 
-		int i = 0;
-		for (gidNode = node.child("data").child("tile"); gidNode && ret; gidNode = gidNode.next_sibling("tile"))
+	// Cells without a chunk are empty, cells of evicted chunks can not be walked until paged in
+	for (int cy = min.y; cy <= max.y; ++cy)
+	{
+		for (int cx = min.x; cx <= max.x; ++cx)
 		{
-			if (ret == true) ret = StoreId(gidNode, layer, i);
-			++i;
+			const MapStreamChunk* chunk = navigationLayer->streamGrid[cy * navigationLayer->streamWidth + cx];
+			for (int y = 0; y < chunkH; ++y)
+			{
+				uchar* row = &map[((cy - min.y) * chunkH + y) * w + (cx - min.x) * chunkW];
+				if (chunk == NULL) memset(row, 1, chunkW);
+				else if (chunk->walkability == NULL) memset(row, INVALID_WALK_CODE, chunkW);
+				else memcpy(row, &chunk->walkability[y * chunkW], chunkW);
+			}
 		}
-		LOG("Layer <<%s>> has loaded %d tiles", layer->name.GetString(), i);
 	}
-	ret = LoadProperties(node.child("properties"), layer->properties);
-	return ret;
+
+	origin.create(min.x * chunkW, min.y * chunkH);
+	*buffer = map;
+	*width = w;
+	*height = h;
+
+	return true;
 }
 
 bool Map::LoadProperties(pugi::xml_node& node, Properties& properties)
@@ -304,11 +1929,7 @@ bool Map::LoadProperties(pugi::xml_node& node, Properties& properties)
 	pugi::xml_node property;
 	for (property = node.child("property"); property; property = property.next_sibling("property"))
 	{
-		Properties::Property* prop = new Properties::Property();
-
-		prop->name = property.attribute("name").as_string();
-		prop->value = property.attribute("value").as_int();
-		properties.list.Add(prop);
+		properties.AddProperty(Properties::Intern(property.attribute("name").as_string()), property.attribute("value").as_int());
 	}
 	return ret;
 }
@@ -348,37 +1969,126 @@ TileSet* Map::GetTilesetFromTileId(int id) const
 	return set;
 }
 
-Tile* TileSet::GetPropList(int id) const {
-	ListItem<Tile*>* tile = tilesetPropList.start;
-	Tile* t = nullptr;
-	while (tile != NULL) {
-		t = tile->data;
-		if (t->id == id) {
-			return t;
+// Names of all the interned properties, the key is the position in the array. The loader
+// thread interns names while the main thread looks them up, so the table is behind a mutex.
+// Every name has its own allocation, GetName's pointers stay valid when the array grows
+struct PropertyNames
+{
+	PropertyNames() : mutex(SDL_CreateMutex()) {}
+	~PropertyNames()
+	{
+		for (uint i = 0; i < names.Count(); ++i) RELEASE(names[i]);
+		SDL_DestroyMutex(mutex);
+	}
+
+	int Find(const char* name) const
+	{
+		for (uint i = 0; i < names.Count(); ++i)
+		{
+			if (*names[i] == name) return (int)i;
 		}
-		tile = tile->next;
+		return -1;
+	}
+
+	DynArray<SString*> names;
+	SDL_mutex* mutex;
+};
+
+// Built on first use, which C++ makes thread safe
+static PropertyNames& GetPropertyNames()
+{
+	static PropertyNames table;
+	return table;
+}
+
+int Properties::Intern(const char* name)
+{
+	PropertyNames& table = GetPropertyNames();
+	SDL_LockMutex(table.mutex);
+
+	int key = table.Find(name);
+	if (key == -1)
+	{
+		table.names.PushBack(new SString(name));
+		key = (int)table.names.Count() - 1;
 	}
-	return t;
+
+	SDL_UnlockMutex(table.mutex);
+	return key;
 }
 
-int Properties::GetProperty(const char* value, int default) const
+const char* Properties::GetName(int key)
 {
-	
-	ListItem<Property*>* propertiesL;
-	propertiesL = list.start;
+	PropertyNames& table = GetPropertyNames();
+	SDL_LockMutex(table.mutex);
+	const char* name = (key >= 0 && key < (int)table.names.Count()) ? table.names[key]->GetString() : "";
+	SDL_UnlockMutex(table.mutex);
+	return name;
+}
+
+int Properties::FindKey(const char* name)
+{
+	PropertyNames& table = GetPropertyNames();
+	SDL_LockMutex(table.mutex);
+	int key = table.Find(name);
+	SDL_UnlockMutex(table.mutex);
+	return key;
+}
 
-	SString proppr = value;
+int Properties::LowerBound(int key) const
+{
+	int first = 0;
+	int last = (int)list.Count();
 
-	while (propertiesL != NULL)
+	while (first < last)
 	{
-		//LOG("Checking property: %s", P->data->name.GetString());         //<- checks the property
-		if (propertiesL->data->name == proppr)
-		{
-			return propertiesL->data->value;
-		}
-		propertiesL = propertiesL->next;
+		int middle = (first + last) / 2;
+		if (list.At(middle)->key < key) first = middle + 1;
+		else last = middle;
 	}
-	return default;
+	return first;
+}
+
+int Properties::GetProperty(int key, int defaultValue) const
+{
+	int i = LowerBound(key);
+	if (i < (int)list.Count() && list.At(i)->key == key)
+	{
+		return list.At(i)->value;
+	}
+	return defaultValue;
+}
+
+int Properties::GetProperty(const char* name, int defaultValue) const
+{
+	return GetProperty(FindKey(name), defaultValue);
+}
+
+void Properties::SetProperty(int key, int value)
+{
+	int i = LowerBound(key);
+	if (i < (int)list.Count() && list[i].key == key)
+	{
+		list[i].value = value;
+	}
+}
+
+void Properties::SetProperty(const char* name, int value)
+{
+	SetProperty(FindKey(name), value);
+}
+
+void Properties::AddProperty(int key, int value)
+{
+	int i = LowerBound(key);
+	if (i < (int)list.Count() && list[i].key == key)
+	{
+		list[i].value = value;
+		return;
+	}
+
+	Property property = { key, value };
+	list.Insert(property, i);
 }
 
 void Map::LogInfo()
@@ -428,28 +2138,27 @@ void Map::LogInfo()
 }
 
 
-void Properties::SetProperty(const char* name, int value)
+void Map::SetTileProperty(int x, int y, const char* property, int value, bool nonMovementCollision, bool isObject)
 {
-	ListItem<Property*>* property;
-	property = list.start;
-
-	SString prop = name;
-
-	while (property != NULL)
+	// Colliders are overridden per cell in the collision grid, the rest of tiles sharing the gid are not affected
+	if (!nonMovementCollision && !isObject && colliderGridWidth > 0 && strcmp(property, "Collider") == 0)
 	{
-		//LOG("Checking property: %s", P->data->name.GetString());
-		if (property->data->name == prop)
+		if (x < 0 || y < 0 || x >= colliderGridWidth || y >= colliderGridHeight) return;
+
+		if (colliderGrid != NULL) colliderGrid[(y * colliderGridWidth) + x] = (uchar)value;
+		else
 		{
-			property->data->value = value;
-			return;
+			MapStreamChunk* chunk = collisionLayer->GetStreamChunk(x, y);
+			if (chunk == NULL) return;
+
+			PageIn(collisionLayer, chunk);
+			chunk->colliders[(y - chunk->y) * chunk->width + (x - chunk->x)] = (uchar)value;
+			chunk->modified = true;
 		}
-		property = property->next;
+		InvalidateChunks(x, y);
+		return;
 	}
-}
 
-
-void Map::SetTileProperty(int x, int y, const char* property, int value, bool nonMovementCollision, bool isObject)
-{
 	// MapLayer
 	ListItem <MapLayer*>* mapLayer = data.layers.start;
 	SString layerName;
@@ -499,13 +2208,24 @@ void Map::SetTileProperty(int x, int y, const char* property, int value, bool no
 		return;
 	}
 	Tile* currentTile = tileSet->data->GetPropList(id);
+	if (currentTile == NULL)
+	{
+		return;
+	}
 	currentTile->properties.SetProperty(property, value);
+
+	InvalidateChunks(x, y);
 }
 
 
 
 int Map::GetTileProperty(int x, int y, const char* property, bool nonMovementCollision, bool isObject) const
 {
+	if (!nonMovementCollision && !isObject && colliderGridWidth > 0 && strcmp(property, "Collider") == 0)
+	{
+		return GetColliderType(x, y);
+	}
+
 	int ret;
 	// MapLayer
 	ListItem <MapLayer*>* mapLayer = data.layers.start;
@@ -557,7 +2277,7 @@ int Map::GetTileProperty(int x, int y, const char* property, bool nonMovementCol
 		return ret;
 	}
 	Tile* currentTile = tileSet->data->GetPropList(id);
-	ret = currentTile->properties.GetProperty(property, 0);
+	ret = (currentTile != NULL) ? currentTile->properties.GetProperty(property, 0) : 0;
 	return ret;
 }
 
@@ -566,18 +2286,39 @@ int Map::GetTileProperty(int x, int y, const char* property, bool nonMovementCol
 // Create walkability map for pathfinding
 bool Map::CreateWalkabilityMap(int* width, int* height, uchar** buffer) const
 {
-	bool ret = false;
-	ListItem<MapLayer*>* item;
-	item = data.layers.start;
+	if (navigationGrid == NULL) return false;
+
+	uchar* map = new uchar[navigationGridWidth * navigationGridHeight];
+	memcpy(map, navigationGrid, navigationGridWidth * navigationGridHeight);
+
+	*buffer = map;
+	*width = navigationGridWidth;
+	*height = navigationGridHeight;
+
+	return true;
+}
 
+// Walkability of the first layer flagged for navigation
+void Map::BuildNavigationGrid()
+{
+	RELEASE_ARRAY(navigationGrid);
+	navigationGridWidth = navigationGridHeight = 0;
+	navigationLayer = NULL;
+
+	ListItem<MapLayer*>* item;
 	for (item = data.layers.start; item != NULL; item = item->next)
 	{
 		MapLayer* layer = item->data;
 
-		if (layer->properties.GetProperty("Navigation", 0) == 0)
+		if (layer->properties.GetProperty(navigationKey, 0) == 0)
 		{
 			continue;
 		}
+		navigationLayer = layer;
+
+		// Infinite layers compute it per chunk and hand the resident window to the pathfinding module
+		if (layer->IsStreamed()) break;
+
 		uchar* map = new uchar[layer->width * layer->height];
 		memset(map, 1, layer->width * layer->height);
 
@@ -585,37 +2326,24 @@ bool Map::CreateWalkabilityMap(int* width, int* height, uchar** buffer) const
 		{
 			for (int x = 0; x < data.width; ++x)
 			{
-				int i = (y * layer->width) + x;
-
-				int tileId = layer->Get(x, y);
-				TileSet* tileset = (tileId > 0) ? GetTilesetFromTileId(tileId) : NULL;
-
-				if (tileset != NULL)
-				{
-					switch (tileId - tileset->firstgid)
-					{
-					case 0:
-						map[i] = (uchar)254;
-						break;
-					case 1:
-						map[i] = (uchar)0;
-						break;
-					default:
-						map[i] = (uchar)0;
-						break;
-					}
-					//map[i] = (tileId - tileset->firstgId) > 0 ? (uchar)0 : (uchar)1;
-				}
+				map[(y * layer->width) + x] = ResolveWalkability(layer->Get(x, y));
 			}
 		}
 
-		*buffer = map;
-		*width = data.width;
-		*height = data.height;
-		ret = true;
+		navigationGrid = map;
+		navigationGridWidth = data.width;
+		navigationGridHeight = data.height;
 
 		break;
 	}
-	return ret;
+}
+
+// Walkability code of a navigation tile: the first tile of a tileset is blocked (254), the rest 0 and empty cells 1
+uchar Map::ResolveWalkability(uint gid) const
+{
+	TileSet* tileset = (gid > 0) ? GetTilesetFromTileId(gid) : NULL;
+	if (tileset == NULL) return (uchar)1;
+
+	return (gid - tileset->firstgid == 0) ? (uchar)254 : (uchar)0;
 }
 
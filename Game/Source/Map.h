@@ -3,34 +3,56 @@
 
 #include "Module.h"
 #include "List.h"
+#include "DynArray.h"
 #include "Point.h"
+#include "Collisions.h"
+#include "BakedMap.h"
+#include "PerfTimer.h"
 
 #include "PugiXml\src\pugixml.hpp"
 
+#include "SDL/include/SDL.h"
+
+// Default size in tiles of the pre-rendered layer chunks
+#define MAP_CHUNK_SIZE 16
+
+// Default chunks kept resident around the camera in infinite maps, and how many may stay resident
+#define MAP_STREAM_RADIUS 1
+#define MAP_STREAM_BUDGET 96
+
+// Property names are interned to integer keys when the map is loaded,
+// each Properties keeps its values in a small array sorted by key
 struct Properties
 {
 	struct Property
 	{
-		SString name;
+		int key;
 		int value;
 	};
 
-	~Properties()
-	{
-		ListItem<Property*>* item;
-		item = list.start;
+	Properties() : list(2) {}
 
-		while (item != NULL)
-		{
-			RELEASE(item->data);
-			item = item->next;
-		}
-		list.Clear();
-	}
+	// Returns the key of a property name, registering it the first time. Safe from any thread
+	static int Intern(const char* name);
+
+	// Returns the key of a property name or -1 if it was never interned
+	static int FindKey(const char* name);
+
+	static const char* GetName(int key);
 
-	int GetProperty(const char* name, int default_value = 0) const;
+	int GetProperty(int key, int defaultValue = 0) const;
+	int GetProperty(const char* name, int defaultValue = 0) const;
+	void SetProperty(int key, int value);
 	void SetProperty(const char* name, int value);
-	List<Property*> list;
+
+	// Adds a property keeping the list sorted, or overwrites it if already present
+	void AddProperty(int key, int value);
+
+	DynArray<Property> list;
+
+private:
+	// Position of the key in the list, or where it should be inserted
+	int LowerBound(int key) const;
 };
 
 struct Tile
@@ -41,7 +63,19 @@ struct Tile
 
 struct TileSet
 {
+	TileSet() : texture(NULL), surface(NULL), tileCount(0), tiles(NULL) {}
+
+	~TileSet()
+	{
+		if (surface != NULL) SDL_FreeSurface(surface);
+		if (tiles == NULL) return;
+
+		for (int i = 0; i < tileCount; ++i) RELEASE(tiles[i]);
+		RELEASE_ARRAY(tiles);
+	}
+
 	SString	name;
+	SString image;
 	int	firstgid;
 	int margin;
 	int	spacing;
@@ -49,19 +83,33 @@ struct TileSet
 	int	tileHeight;
 
 	SDL_Texture* texture;
+
+	// Decoded image waiting to be uploaded as the texture
+	SDL_Surface* surface;
+
 	int	texWidth;
 	int	texHeight;
 	int	numTilesWidth;
 	int	numTilesHeight;
 	int	offsetX;
 	int	offsetY;
+	int	tileCount;
 
-	List<Tile*> tilesetPropList;
+	// Tiles with properties indexed by local id, NULL for tiles without them
+	Tile** tiles;
 
 	SDL_Rect GetTileRect(int id) const;
 
 	// function that gives id and returns its properties
-	Tile* GetPropList(int id) const;
+	inline Tile* GetPropList(int id) const { return (tiles != NULL && id >= 0 && id < tileCount) ? tiles[id] : NULL; }
+};
+
+// Tileset index and source rectangle of a gid, resolved once when the map is loaded.
+// Holds no pointers so baked maps can store the table as is
+struct TileDrawInfo
+{
+	int tileset;
+	SDL_Rect rect;
 };
 
 enum MapTypes
@@ -72,6 +120,71 @@ enum MapTypes
 	MAPTYPE_STAGGERED
 };
 
+// Block of a layer baked into a render target
+struct MapChunk
+{
+	SDL_Texture* texture;
+	bool dirty;
+	bool empty;
+};
+
+// How the payload of a stream chunk is stored
+enum MapChunkEncoding
+{
+	CHUNK_CSV,
+	CHUNK_RAW,
+	CHUNK_ZLIB,
+	CHUNK_GZIP
+};
+
+// Chunk of an infinite layer. Its tiles are read back from the tmx and decoded when the chunk
+// is paged in, and dropped again when it is evicted
+struct MapStreamChunk
+{
+	MapStreamChunk() : x(0), y(0), width(0), height(0), encoding(CHUNK_CSV), fileOffset(0), fileSize(0), payload(NULL), payloadSize(0),
+		gids(NULL), colliders(NULL), walkability(NULL), texture(NULL), textureDirty(false), empty(false), lastUsed(0), modified(false) {}
+
+	~MapStreamChunk()
+	{
+		RELEASE_ARRAY(payload);
+		RELEASE_ARRAY(gids);
+		RELEASE_ARRAY(colliders);
+		RELEASE_ARRAY(walkability);
+		if (texture != NULL) SDL_DestroyTexture(texture);
+	}
+
+	// First tile of the chunk, in map coordinates
+	int x;
+	int y;
+	int width;
+	int height;
+
+	// Text of the chunk element inside the tmx
+	MapChunkEncoding encoding;
+	uint fileOffset;
+	uint fileSize;
+
+	// Tiles as they come in the tmx, only kept when it can not be read back
+	uchar* payload;
+	uint payloadSize;
+
+	// Resident data, NULL while evicted. Colliders and walkability only in the collision and navigation layers
+	uint* gids;
+	uchar* colliders;
+	uchar* walkability;
+
+	// Render cache of the resident tiles, like the chunks of finite layers
+	SDL_Texture* texture;
+	bool textureDirty;
+	bool empty;
+
+	// Frame the chunk was last needed, for the LRU eviction
+	uint lastUsed;
+
+	// Edited at runtime, kept resident so the changes are not lost
+	bool modified;
+};
+
 struct MapLayer
 {
 	SString	name;
@@ -79,13 +192,68 @@ struct MapLayer
 	int height;
 	uint* data;
 
+	// False when data points inside a mapped baked map
+	bool ownsData;
+
+	// Camera scroll factor of the layer (Tiled "parallaxx"), 1.0f scrolls with the world
+	float parallax;
+
 	Properties properties;
 
-	MapLayer() : data(NULL) {}
+	// Render cache of the layer, chunksWidth * chunksHeight blocks
+	MapChunk* chunks;
+	int chunksWidth;
+	int chunksHeight;
+
+	// Infinite layers have no data, their tiles live in stream chunks placed on a grid of
+	// streamWidth * streamHeight cells of streamChunkWidth * streamChunkHeight tiles
+	DynArray<MapStreamChunk*> streamed;
+	MapStreamChunk** streamGrid;
+	int streamWidth;
+	int streamHeight;
+	int streamChunkWidth;
+	int streamChunkHeight;
+
+	MapLayer() : data(NULL), ownsData(true), parallax(1.0f), chunks(NULL), chunksWidth(0), chunksHeight(0),
+		streamed(0), streamGrid(NULL), streamWidth(0), streamHeight(0), streamChunkWidth(0), streamChunkHeight(0) {}
+
+	~MapLayer()
+	{
+		if (ownsData) RELEASE_ARRAY(data);
+		ReleaseChunks();
+
+		for (uint i = 0; i < streamed.Count(); ++i) RELEASE(streamed[i]);
+		RELEASE_ARRAY(streamGrid);
+	}
+
+	void ReleaseChunks()
+	{
+		if (chunks == NULL) return;
+
+		for (int i = 0; i < chunksWidth * chunksHeight; ++i)
+		{
+			if (chunks[i].texture != NULL) SDL_DestroyTexture(chunks[i].texture);
+		}
+		RELEASE_ARRAY(chunks);
+	}
 
-	~MapLayer() { RELEASE(data); }
+	inline bool IsStreamed() const { return data == NULL && streamGrid != NULL; }
 
-	inline uint Get(int x, int y) const { return data[(y * width) + x]; }
+	// Stream chunk holding a tile, NULL if the layer has no tiles there
+	inline MapStreamChunk* GetStreamChunk(int x, int y) const
+	{
+		return streamGrid[(y / streamChunkHeight) * streamWidth + (x / streamChunkWidth)];
+	}
+
+	// Gid of a tile, 0 for tiles of evicted chunks
+	inline uint Get(int x, int y) const
+	{
+		if (data != NULL) return data[(y * width) + x];
+
+		MapStreamChunk* chunk = (streamGrid != NULL) ? GetStreamChunk(x, y) : NULL;
+		if (chunk == NULL || chunk->gids == NULL) return 0;
+		return chunk->gids[(y - chunk->y) * chunk->width + (x - chunk->x)];
+	}
 };
 
 struct MapData
@@ -96,6 +264,10 @@ struct MapData
 	int	tileHeight;
 	SDL_Color backgroundColor;
 	MapTypes type;
+
+	// Tiled "infinite" maps, their layers are streamed around the camera
+	bool infinite;
+
 	List<TileSet*> tilesets;
 	List<MapLayer*> layers;
 };
@@ -113,35 +285,118 @@ public:
 	// Called before render is available
 	bool Awake(pugi::xml_node& conf);
 
+	// Called each loop iteration, finishes the asynchronous loads
+	bool Update(float dt);
+
 	// Called each loop iteration
 	void Draw();
 
 	// Called before quitting
 	bool CleanUp();
 
-	// Load new map
+	// Load new map, from its baked version when there is an up to date one
 	bool Load(const char* path);
 
+	// Starts loading a map on a worker thread. Parsing and image decoding run there,
+	// Update uploads the textures and bakes the chunks in slices of the loading budget.
+	// The map counts as loaded once pathfinding has built its walkability in the background
+	bool LoadAsync(const char* path);
+
+	inline bool IsLoading() const { return loadStage != LOAD_IDLE; }
+	inline bool IsLoaded() const { return mapLoaded; }
+
+	// The last LoadAsync ended without a map
+	inline bool LoadFailed() const { return loadFailed; }
+
+	// Progress of the current load from 0 to 1
+	float GetLoadProgress() const;
+
+	// Compiles a tmx map to the baked binary format
+	bool Bake(const char* path);
+
 	iPoint MapToWorld(int x, int y) const;
+
+	// Computes the first and last tile visible by the camera for a layer scrolling at the given speed
+	void GetVisibleTileRange(const MapLayer* layer, iPoint& min, iPoint& max) const;
 	MapTypes StrToMapType(SString s);
 
 	// Changes property to value assigned
 	void SetTileProperty(int x, int y, const char* property, int value, bool nonMovementCollision = false, bool isObject = false);
 
+	// Replaces the gid of a tile and schedules its chunk to be baked again
+	void SetTileId(MapLayer* layer, int x, int y, uint gid);
+
+	MapLayer* GetLayer(const char* name) const;
+	TileSet* GetTileset(const char* name) const;
+
 	// Gets the value of a property in a given tile
 	int GetTileProperty(int x, int y, const char* property, bool nonMovementCollision = false, bool isObject = false) const;
 
+	// Gets the collider type of a tile from the collision grid
+	inline Collider::Type GetColliderType(int x, int y) const
+	{
+		if (x < 0 || y < 0 || x >= colliderGridWidth || y >= colliderGridHeight) return Collider::Type::AIR;
+		if (colliderGrid == NULL) return GetStreamedColliderType(x, y);
+		return (Collider::Type)colliderGrid[(y * colliderGridWidth) + x];
+	}
+
+	// Walkability of the resident part of an infinite map, origin is its first tile
+	bool CreateWalkabilityWindow(iPoint& origin, int* width, int* height, uchar** buffer) const;
+
 
 	bool Map::CreateWalkabilityMap(int* width, int* height, uchar** buffer) const;
 
 private:
-	bool LoadMap();
+	enum LoadStage
+	{
+		LOAD_IDLE,
+		LOAD_PARSING,
+		LOAD_UPLOADING,
+		LOAD_BAKING,
+		LOAD_NAVIGATION
+	};
+
+	static int LoadThread(void* param);
+
+	// Everything that does not need the renderer, safe to run on the loading thread
+	bool LoadData(const char* path);
+
+	// Budgeted steps of the main thread part of a load, a budget of 0 runs them to the end.
+	// They return true once there is nothing left to do
+	bool UploadTilesets(const PerfTimer& slice, double budget);
+	bool BakeDirtyChunks(const PerfTimer& slice, double budget);
+
+	bool LoadMap(pugi::xml_node& mapNode);
+	bool LoadBaked(const char* path);
+	bool WriteBaked(const char* path) const;
 	bool LoadTilesetDetails(pugi::xml_node& tileset_node, TileSet* set);
 	bool LoadTilesetImage(pugi::xml_node& tileset_node, TileSet* set);
 	bool LoadTilesetProperties(pugi::xml_node& node, TileSet* set);
 	bool LoadProperties(pugi::xml_node& node, Properties& properties);
 	bool LoadLayer(pugi::xml_node& node, MapLayer* layer);
+	void BuildTileDrawTable();
+	void BuildColliderGrid();
+	void BuildNavigationGrid();
+	void CacheTilesetTextures();
+	void DecodeTilesetImage(TileSet* set);
+	uchar ResolveColliderType(uint gid) const;
+	void BuildChunks(MapLayer* layer);
+	void BakeChunk(MapLayer* layer, int cx, int cy);
+	bool RenderTiles(MapLayer* layer, int startX, int startY, int endX, int endY, SDL_Texture*& texture);
+	void InvalidateChunks(int x, int y);
+	void DrawTiles(const MapLayer* layer, const iPoint& min, const iPoint& max) const;
 	bool StoreId(pugi::xml_node& node, MapLayer* layer, int index);
+	bool DecodeCsv(const char* text, MapLayer* layer);
+	bool LoadStreamChunks(pugi::xml_node& dataNode, const char* encoding, const char* compression, MapLayer* layer);
+	void BuildStreamGrids();
+	void UpdateStreaming();
+	MapStreamChunk* PageIn(MapLayer* layer, MapStreamChunk* chunk) const;
+	void Evict(MapStreamChunk* chunk);
+	void DrawStreamedTiles(MapLayer* layer, const iPoint& min, const iPoint& max);
+	Collider::Type GetStreamedColliderType(int x, int y) const;
+	uchar ResolveWalkability(uint gid) const;
+	bool DecodeBase64(const char* text, const char* compression, MapLayer* layer);
+	uint GetMemoryUsage() const;
 	void LogInfo();
 
 	TileSet* GetTilesetFromTileId(int id) const;
@@ -150,9 +405,64 @@ public:
 	MapData data;
 
 private:
-	pugi::xml_document mapFile;
+	// Draw info of every gid, shared by all layers
+	TileDrawInfo* tileDrawTable;
+	uint tileDrawCount;
+	SDL_Texture** tilesetTextures;
+
+	// Collider type of every cell of the Collisions layer, built from the Metadata tileset
+	uchar* colliderGrid;
+	int colliderGridWidth;
+	int colliderGridHeight;
+	MapLayer* collisionLayer;
+	TileSet* metadataTileset;
+
+	// Walkability of the Navigation layer, copied to the pathfinding module
+	uchar* navigationGrid;
+	int navigationGridWidth;
+	int navigationGridHeight;
+	MapLayer* navigationLayer;
+
+	// Streaming of infinite maps. Lookups page chunks in, so this state changes in const methods
+	int streamRadius;
+	int streamBudget;
+	mutable uint streamFrame;
+	mutable DynArray<MapStreamChunk*> residentChunks;
+	mutable bool navigationWindowDirty;
+
+	// Tmx of the infinite map, open while it is loaded to read the chunks back
+	SDL_RWops* streamFile;
+
+	// Baked map the tables and layer data point into while it is loaded
+	MappedFile bakedFile;
+	bool bakeMode;
+
+	// Keys of the properties the map reads every frame
+	int drawableKey;
+	int colliderKey;
+	int navigationKey;
+
+	// Size in tiles of the layer render chunks
+	int chunkSize;
+
+	// Asynchronous load state, the atomics are written by the loading thread
+	SDL_Thread* loadThread;
+	LoadStage loadStage;
+	SString loadingFile;
+	PerfTimer loadTimer;
+	mutable SDL_atomic_t parseResult;
+	mutable SDL_atomic_t itemsToParse;
+	mutable SDL_atomic_t itemsParsed;
+	int tilesetsUploaded;
+	int chunksToBake;
+	int chunksBaked;
+
+	// Milliseconds per frame the main thread spends finishing a load
+	double loadBudget;
+
 	SString folder;
 	bool mapLoaded;
+	bool loadFailed;
 	bool loadAll;
 	
 };
@@ -1,27 +1,70 @@
 #include "App.h"
 #include "PathFinding.h"
 #include "Map.h"
+#include "PathHierarchy.h"
 #include "Render.h"
 #include "Textures.h"
+#include "Input.h"
+#include "PerfTimer.h"
 
 #include "Defs.h"
 #include "Log.h"
 
-PathFinding::PathFinding() : Module(), map(NULL), width(0), height(0)
+#include <limits.h>
+
+PathFinding::PathFinding() : Module(), walkability(NULL), mapVersion(1),
+	targetMap(NULL), targetWidth(0), targetHeight(0), targetOrigin(0, 0), targetDirty(false),
+	queuedBuild(NULL), finishedBuild(NULL), buildId(0), publishedId(0), levelBuildId(0), logSurfaces(false), builder(NULL), buildQueued(NULL),
+	clusterSize(PATH_CLUSTER_SIZE), jumpTables(true), defaultMode(PATH_MODE_HIERARCHICAL),
+	flowFields(), flowQueue(NULL), flowCapacity(0), flowRadius(FLOW_FIELD_RADIUS), groundMotionSet(false),
+	nextTicket(1), requestMutex(NULL), requestQueued(NULL), workerCount(PATH_WORKERS), quitWorkers(false),
+	sliceCount(PATH_SLICES), sliceExpansions(PATH_SLICE_EXPANSIONS), frameBudget(PATH_FRAME_BUDGET), slicedExpanded(0), frameExpanded(0)
 {
 	name.Create("pathfinding");
+
+	memset(&groundMotion, 0, sizeof(groundMotion));
+	memset(workers, 0, sizeof(workers));
+	memset(slicedRequests, 0, sizeof(slicedRequests));
+	SDL_AtomicSet(&workerExpanded, 0);
 }
 
 // Destructor
 PathFinding::~PathFinding()
 {
-	RELEASE_ARRAY(map);
+	CleanUp();
 }
 
 bool PathFinding::Awake(pugi::xml_node& config)
 {
 	LOG("Loading PathFinder");
 	bool ret = true;
+
+	flowRadius = config.child("flow").attribute("radius").as_int(FLOW_FIELD_RADIUS);
+	workerCount = config.child("workers").attribute("count").as_int(PATH_WORKERS);
+	if (workerCount < 0) workerCount = 0;
+	if (workerCount > MAX_PATH_WORKERS) workerCount = MAX_PATH_WORKERS;
+
+	// A single core gains nothing from workers, time slicing bounds the frame instead
+	if (SDL_GetCPUCount() <= 1) workerCount = 0;
+
+	clusterSize = config.child("hierarchy").attribute("cluster").as_int(PATH_CLUSTER_SIZE);
+	if (clusterSize < 0) clusterSize = 0;
+
+	pugi::xml_node search = config.child("search");
+	frameBudget = search.attribute("budget").as_int(PATH_FRAME_BUDGET);
+	sliceExpansions = search.attribute("slice").as_int(PATH_SLICE_EXPANSIONS);
+	sliceCount = search.attribute("concurrent").as_int(PATH_SLICES);
+	if (sliceCount < 1) sliceCount = 1;
+	if (sliceCount > MAX_PATH_SLICES) sliceCount = MAX_PATH_SLICES;
+	if (sliceExpansions < 1) sliceExpansions = 1;
+
+	SString mode(search.attribute("mode").as_string("hierarchical"));
+	if (mode == "astar") defaultMode = PATH_MODE_ASTAR;
+	else if (mode == "jps") defaultMode = PATH_MODE_JPS;
+	else defaultMode = PATH_MODE_HIERARCHICAL;
+
+	jumpTables = config.child("jps").attribute("precompute").as_bool(true);
+
 	return ret;
 }
 
@@ -30,6 +73,24 @@ bool PathFinding::Start()
 	
 	debugPath = app->tex->Load("Assets/Maps/pathing_thing.png");
 
+	requestMutex = SDL_CreateMutex();
+	requestQueued = SDL_CreateCond();
+	buildQueued = SDL_CreateCond();
+	quitWorkers = false;
+
+	for (int i = 0; i < workerCount; ++i)
+	{
+		workers[i] = SDL_CreateThread(WorkerThread, "PathWorker", this);
+		if (workers[i] == NULL) LOG("Could not create path worker: %s", SDL_GetError());
+	}
+
+	// Without workers the maps are built on the main thread too
+	if (workerCount > 0)
+	{
+		builder = SDL_CreateThread(BuilderThread, "PathMapBuilder", this);
+		if (builder == NULL) LOG("Could not create the map builder: %s", SDL_GetError());
+	}
+
 	return true;
 }
 
@@ -38,43 +99,491 @@ bool PathFinding::CleanUp()
 {
 	LOG("Freeing pathfinding library");
 
-	RELEASE_ARRAY(map);
+	if (requestMutex != NULL)
+	{
+		SDL_LockMutex(requestMutex);
+		quitWorkers = true;
+		SDL_CondBroadcast(requestQueued);
+		SDL_CondBroadcast(buildQueued);
+		SDL_UnlockMutex(requestMutex);
+	}
+
+	for (int i = 0; i < MAX_PATH_WORKERS; ++i)
+	{
+		if (workers[i] != NULL) SDL_WaitThread(workers[i], NULL);
+		workers[i] = NULL;
+	}
+
+	if (builder != NULL) SDL_WaitThread(builder, NULL);
+	builder = NULL;
+
+	MapBuild* builds[2] = { queuedBuild, finishedBuild };
+	for (int i = 0; i < 2; ++i)
+	{
+		if (builds[i] == NULL) continue;
+		if (builds[i]->result != NULL) builds[i]->result->Release();
+		RELEASE_ARRAY(builds[i]->data);
+		RELEASE(builds[i]);
+	}
+	queuedBuild = finishedBuild = NULL;
+
+	RELEASE_ARRAY(targetMap);
+	targetDirty = false;
+
+	for (int i = 0; i < MAX_PATH_SLICES; ++i)
+	{
+		slicedSearches[i].End();
+		slicedSearches[i].Release();
+		slicedRequests[i] = NULL;
+	}
+
+	ListItem<PathRequest*>* item = requests.start;
+	while (item != NULL)
+	{
+		RELEASE(item->data);
+		item = item->next;
+	}
+	requests.Clear();
+
+	if (requestQueued != NULL) SDL_DestroyCond(requestQueued);
+	if (buildQueued != NULL) SDL_DestroyCond(buildQueued);
+	if (requestMutex != NULL) SDL_DestroyMutex(requestMutex);
+	requestQueued = NULL;
+	buildQueued = NULL;
+	requestMutex = NULL;
+
+	if (walkability != NULL) walkability->Release();
+	walkability = NULL;
+	search.Release();
+
+	RELEASE_ARRAY(flowQueue);
+	for (int i = 0; i < FLOW_MAX; ++i)
+	{
+		RELEASE_ARRAY(flowFields[i].distance);
+		RELEASE_ARRAY(flowFields[i].visited);
+		flowFields[i].valid = false;
+	}
+	flowCapacity = 0;
+	surfaceField.Release();
 
 	return true;
 }
 
 // Sets up the walkability map
-void PathFinding::SetMap(uint width, uint height, uchar* data)
+void PathFinding::SetMap(uint width, uint height, uchar* data, const iPoint& origin)
+{
+	// Edits and builds not published yet belong to the map being replaced, whatever they hand over is dropped
+	RELEASE_ARRAY(targetMap);
+	targetMap = new uchar[width * height];
+	memcpy(targetMap, data, width * height);
+	targetWidth = width;
+	targetHeight = height;
+	targetOrigin = origin;
+	targetDirty = false;
+
+	MapBuild build;
+	build.id = publishedId = levelBuildId = ++buildId;
+	build.width = width;
+	build.height = height;
+	build.origin = origin;
+	build.data = data;
+	build.surfaces = groundMotionSet;
+	build.motion = groundMotion;
+
+	logSurfaces = true;
+	PublishMap(BuildWalkability(build, walkability));
+}
+
+void PathFinding::LoadMap(uint width, uint height, const uchar* data, const iPoint& origin)
+{
+	// Builds requested so far belong to the previous level, whatever they hand over is dropped.
+	// The next one queued is the first of this level
+	publishedId = buildId;
+	levelBuildId = buildId + 1;
+	logSurfaces = true;
+
+	UpdateMap(width, height, data, origin);
+}
+
+bool PathFinding::IsMapReady() const
+{
+	return publishedId >= levelBuildId;
+}
+
+void PathFinding::UpdateMap(uint width, uint height, const uchar* data, const iPoint& origin)
+{
+	if (targetMap == NULL || targetWidth * targetHeight != width * height)
+	{
+		RELEASE_ARRAY(targetMap);
+		targetMap = new uchar[width * height];
+	}
+	memcpy(targetMap, data, width * height);
+	targetWidth = width;
+	targetHeight = height;
+	targetOrigin = origin;
+	targetDirty = true;
+}
+
+// Everything searches need from a walkability, previous is repaired into the new hierarchy
+WalkabilityMap* PathFinding::BuildWalkability(const MapBuild& build, const WalkabilityMap* previous) const
+{
+	WalkabilityMap* created = WalkabilityMap::Create(build.width, build.height, build.data, build.origin);
+	if (clusterSize > 0) created->hierarchy = PathHierarchy::Create(*created, clusterSize, previous);
+	if (jumpTables) created->BuildJumpDistances();
+	if (build.surfaces) created->surfaces = SurfaceGraph::Create(*created, build.motion);
+
+	return created;
+}
+
+// Hands the target to the builder, replacing a build it has not started yet.
+// Without a builder the map is built right away
+void PathFinding::QueueBuild()
+{
+	MapBuild* build = new MapBuild();
+	build->id = ++buildId;
+	build->width = targetWidth;
+	build->height = targetHeight;
+	build->origin = targetOrigin;
+	build->data = new uchar[targetWidth * targetHeight];
+	memcpy(build->data, targetMap, targetWidth * targetHeight);
+	build->surfaces = groundMotionSet;
+	build->motion = groundMotion;
+	build->result = NULL;
+	targetDirty = false;
+
+	if (builder == NULL)
+	{
+		build->result = BuildWalkability(*build, walkability);
+		FinishBuild(build);
+		return;
+	}
+
+	SDL_LockMutex(requestMutex);
+	if (queuedBuild != NULL)
+	{
+		RELEASE_ARRAY(queuedBuild->data);
+		RELEASE(queuedBuild);
+	}
+	queuedBuild = build;
+	SDL_CondSignal(buildQueued);
+	SDL_UnlockMutex(requestMutex);
+}
+
+void PathFinding::FinishBuild(MapBuild* build)
+{
+	if (build->id > publishedId)
+	{
+		publishedId = build->id;
+		PublishMap(build->result);
+	}
+	else build->result->Release();
+
+	RELEASE_ARRAY(build->data);
+	RELEASE(build);
+}
+
+int PathFinding::BuilderThread(void* param)
 {
-	this->width = width;
-	this->height = height;
+	PathFinding* pathfinding = (PathFinding*)param;
 
-	RELEASE_ARRAY(map);
-	map = new uchar[width * height];
-	memcpy(map, data, width * height);
+	SDL_LockMutex(pathfinding->requestMutex);
+	while (pathfinding->quitWorkers == false)
+	{
+		// The last result has to be published before the next build starts
+		MapBuild* build = pathfinding->queuedBuild;
+		if (build == NULL || pathfinding->finishedBuild != NULL)
+		{
+			SDL_CondWait(pathfinding->buildQueued, pathfinding->requestMutex);
+			continue;
+		}
+		pathfinding->queuedBuild = NULL;
+
+		WalkabilityMap* previous = pathfinding->walkability;
+		if (previous != NULL) previous->AddRef();
+		SDL_UnlockMutex(pathfinding->requestMutex);
+
+		build->result = pathfinding->BuildWalkability(*build, previous);
+		if (previous != NULL) previous->Release();
+
+		SDL_LockMutex(pathfinding->requestMutex);
+		pathfinding->finishedBuild = build;
+	}
+	SDL_UnlockMutex(pathfinding->requestMutex);
+
+	return 0;
+}
+
+// Makes created the walkability searches use from now on
+void PathFinding::PublishMap(WalkabilityMap* created)
+{
+	uint width = created->width;
+	uint height = created->height;
+
+	// Ground enemies tell how they move once spawned, the graph may come with a later build
+	if (logSurfaces && created->surfaces != NULL)
+	{
+		LOG("Surface graph: %d spans, %d links", created->surfaces->GetSpanCount(), created->surfaces->GetLinkCount());
+		logSurfaces = false;
+	}
+
+	// Workers take their reference with the mutex locked, searches still running
+	// keep the previous map alive until they finish
+	if (requestMutex != NULL) SDL_LockMutex(requestMutex);
+	WalkabilityMap* previous = walkability;
+	walkability = created;
+	if (requestMutex != NULL) SDL_UnlockMutex(requestMutex);
+
+	if (previous != NULL) previous->Release();
+	++mapVersion;
+
+	search.Reserve(width * height);
+	ReserveFlowFields(width * height);
+
+	// The fields were built over the previous walkability
+	for (int i = 0; i < FLOW_MAX; ++i) flowFields[i].valid = false;
+	surfaceField.valid = false;
+}
+
+// Edits of the same frame are gathered into the target and built together in the background,
+// the hierarchy only repairs the clusters they touch
+void PathFinding::SetTileWalkability(const iPoint& pos, uchar value)
+{
+	if (targetMap == NULL) return;
+
+	int x = pos.x - targetOrigin.x;
+	int y = pos.y - targetOrigin.y;
+	if (x < 0 || y < 0 || x >= (int)targetWidth || y >= (int)targetHeight) return;
+
+	targetMap[(y * targetWidth) + x] = value;
+	targetDirty = true;
+}
+
+void PathFinding::SetGroundMotion(const SurfaceMotion& motion)
+{
+	if (groundMotionSet && groundMotion == motion) return;
+
+	groundMotion = motion;
+	groundMotionSet = true;
+
+	// Same tiles, only the surface graph changes
+	if (targetMap != NULL) targetDirty = true;
+}
+
+bool PathFinding::HasSurfaces() const
+{
+	return (walkability != NULL && walkability->surfaces != NULL);
 }
 
 // Utility: return true if pos is inside the map boundaries
 bool PathFinding::CheckBoundaries(const iPoint& pos) const
 {
-	return (pos.x >= 0 && pos.x <= (int)width &&
-		pos.y >= 0 && pos.y <= (int)height);
+	return (walkability != NULL) && walkability->CheckBoundaries(pos);
 }
 
 // Utility: returns true is the tile is walkable
 bool PathFinding::IsWalkable(const iPoint& pos) const
 {
-	uchar t = GetTileCost(pos);
-	return t != INVALID_WALK_CODE && t >= 0 && t != 254;
+	return (walkability != NULL) && walkability->IsWalkable(pos);
 }
 
 // Utility: return the walkability value of a tile
 uchar PathFinding::GetTileCost(const iPoint& pos) const
 {
-	if (CheckBoundaries(pos))
-		return map[(pos.y * width) + pos.x];
+	return (walkability != NULL) ? walkability->GetTileCost(pos) : INVALID_WALK_CODE;
+}
+
+// Walks the tiles 4-connected, stepping on the axis whose next tile line the segment reaches first.
+// Where it goes exactly through a corner both tiles beside it have to be walkable
+bool PathFinding::HasLineOfSight(const iPoint& from, const iPoint& to, iPoint* next) const
+{
+	if (walkability == NULL || walkability->IsWalkable(from) == false) return false;
+
+	int nx = abs(to.x - from.x), ny = abs(to.y - from.y);
+	int sx = (to.x > from.x) ? 1 : -1, sy = (to.y > from.y) ? 1 : -1;
+	iPoint pos = from;
+	bool first = true;
+
+	for (int ix = 0, iy = 0; ix < nx || iy < ny;)
+	{
+		iPoint step = pos;
+		int decision = (1 + 2 * ix) * ny - (1 + 2 * iy) * nx;
+		if (decision == 0)
+		{
+			if (walkability->IsWalkable(iPoint(pos.x + sx, pos.y)) == false || walkability->IsWalkable(iPoint(pos.x, pos.y + sy)) == false) return false;
+			step.x += sx;
+			pos.x += sx;
+			pos.y += sy;
+			++ix;
+			++iy;
+		}
+		else if (decision < 0)
+		{
+			pos.x += sx;
+			step = pos;
+			++ix;
+		}
+		else
+		{
+			pos.y += sy;
+			step = pos;
+			++iy;
+		}
+
+		if (walkability->IsWalkable(pos) == false) return false;
+
+		if (first && next != NULL) *next = step;
+		first = false;
+	}
+	return true;
+}
+
+// Actual A* algorithm: return number of steps in the creation of the path or -1
+int PathFinding::CreatePath(DynArray<iPoint>& path, const iPoint& origin, const iPoint& destination, PathMode mode)
+{
+	if (walkability == NULL) return -1;
+
+	return search.Run(walkability, origin, destination, path, (mode == PATH_MODE_DEFAULT) ? defaultMode : mode);
+}
+
+// Random walkable tile, same sequence on every run
+static iPoint RandomWalkable(const WalkabilityMap& map, uint& seed)
+{
+	iPoint pos;
+	int attempts = 0;
+	do
+	{
+		seed = seed * 1103515245 + 12345;
+		pos = map.CellPosition((seed >> 8) % (map.width * map.height));
+	} while (map.IsWalkable(pos) == false && ++attempts < 1000);
+
+	return pos;
+}
+
+// Runs the same random queries in every mode and logs how many nodes each expands.
+// A*, JPS and JPS+ must agree on every length, the hierarchy trades a little of it
+void PathFinding::Benchmark(int queries)
+{
+	if (walkability == NULL) return;
+
+	uint width = walkability->width;
+	uint height = walkability->height;
+
+	WalkabilityMap* plain = WalkabilityMap::Create(width, height, walkability->map, walkability->origin);
+	WalkabilityMap* tables = WalkabilityMap::Create(width, height, walkability->map, walkability->origin);
+	tables->BuildJumpDistances();
+	if (clusterSize > 0) plain->hierarchy = PathHierarchy::Create(*plain, clusterSize);
+
+	const char* names[4] = { "A*", "JPS", "JPS+", "HPA*" };
+	WalkabilityMap* maps[4] = { plain, plain, tables, plain };
+	PathMode modes[4] = { PATH_MODE_ASTAR, PATH_MODE_JPS, PATH_MODE_JPS, PATH_MODE_HIERARCHICAL };
+	int expanded[4] = { 0, 0, 0, 0 };
+	int length[4] = { 0, 0, 0, 0 };
+	double ms[4] = { 0.0, 0.0, 0.0, 0.0 };
+	int mismatches = 0;
+	int unreachable = 0;
+	int hierarchicalLength = 0;
+	int exactLength = 0;
+
+	DynArray<iPoint> path(DEFAULT_PATH_LENGTH);
+	uint seed = 12345;
+
+	for (int q = 0; q < queries; ++q)
+	{
+		iPoint ends[2];
+		for (int e = 0; e < 2; ++e) ends[e] = RandomWalkable(*walkability, seed);
+
+		for (int m = 0; m < 4; ++m)
+		{
+			int count = 0;
+			path.Clear();
+
+			PerfTimer timer;
+			if (search.Begin(maps[m], ends[0], ends[1], modes[m])) search.Step(INT_MAX, count);
+			length[m] = search.GetPath(path);
+			search.End();
+
+			ms[m] += timer.ReadMs();
+			expanded[m] += count;
+		}
+
+		if (length[0] != length[1] || length[0] != length[2]) ++mismatches;
+
+		// HPA* has to find the same tiles reachable, its paths may be longer
+		if ((length[0] > 0) != (length[3] > 0)) ++unreachable;
+		else if (length[0] > 0)
+		{
+			exactLength += length[0];
+			hierarchicalLength += length[3];
+		}
+	}
+
+	LOG("Path benchmark: %d queries on %dx%d tiles", queries, width, height);
+	for (int m = 0; m < 4; ++m)
+	{
+		LOG("  %-5s %8d nodes expanded (%3d%% of A*) %8.3f ms", names[m], expanded[m],
+			(expanded[0] > 0) ? (int)(100.0 * expanded[m] / expanded[0]) : 0, ms[m]);
+	}
+	LOG("  %d JPS lengths differ from A*", mismatches);
+	if (clusterSize > 0)
+	{
+		LOG("  %d HPA* reachability differs from A*, paths %.1f%% longer", unreachable,
+			(exactLength > 0) ? 100.0 * (hierarchicalLength - exactLength) / exactLength : 0.0);
+		BenchmarkRepair(queries, plain);
+	}
+
+	plain->Release();
+	tables->Release();
+}
+
+// Flips random tiles of the map and checks the hierarchy repaired from it finds
+// the same paths as one built from scratch
+void PathFinding::BenchmarkRepair(int queries, const WalkabilityMap* previous)
+{
+	uint width = previous->width;
+	uint height = previous->height;
+	uint seed = 54321;
+
+	uchar* edited = new uchar[width * height];
+	memcpy(edited, previous->map, width * height);
+	for (uint i = 0; i < (width * height) / 100 + 1; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		uchar& tile = edited[(seed >> 8) % (width * height)];
+		if (tile != INVALID_WALK_CODE) tile = (tile == 254) ? 1 : 254;
+	}
+
+	WalkabilityMap* repaired = WalkabilityMap::Create(width, height, edited, previous->origin);
+	WalkabilityMap* rebuilt = WalkabilityMap::Create(width, height, edited, previous->origin);
+	repaired->hierarchy = PathHierarchy::Create(*repaired, clusterSize, previous);
+	rebuilt->hierarchy = PathHierarchy::Create(*rebuilt, clusterSize);
+	RELEASE_ARRAY(edited);
+
+	DynArray<iPoint> path(DEFAULT_PATH_LENGTH);
+	int mismatches = 0;
+
+	for (int q = 0; q < queries; ++q)
+	{
+		iPoint ends[2];
+		for (int e = 0; e < 2; ++e) ends[e] = RandomWalkable(*rebuilt, seed);
+
+		int length[2];
+		WalkabilityMap* maps[2] = { repaired, rebuilt };
+		for (int m = 0; m < 2; ++m)
+		{
+			int count = 0;
+			path.Clear();
+			if (search.Begin(maps[m], ends[0], ends[1], PATH_MODE_HIERARCHICAL)) search.Step(INT_MAX, count);
+			length[m] = search.GetPath(path);
+			search.End();
+		}
 
-	return INVALID_WALK_CODE;
+		if (length[0] != length[1]) ++mismatches;
+	}
+
+	LOG("  %d HPA* lengths differ between a repaired and a rebuilt hierarchy", mismatches);
+
+	repaired->Release();
+	rebuilt->Release();
 }
 
 // To request all tiles involved in the last generated path
@@ -92,161 +601,404 @@ void PathFinding::DrawPath(DynArray<iPoint>* path)
 	}
 }
 
-// PathList ------------------------------------------------------------------------
-// Looks for a node in this list and returns it's list node or NULL
+// Flow fields ---------------------------------------------------------------------
+// One breadth first search from the target serves every enemy chasing it, it only
+// expands flowRadius steps since enemies further away do not chase
 // ---------------------------------------------------------------------------------
-const ListItem<PathNode>* PathList::Find(const iPoint& point) const
+void PathFinding::ReserveFlowFields(uint count)
 {
-	ListItem<PathNode>* item = list.start;
-	while (item)
+	if (count <= flowCapacity) return;
+
+	RELEASE_ARRAY(flowQueue);
+
+	flowCapacity = count;
+	flowQueue = new int[flowCapacity];
+	for (int i = 0; i < FLOW_MAX; ++i)
 	{
-		if (item->data.pos == point)
-			return item;
-		item = item->next;
+		FlowField& field = flowFields[i];
+		RELEASE_ARRAY(field.distance);
+		RELEASE_ARRAY(field.visited);
+
+		field.distance = new int[flowCapacity];
+		field.visited = new uint[flowCapacity];
+		memset(field.visited, 0, flowCapacity * sizeof(uint));
+		field.stamp = 0;
+		field.valid = false;
 	}
-	return NULL;
 }
 
-// PathList ------------------------------------------------------------------------
-// Returns the Pathnode with lowest score in this list or NULL if empty
-// ---------------------------------------------------------------------------------
-ListItem<PathNode>* PathList::GetNodeLowestScore() const
+bool PathFinding::CanStep(FlowFieldType type, const iPoint& from, const iPoint& to) const
+{
+	if (IsWalkable(from) == false || IsWalkable(to) == false) return false;
+
+	// Ground movement can only go up jumping from a tile with floor below
+	if (type == FLOW_GROUND && to.y < from.y) return IsWalkable(iPoint(from.x, from.y + 1)) == false;
+
+	return true;
+}
+
+int PathFinding::FlowDistance(const FlowField& field, const iPoint& pos) const
 {
-	ListItem<PathNode>* ret = NULL;
-	int min = 65535;
+	if (CheckBoundaries(pos) == false) return -1;
 
-	ListItem<PathNode>* item = list.end;
-	while (item)
+	int index = walkability->CellIndex(pos);
+	return (field.visited[index] == field.stamp) ? field.distance[index] : -1;
+}
+
+void PathFinding::BuildFlowField(FlowFieldType type, const iPoint& root)
+{
+	FlowField& field = flowFields[type];
+	field.root = root;
+	field.valid = true;
+
+	// A new stamp leaves every cell of the previous build unreachable without clearing them
+	if (++field.stamp == 0)
 	{
-		if (item->data.Score() < min)
+		memset(field.visited, 0, flowCapacity * sizeof(uint));
+		field.stamp = 1;
+	}
+
+	if (IsWalkable(root) == false) return;
+
+	const int offsets[4][2] = { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+	int head = 0, tail = 0;
+
+	int start = walkability->CellIndex(root);
+	field.visited[start] = field.stamp;
+	field.distance[start] = 0;
+	flowQueue[tail++] = start;
+
+	while (head < tail)
+	{
+		int current = flowQueue[head++];
+		int distance = field.distance[current];
+		if (distance >= flowRadius) continue;
+
+		iPoint pos = walkability->CellPosition(current);
+		for (int i = 0; i < 4; ++i)
 		{
-			min = item->data.Score();
-			ret = item;
+			// Searching from the root, so the step that matters goes from the neighbour to this cell
+			iPoint cell(pos.x + offsets[i][0], pos.y + offsets[i][1]);
+			if (CanStep(type, cell, pos) == false) continue;
+
+			int index = walkability->CellIndex(cell);
+			if (field.visited[index] == field.stamp) continue;
+
+			field.visited[index] = field.stamp;
+			field.distance[index] = distance + 1;
+			flowQueue[tail++] = index;
 		}
-		item = item->prev;
 	}
-	return ret;
 }
 
-// PathNode -------------------------------------------------------------------------
-// Convenient constructors
-// ----------------------------------------------------------------------------------
-PathNode::PathNode() : costSoFar(-1), heuristic(-1), pos(-1, -1), parent(NULL)
-{}
+bool PathFinding::GetFlowStep(FlowFieldType type, const iPoint& from, const iPoint& target, iPoint& next, bool* jump)
+{
+	if (jump != NULL) *jump = false;
+	if (walkability == NULL || from == target) return false;
+
+	if (type == FLOW_GROUND && walkability->surfaces != NULL)
+	{
+		if (surfaceField.valid == false || surfaceField.root != target) walkability->surfaces->BuildField(target, surfaceField);
+
+		bool jumping = false;
+		bool found = walkability->surfaces->GetStep(from, surfaceField, next, jumping);
+		if (jump != NULL) *jump = jumping;
+		return found;
+	}
 
-PathNode::PathNode(int costSoFar, int heuristic, const iPoint& pos, const PathNode* parent) : costSoFar(costSoFar), heuristic(heuristic), pos(pos), parent(parent)
-{}
+	FlowField& field = flowFields[type];
+	if (field.valid == false || field.root != target) BuildFlowField(type, target);
 
-PathNode::PathNode(const PathNode& node) : costSoFar(node.costSoFar), heuristic(node.heuristic), pos(node.pos), parent(node.parent)
-{}
+	int distance = FlowDistance(field, from);
+	if (distance <= 0) return false;
 
-// PathNode -------------------------------------------------------------------------
-// Fills a list (PathList) of all valid adjacent pathnodes
-// ----------------------------------------------------------------------------------
-uint PathNode::FindWalkableAdjacents(PathList& listToFill)
+	const int offsets[4][2] = { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+	for (int i = 0; i < 4; ++i)
+	{
+		iPoint cell(from.x + offsets[i][0], from.y + offsets[i][1]);
+		if (CanStep(type, from, cell) == false) continue;
+
+		int cellDistance = FlowDistance(field, cell);
+		if (cellDistance >= 0 && cellDistance < distance)
+		{
+			next = cell;
+			return true;
+		}
+	}
+	return false;
+}
+
+int PathFinding::GetFlowPath(FlowFieldType type, const iPoint& from, const iPoint& target, DynArray<iPoint>& path)
 {
-	iPoint cell;
-	uint before = listToFill.list.Count();
+	iPoint pos = from;
+	iPoint next;
 
-	// north
-	cell.create(pos.x, pos.y + 1);
-	if (app->pathfinding->IsWalkable(cell))
-		listToFill.list.Add(PathNode(-1, -1, cell, this));
+	path.Clear();
+	path.PushBack(pos);
+	while (path.Count() <= flowCapacity && GetFlowStep(type, pos, target, next))
+	{
+		path.PushBack(next);
+		pos = next;
+	}
 
-	// south
-	cell.create(pos.x, pos.y - 1);
-	if (app->pathfinding->IsWalkable(cell))
-		listToFill.list.Add(PathNode(-1, -1, cell, this));
+	// Over the surfaces the walk ends under the target when it is in the air
+	bool arrived = (pos == target) || (type == FLOW_GROUND && HasSurfaces() && pos.x == target.x);
+	if (arrived == false)
+	{
+		path.Clear();
+		return -1;
+	}
+	return (int)path.Count();
+}
 
-	// east
-	cell.create(pos.x + 1, pos.y);
-	if (app->pathfinding->IsWalkable(cell))
-		listToFill.list.Add(PathNode(-1, -1, cell, this));
+// Path requests -------------------------------------------------------------------
+// Workers take the oldest pending request, search it against the walkability map
+// current at that moment and leave the result in the request until it is polled
+// ---------------------------------------------------------------------------------
+uint PathFinding::RequestPath(const iPoint& origin, const iPoint& destination, PathMode mode)
+{
+	if (requestMutex == NULL) return 0;
+	if (mode == PATH_MODE_DEFAULT) mode = defaultMode;
 
-	// west
-	cell.create(pos.x - 1, pos.y);
-	if (app->pathfinding->IsWalkable(cell))
-		listToFill.list.Add(PathNode(-1, -1, cell, this));
+	SDL_LockMutex(requestMutex);
+
+	// Same tiles as a request nobody has an answer for yet: share it
+	ListItem<PathRequest*>* item = requests.start;
+	while (item != NULL)
+	{
+		PathRequest* request = item->data;
+		if (request->status == PATH_PENDING && request->mode == mode && request->origin == origin && request->destination == destination)
+		{
+			++request->listeners;
+			SDL_UnlockMutex(requestMutex);
+			return request->ticket;
+		}
+		item = item->next;
+	}
 
-	return listToFill.list.Count();
+	PathRequest* request = new PathRequest();
+	request->ticket = nextTicket++;
+	if (nextTicket == 0) nextTicket = 1;
+	request->origin = origin;
+	request->destination = destination;
+	request->mode = mode;
+	request->status = PATH_PENDING;
+	request->listeners = 1;
+	request->running = false;
+	requests.Add(request);
+
+	SDL_CondSignal(requestQueued);
+	SDL_UnlockMutex(requestMutex);
+
+	return request->ticket;
 }
 
-// PathNode -------------------------------------------------------------------------
-// Calculates this tile score
-// ----------------------------------------------------------------------------------
-int PathNode::Score() const
+PathStatus PathFinding::PollPath(uint ticket, DynArray<iPoint>& path)
 {
-	return costSoFar + heuristic;
+	if (requestMutex == NULL || ticket == 0) return PATH_INVALID;
+
+	SDL_LockMutex(requestMutex);
+
+	PathStatus status = PATH_INVALID;
+	ListItem<PathRequest*>* item = FindRequest(ticket);
+	if (item != NULL)
+	{
+		status = item->data->status;
+		if (status == PATH_READY)
+		{
+			path.Clear();
+			path += item->data->path;
+		}
+		if (status != PATH_PENDING) ReleaseListener(item);
+	}
+
+	SDL_UnlockMutex(requestMutex);
+	return status;
 }
 
-// PathNode -------------------------------------------------------------------------
-// Calculate the F for a specific destination tile
-// ----------------------------------------------------------------------------------
-int PathNode::CalculateTotalCost(const iPoint& destination)
+void PathFinding::CancelPath(uint ticket)
 {
-	costSoFar = parent->costSoFar + 1;
-	heuristic = pos.DistanceTo(destination);
+	if (requestMutex == NULL || ticket == 0) return;
+
+	SDL_LockMutex(requestMutex);
+
+	ListItem<PathRequest*>* item = FindRequest(ticket);
+	if (item != NULL) ReleaseListener(item);
 
-	return costSoFar + heuristic;
+	SDL_UnlockMutex(requestMutex);
 }
 
-// ----------------------------------------------------------------------------------
-// Actual A* algorithm: return number of steps in the creation of the path or -1 ----
-// ----------------------------------------------------------------------------------
-int PathFinding::CreatePath(DynArray<iPoint>& path, const iPoint& origin, const iPoint& destination)
+bool PathFinding::PreUpdate()
 {
-	if (!IsWalkable(origin) || !IsWalkable(destination))
+	// Counters of the frame that just ended
+	frameExpanded = slicedExpanded + SDL_AtomicSet(&workerExpanded, 0);
+	slicedExpanded = 0;
+
+	if (app->input->GetKey(SDL_SCANCODE_F11) == KEY_DOWN) Benchmark(PATH_BENCHMARK_QUERIES);
+
+	if (requestMutex != NULL)
 	{
-		return -1;
+		SDL_LockMutex(requestMutex);
+		MapBuild* finished = finishedBuild;
+		finishedBuild = NULL;
+		if (finished != NULL) SDL_CondSignal(buildQueued);
+		SDL_UnlockMutex(requestMutex);
+
+		if (finished != NULL) FinishBuild(finished);
 	}
 
-	PathList open;
-	PathList close;
-	open.list.Add(PathNode(0, origin.DistanceTo(destination), origin, nullptr));
-	while (open.list.Count() != 0)
+	// At most one build requested per frame, the latest target replaces one not started yet
+	if (targetDirty) QueueBuild();
+
+	if (workerCount > 0 || requestMutex == NULL) return true;
+
+	SDL_LockMutex(requestMutex);
+	ServiceSlices();
+	SDL_UnlockMutex(requestMutex);
+
+	return true;
+}
+
+// Without workers the requests advance on the main thread: each search in flight
+// expands at most sliceExpansions nodes per turn, round robin, until the frame
+// budget is spent. Searches keep their open and closed sets for the next frame
+void PathFinding::ServiceSlices()
+{
+	for (int i = 0; i < sliceCount; ++i)
 	{
-		close.list.Add(open.GetNodeLowestScore()->data);
-		open.list.Del(open.GetNodeLowestScore());
+		if (slicedRequests[i] != NULL) continue;
 
-		if (close.list.end->data.pos == destination)
-		{
-			int counter = 1;
-			PathNode backtrack = close.list.end->data;
-			path.PushBack(backtrack.pos);
-			do
-			{
-				counter++;
-				backtrack = close.Find(backtrack.parent->pos)->data;
-				path.PushBack(backtrack.pos);
-			} while (backtrack.parent != nullptr);
-			path.Flip();
-			return counter;
-		}
+		ListItem<PathRequest*>* item = NextRequest();
+		if (item == NULL) break;
 
-		PathList adjNodes;
-		close.list.end->data.FindWalkableAdjacents(adjNodes);
-		for (ListItem<PathNode>* i = adjNodes.list.start; i != NULL; i = i->next)
+		// A search that can not begin fails on its first step
+		item->data->running = true;
+		slicedRequests[i] = item;
+		if (walkability != NULL) slicedSearches[i].Begin(walkability, item->data->origin, item->data->destination, item->data->mode);
+	}
+
+	int budget = frameBudget;
+	bool active = true;
+	while (budget > 0 && active)
+	{
+		active = false;
+		for (int i = 0; i < sliceCount && budget > 0; ++i)
 		{
-			if (close.Find(i->data.pos) != NULL)
+			ListItem<PathRequest*>* item = slicedRequests[i];
+			if (item == NULL) continue;
+
+			// Every ticket was cancelled, stop searching
+			if (item->data->listeners == 0)
 			{
+				slicedSearches[i].End();
+				slicedRequests[i] = NULL;
+				RELEASE(item->data);
+				requests.Del(item);
 				continue;
 			}
-			else if (open.Find(i->data.pos) != NULL)
-			{
-				PathNode tmp = open.Find(i->data.pos)->data;
-				i->data.CalculateTotalCost(destination);
-				if (i->data.costSoFar < tmp.costSoFar)
-				{
-					tmp.parent = i->data.parent;
-				}
-			}
-			else
+
+			int expanded = 0;
+			SearchState state = slicedSearches[i].Step(MIN(sliceExpansions, budget), expanded);
+			budget -= expanded;
+			slicedExpanded += expanded;
+
+			if (state == SEARCH_RUNNING)
 			{
-				i->data.CalculateTotalCost(destination);
-				open.list.Add(i->data);
+				active = true;
+				continue;
 			}
+
+			item->data->path.Clear();
+			slicedSearches[i].GetPath(item->data->path);
+			slicedSearches[i].End();
+			slicedRequests[i] = NULL;
+			CompleteRequest(item, state == SEARCH_FOUND);
 		}
-		adjNodes.list.Clear();
 	}
-	return -1;
-}
\ No newline at end of file
+}
+
+ListItem<PathRequest*>* PathFinding::FindRequest(uint ticket)
+{
+	ListItem<PathRequest*>* item = requests.start;
+	while (item != NULL && item->data->ticket != ticket) item = item->next;
+
+	return item;
+}
+
+ListItem<PathRequest*>* PathFinding::NextRequest()
+{
+	ListItem<PathRequest*>* item = requests.start;
+	while (item != NULL && (item->data->status != PATH_PENDING || item->data->running)) item = item->next;
+
+	return item;
+}
+
+void PathFinding::ReleaseListener(ListItem<PathRequest*>* item)
+{
+	// Whoever is still searching it deletes the request when it finishes
+	if (--item->data->listeners > 0 || item->data->running) return;
+
+	RELEASE(item->data);
+	requests.Del(item);
+}
+
+void PathFinding::RunRequest(ListItem<PathRequest*>* item, PathSearch& search)
+{
+	PathRequest* request = item->data;
+	request->running = true;
+
+	WalkabilityMap* map = walkability;
+	if (map != NULL) map->AddRef();
+
+	// The search itself runs unlocked, nobody else touches a running request's path
+	SDL_UnlockMutex(requestMutex);
+
+	bool found = false;
+	if (map != NULL)
+	{
+		int expanded = 0;
+		request->path.Clear();
+		if (search.Begin(map, request->origin, request->destination, request->mode))
+		{
+			found = (search.Step(INT_MAX, expanded) == SEARCH_FOUND);
+			search.GetPath(request->path);
+		}
+		search.End();
+		map->Release();
+
+		SDL_AtomicAdd(&workerExpanded, expanded);
+	}
+
+	SDL_LockMutex(requestMutex);
+	CompleteRequest(item, found);
+}
+
+void PathFinding::CompleteRequest(ListItem<PathRequest*>* item, bool found)
+{
+	item->data->running = false;
+	item->data->status = found ? PATH_READY : PATH_FAILED;
+
+	// Every ticket was cancelled while it ran
+	if (item->data->listeners == 0)
+	{
+		RELEASE(item->data);
+		requests.Del(item);
+	}
+}
+
+int PathFinding::WorkerThread(void* param)
+{
+	PathFinding* pathfinding = (PathFinding*)param;
+	PathSearch search;
+
+	SDL_LockMutex(pathfinding->requestMutex);
+	while (pathfinding->quitWorkers == false)
+	{
+		ListItem<PathRequest*>* item = pathfinding->NextRequest();
+		if (item != NULL) pathfinding->RunRequest(item, search);
+		else SDL_CondWait(pathfinding->requestQueued, pathfinding->requestMutex);
+	}
+	SDL_UnlockMutex(pathfinding->requestMutex);
+
+	return 0;
+}
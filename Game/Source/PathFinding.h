@@ -6,11 +6,20 @@
 #include "Point.h"
 #include "DynArray.h"
 #include "List.h"
+#include "PathSearch.h"
+#include "SurfaceGraph.h"
 
 #include "SDL/include/SDL.h"
 
 #define DEFAULT_PATH_LENGTH 50
-#define INVALID_WALK_CODE 255
+#define FLOW_FIELD_RADIUS 10
+#define PATH_WORKERS 2
+#define MAX_PATH_WORKERS 8
+#define PATH_FRAME_BUDGET 2000
+#define PATH_SLICE_EXPANSIONS 200
+#define PATH_SLICES 4
+#define MAX_PATH_SLICES 8
+#define PATH_BENCHMARK_QUERIES 500
 
 // --------------------------------------------------
 // Recommended reading:
@@ -18,6 +27,53 @@
 // Details: http://theory.stanford.edu/~amitp/GameProgramming/
 // --------------------------------------------------
 
+// Movement rules of a flow field. Flying enemies move freely between walkable
+// tiles, ground ones follow the surface graph once their motion is known, before
+// that they can only move up from a tile that stands on something
+enum FlowFieldType
+{
+	FLOW_GROUND,
+	FLOW_FLYING,
+	FLOW_MAX
+};
+
+// ---------------------------------------------------------------------
+// Flow field: steps from every cell to the root, built breadth first from
+// the root and shared by all the enemies chasing it
+// ---------------------------------------------------------------------
+struct FlowField
+{
+	iPoint root;
+	bool valid;
+	uint stamp;		// build that last reached a cell, cells with an older one are unreachable
+	int* distance;
+	uint* visited;
+};
+
+enum PathStatus
+{
+	PATH_INVALID,	// unknown ticket, or already collected
+	PATH_PENDING,
+	PATH_READY,
+	PATH_FAILED
+};
+
+// ---------------------------------------------------------------------
+// Path request serviced by the workers. Requests for the same tiles made
+// while one is still pending share it, each ticket handed out is a listener
+// ---------------------------------------------------------------------
+struct PathRequest
+{
+	uint ticket;
+	iPoint origin;
+	iPoint destination;
+	PathMode mode;
+	PathStatus status;
+	int listeners;
+	bool running;
+	DynArray<iPoint> path;
+};
+
 class PathFinding : public Module
 {
 public:
@@ -32,14 +88,43 @@ public:
 	// Called before render is available
 	bool Awake(pugi::xml_node& config);
 
+	// Advances the queued requests within the frame budget when there are no workers
+	bool PreUpdate();
+
 	// Called before quitting
 	bool CleanUp();
 
-	// Sets up the walkability map
-	void SetMap(uint width, uint height, uchar* data);
+	// Sets up the walkability map of a new level, origin is the map tile of its first cell.
+	// Blocks until the hierarchy, jump tables and surface graph are built
+	void SetMap(uint width, uint height, uchar* data, const iPoint& origin = iPoint(0, 0));
+
+	// Same for a level loading behind a transition, built in the background. Searches keep
+	// using the previous map until IsMapReady
+	void LoadMap(uint width, uint height, const uchar* data, const iPoint& origin = iPoint(0, 0));
+	bool IsMapReady() const;
+
+	// Replaces the walkability of the current level, like a new streaming window. What is derived
+	// from it is built in the background, searches keep using the current map until it is ready
+	void UpdateMap(uint width, uint height, const uchar* data, const iPoint& origin);
+
+	// Changes the walkability of one tile, searches see it once the next build is published
+	void SetTileWalkability(const iPoint& pos, uchar value);
+
+	// Motion of the ground enemies, the surface graph is built for it from the next frame on
+	void SetGroundMotion(const SurfaceMotion& motion);
+	bool HasSurfaces() const;
+
+	// Main function to request a path from A to B, searched right away on the calling thread
+	int CreatePath(DynArray<iPoint>& path, const iPoint& origin, const iPoint& destination, PathMode mode = PATH_MODE_DEFAULT);
+
+	// Queues a path from A to B for the workers and returns its ticket, 0 if it can not be queued
+	uint RequestPath(const iPoint& origin, const iPoint& destination, PathMode mode = PATH_MODE_DEFAULT);
+
+	// Once the request is done copies the result to path and releases the ticket
+	PathStatus PollPath(uint ticket, DynArray<iPoint>& path);
 
-	// Main function to request a path from A to B
-	int CreatePath(DynArray<iPoint>& path, const iPoint& origin, const iPoint& destination);
+	// Releases the ticket without waiting for its result
+	void CancelPath(uint ticket);
 
 	// Utility: return true if pos is inside the map boundaries
 	bool CheckBoundaries(const iPoint& pos) const;
@@ -50,60 +135,134 @@ public:
 	// Utility: return the walkability value of a tile
 	uchar GetTileCost(const iPoint& pos) const;
 
+	// Whether every tile the segment between the centres of from and to crosses is walkable.
+	// next gets the first of them after from, a neighbour of it
+	bool HasLineOfSight(const iPoint& from, const iPoint& to, iPoint* next = NULL) const;
+
+	// Changes every time a new walkability is published, results over the old one are stale
+	inline uint GetMapVersion() const { return mapVersion; }
+
+	// Next tile to move from "from" towards target, the field is only rebuilt when the target changes tile.
+	// Over the surface graph next may be several tiles away, jump tells whether to jump to reach it
+	bool GetFlowStep(FlowFieldType type, const iPoint& from, const iPoint& target, iPoint& next, bool* jump = NULL);
+
+	// Follows the flow field from "from" to target, returns the number of tiles or -1
+	int GetFlowPath(FlowFieldType type, const iPoint& from, const iPoint& target, DynArray<iPoint>& path);
+
 	void DrawPath(DynArray<iPoint>* path);
 
+	// Nodes expanded by the path requests during the last frame, workers included
+	inline int GetExpandedNodes() const { return frameExpanded; }
+
+	// Logs the nodes expanded by every mode on the same random paths (F11)
+	void Benchmark(int queries);
+	void BenchmarkRepair(int queries, const WalkabilityMap* previous);
+
+private:
+	// Walkability maps built off the main thread, one at a time
+	struct MapBuild
+	{
+		uint id;
+		uint width;
+		uint height;
+		iPoint origin;
+		uchar* data;
+		bool surfaces;
+		SurfaceMotion motion;
+		WalkabilityMap* result;
+	};
+
+	WalkabilityMap* BuildWalkability(const MapBuild& build, const WalkabilityMap* previous) const;
+	void QueueBuild();
+	void FinishBuild(MapBuild* build);
+	void PublishMap(WalkabilityMap* created);
+	static int BuilderThread(void* param);
+
+	// Flow fields
+	void ReserveFlowFields(uint count);
+	void BuildFlowField(FlowFieldType type, const iPoint& root);
+	bool CanStep(FlowFieldType type, const iPoint& from, const iPoint& to) const;
+	int FlowDistance(const FlowField& field, const iPoint& pos) const;
+
+	// Requests, all of them called with requestMutex locked
+	ListItem<PathRequest*>* FindRequest(uint ticket);
+	ListItem<PathRequest*>* NextRequest();
+	void RunRequest(ListItem<PathRequest*>* item, PathSearch& search);
+	void CompleteRequest(ListItem<PathRequest*>* item, bool found);
+	void ServiceSlices();
+	void ReleaseListener(ListItem<PathRequest*>* item);
+
+	static int WorkerThread(void* param);
+
 private:
 	// texture to draw the path
 	SString folderTexture;
 	SDL_Texture* debugPath;
 
-	// size of the map
-	uint width;
-	uint height;
+	// Current walkability, searches in flight may still hold older ones
+	WalkabilityMap* walkability;
+	uint mapVersion;
 
-	// all map walkability values [0..255]
-	uchar* map;
-};
+	// Walkability the next build starts from, the last one requested. targetDirty
+	// when it changed since it was handed to the builder
+	uchar* targetMap;
+	uint targetWidth;
+	uint targetHeight;
+	iPoint targetOrigin;
+	bool targetDirty;
 
-// forward declaration
-struct PathList;
+	// Builds waiting for the builder and for PreUpdate to publish them, guarded by requestMutex.
+	// Ids grow with every request, results older than the published map are dropped
+	MapBuild* queuedBuild;
+	MapBuild* finishedBuild;
+	uint buildId;
+	uint publishedId;
+	uint levelBuildId;	// first build of the current level
+	bool logSurfaces;	// the surface graph size is logged once per level
+	SDL_Thread* builder;
+	SDL_cond* buildQueued;
 
-// ---------------------------------------------------------------------
-// Pathnode: Helper struct to represent a node in the path creation
-// ---------------------------------------------------------------------
-struct PathNode
-{
-	int costSoFar;
-	int heuristic;
-	iPoint pos;
-	const PathNode* parent; // needed to reconstruct the path in the end
-
-	// Convenient constructors
-	PathNode();
-	PathNode(int costSoFar, int heuristic, const iPoint& pos, const PathNode* parent);
-	PathNode(const PathNode& node);
-
-	// Fills a list (PathList) of all valid adjacent pathnodes
-	uint FindWalkableAdjacents(PathList& list_to_fill);
-	// Calculates this tile score
-	int Score() const;
-	// Calculate the F for a specific destination tile
-	int CalculateTotalCost(const iPoint& destination);
-};
+	// Tiles per side of the hierarchy clusters, 0 searches tile by tile
+	int clusterSize;
 
-// ---------------------------------------------------------------------
-// Helper struct to include a list of path nodes
-// ---------------------------------------------------------------------
-struct PathList
-{
-	// Looks for a node in this list and returns it's list node or NULL
-	const ListItem<PathNode>* Find(const iPoint& point) const;
+	// Whether new maps get JPS+ jump distances, and the mode of requests that do not pick one
+	bool jumpTables;
+	PathMode defaultMode;
+
+	// Search used by CreatePath
+	PathSearch search;
+
+	// Flow fields towards the player, how many steps away they reach
+	FlowField flowFields[FLOW_MAX];
+	int* flowQueue;
+	uint flowCapacity;
+	int flowRadius;
+
+	// Ground enemies chase over the surface graph instead, the whole of it since it is small
+	SurfaceMotion groundMotion;
+	bool groundMotionSet;
+	SurfaceField surfaceField;
+
+	// Path requests, guarded by requestMutex. Workers sleep on requestQueued
+	List<PathRequest*> requests;
+	uint nextTicket;
+	SDL_mutex* requestMutex;
+	SDL_cond* requestQueued;
+	SDL_Thread* workers[MAX_PATH_WORKERS];
+	int workerCount;
+	bool quitWorkers;
 
-	// Returns the Pathnode with lowest score in this list or NULL if empty
-	ListItem<PathNode>* GetNodeLowestScore() const;
+	// Time sliced requests when there are no workers, one search per request in flight
+	PathSearch slicedSearches[MAX_PATH_SLICES];
+	ListItem<PathRequest*>* slicedRequests[MAX_PATH_SLICES];
+	int sliceCount;
+	int sliceExpansions;
+	int frameBudget;
 
-	// The list itself, note they are not pointers!
-	List<PathNode> list;
+	// Expansion counters
+	int slicedExpanded;
+	int frameExpanded;
+	SDL_atomic_t workerExpanded;
 };
 
-#endif // __PATHFINDING_H__
\ No newline at end of file
+#endif // __PATHFINDING_H__
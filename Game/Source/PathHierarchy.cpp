@@ -0,0 +1,262 @@
+#include "PathHierarchy.h"
+#include "PathSearch.h"
+
+#include "Defs.h"
+
+#include <string.h>
+
+PathHierarchy::PathHierarchy() : clusterSize(0), clustersWidth(0), clustersHeight(0), clusterCount(0), maxEntrances(0),
+	width(0), height(0), origin(0, 0), entranceCount(NULL), entrancePos(NULL), entranceSide(NULL), entranceLink(NULL),
+	intraDistance(NULL), distance(NULL), queue(NULL)
+{}
+
+PathHierarchy::~PathHierarchy()
+{
+	RELEASE_ARRAY(entranceCount);
+	RELEASE_ARRAY(entrancePos);
+	RELEASE_ARRAY(entranceSide);
+	RELEASE_ARRAY(entranceLink);
+	RELEASE_ARRAY(intraDistance);
+	RELEASE_ARRAY(distance);
+	RELEASE_ARRAY(queue);
+}
+
+PathHierarchy* PathHierarchy::Create(const WalkabilityMap& map, int clusterSize, const WalkabilityMap* previous)
+{
+	PathHierarchy* hierarchy = new PathHierarchy();
+	hierarchy->Allocate(map, clusterSize);
+
+	const PathHierarchy* old = (previous != NULL) ? previous->hierarchy : NULL;
+	bool repair = (old != NULL && old->clusterSize == clusterSize && old->width == map.width &&
+		old->height == map.height && old->origin == map.origin);
+
+	if (repair == false)
+	{
+		for (int c = 0; c < hierarchy->clusterCount; ++c) hierarchy->BuildEntrances(map, c);
+		for (int c = 0; c < hierarchy->clusterCount; ++c) hierarchy->LinkEntrances(c);
+		for (int c = 0; c < hierarchy->clusterCount; ++c) hierarchy->BuildIntraDistances(map, c);
+
+		return hierarchy;
+	}
+
+	hierarchy->CopyFrom(*old);
+
+	// 2: tiles changed, or a border with such a cluster, entrances are rebuilt
+	// 1: next to a rebuilt cluster, only its links may point to old slots
+	uchar* repairs = new uchar[hierarchy->clusterCount];
+	memset(repairs, 0, hierarchy->clusterCount);
+
+	for (int c = 0; c < hierarchy->clusterCount; ++c)
+	{
+		SDL_Rect rect = hierarchy->GetClusterRect(c);
+		for (int y = rect.y; y < rect.y + rect.h; ++y)
+		{
+			int row = map.CellIndex(iPoint(rect.x, y));
+			if (memcmp(map.map + row, previous->map + row, rect.w) != 0)
+			{
+				repairs[c] = 3;
+				break;
+			}
+		}
+	}
+
+	const int offsets[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+	for (int level = 3; level > 1; --level)
+	{
+		for (int c = 0; c < hierarchy->clusterCount; ++c)
+		{
+			if (repairs[c] != level) continue;
+
+			int cx = c % hierarchy->clustersWidth;
+			int cy = c / hierarchy->clustersWidth;
+			for (int i = 0; i < 4; ++i)
+			{
+				int nx = cx + offsets[i][0];
+				int ny = cy + offsets[i][1];
+				if (nx < 0 || ny < 0 || nx >= hierarchy->clustersWidth || ny >= hierarchy->clustersHeight) continue;
+
+				uchar& neighbour = repairs[ny * hierarchy->clustersWidth + nx];
+				if (neighbour < level - 1) neighbour = level - 1;
+			}
+		}
+	}
+
+	for (int c = 0; c < hierarchy->clusterCount; ++c) if (repairs[c] >= 2) hierarchy->BuildEntrances(map, c);
+	for (int c = 0; c < hierarchy->clusterCount; ++c) if (repairs[c] >= 1) hierarchy->LinkEntrances(c);
+	for (int c = 0; c < hierarchy->clusterCount; ++c) if (repairs[c] >= 2) hierarchy->BuildIntraDistances(map, c);
+
+	RELEASE_ARRAY(repairs);
+	return hierarchy;
+}
+
+void PathHierarchy::Allocate(const WalkabilityMap& map, int clusterSize)
+{
+	this->clusterSize = clusterSize;
+	width = map.width;
+	height = map.height;
+	origin = map.origin;
+
+	clustersWidth = (width + clusterSize - 1) / clusterSize;
+	clustersHeight = (height + clusterSize - 1) / clusterSize;
+	clusterCount = clustersWidth * clustersHeight;
+
+	// A side of clusterSize tiles has at most one run of walkable tiles every two tiles
+	maxEntrances = 4 * ((clusterSize + 1) / 2);
+
+	entranceCount = new int[clusterCount];
+	entrancePos = new iPoint[clusterCount * maxEntrances];
+	entranceSide = new int[clusterCount * maxEntrances];
+	entranceLink = new int[clusterCount * maxEntrances];
+	intraDistance = new int[clusterCount * maxEntrances * maxEntrances];
+	distance = new int[clusterSize * clusterSize];
+	queue = new int[clusterSize * clusterSize];
+
+	memset(entranceCount, 0, clusterCount * sizeof(int));
+}
+
+void PathHierarchy::CopyFrom(const PathHierarchy& other)
+{
+	memcpy(entranceCount, other.entranceCount, clusterCount * sizeof(int));
+	for (int i = 0; i < clusterCount * maxEntrances; ++i) entrancePos[i] = other.entrancePos[i];
+	memcpy(entranceSide, other.entranceSide, clusterCount * maxEntrances * sizeof(int));
+	memcpy(entranceLink, other.entranceLink, clusterCount * maxEntrances * sizeof(int));
+	memcpy(intraDistance, other.intraDistance, clusterCount * maxEntrances * maxEntrances * sizeof(int));
+}
+
+int PathHierarchy::ClusterOf(const iPoint& pos) const
+{
+	return ((pos.y - origin.y) / clusterSize) * clustersWidth + (pos.x - origin.x) / clusterSize;
+}
+
+SDL_Rect PathHierarchy::GetClusterRect(int cluster) const
+{
+	SDL_Rect rect;
+	rect.x = (cluster % clustersWidth) * clusterSize;
+	rect.y = (cluster / clustersWidth) * clusterSize;
+	rect.w = MIN(clusterSize, (int)width - rect.x);
+	rect.h = MIN(clusterSize, (int)height - rect.y);
+	rect.x += origin.x;
+	rect.y += origin.y;
+
+	return rect;
+}
+
+void PathHierarchy::BuildEntrances(const WalkabilityMap& map, int cluster)
+{
+	entranceCount[cluster] = 0;
+
+	AddBorderEntrances(map, cluster, SIDE_UP);
+	AddBorderEntrances(map, cluster, SIDE_DOWN);
+	AddBorderEntrances(map, cluster, SIDE_LEFT);
+	AddBorderEntrances(map, cluster, SIDE_RIGHT);
+}
+
+// One entrance in the middle of every run of tiles walkable on both sides of the border.
+// The cluster across the border finds the same runs, so both ends can be linked later
+void PathHierarchy::AddBorderEntrances(const WalkabilityMap& map, int cluster, ClusterSide side)
+{
+	SDL_Rect rect = GetClusterRect(cluster);
+
+	iPoint first, step, across;
+	int length;
+	switch (side)
+	{
+	case SIDE_UP: first = iPoint(rect.x, rect.y); step = iPoint(1, 0); across = iPoint(0, -1); length = rect.w; break;
+	case SIDE_DOWN: first = iPoint(rect.x, rect.y + rect.h - 1); step = iPoint(1, 0); across = iPoint(0, 1); length = rect.w; break;
+	case SIDE_LEFT: first = iPoint(rect.x, rect.y); step = iPoint(0, 1); across = iPoint(-1, 0); length = rect.h; break;
+	default: first = iPoint(rect.x + rect.w - 1, rect.y); step = iPoint(0, 1); across = iPoint(1, 0); length = rect.h; break;
+	}
+
+	int runStart = -1;
+	for (int i = 0; i <= length; ++i)
+	{
+		iPoint inside(first.x + step.x * i, first.y + step.y * i);
+		bool open = (i < length && map.IsWalkable(inside) && map.IsWalkable(inside + across));
+
+		if (open && runStart == -1) runStart = i;
+		if (open || runStart == -1) continue;
+
+		int middle = (runStart + i - 1) / 2;
+		int slot = cluster * maxEntrances + entranceCount[cluster]++;
+		entrancePos[slot] = iPoint(first.x + step.x * middle, first.y + step.y * middle);
+		entranceSide[slot] = side;
+		entranceLink[slot] = -1;
+		runStart = -1;
+	}
+}
+
+void PathHierarchy::LinkEntrances(int cluster)
+{
+	const int offsets[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+	const int opposite[4] = { SIDE_DOWN, SIDE_UP, SIDE_RIGHT, SIDE_LEFT };
+
+	for (int i = 0; i < entranceCount[cluster]; ++i)
+	{
+		int slot = cluster * maxEntrances + i;
+		int side = entranceSide[slot];
+		iPoint partner(entrancePos[slot].x + offsets[side][0], entrancePos[slot].y + offsets[side][1]);
+		int neighbour = ClusterOf(partner);
+
+		entranceLink[slot] = -1;
+		for (int j = 0; j < entranceCount[neighbour]; ++j)
+		{
+			int other = neighbour * maxEntrances + j;
+			if (entranceSide[other] == opposite[side] && entrancePos[other] == partner)
+			{
+				entranceLink[slot] = other;
+				break;
+			}
+		}
+	}
+}
+
+void PathHierarchy::BuildIntraDistances(const WalkabilityMap& map, int cluster)
+{
+	SDL_Rect rect = GetClusterRect(cluster);
+
+	for (int i = 0; i < entranceCount[cluster]; ++i)
+	{
+		ClusterDistances(map, rect, entrancePos[cluster * maxEntrances + i], distance, queue);
+
+		for (int j = 0; j < entranceCount[cluster]; ++j)
+		{
+			const iPoint& pos = entrancePos[cluster * maxEntrances + j];
+			intraDistance[(cluster * maxEntrances + i) * maxEntrances + j] = distance[(pos.y - rect.y) * rect.w + (pos.x - rect.x)];
+		}
+	}
+}
+
+void PathHierarchy::ClusterDistances(const WalkabilityMap& map, const SDL_Rect& rect, const iPoint& from, int* distance, int* queue)
+{
+	memset(distance, -1, rect.w * rect.h * sizeof(int));
+
+	if (from.x < rect.x || from.y < rect.y || from.x >= rect.x + rect.w || from.y >= rect.y + rect.h) return;
+	if (map.IsWalkable(from) == false) return;
+
+	const int offsets[4][2] = { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+	int head = 0, tail = 0;
+
+	int start = (from.y - rect.y) * rect.w + (from.x - rect.x);
+	distance[start] = 0;
+	queue[tail++] = start;
+
+	while (head < tail)
+	{
+		int current = queue[head++];
+		int x = rect.x + current % rect.w;
+		int y = rect.y + current / rect.w;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			int nx = x + offsets[i][0];
+			int ny = y + offsets[i][1];
+			if (nx < rect.x || ny < rect.y || nx >= rect.x + rect.w || ny >= rect.y + rect.h) continue;
+
+			int index = (ny - rect.y) * rect.w + (nx - rect.x);
+			if (distance[index] != -1 || map.IsWalkable(iPoint(nx, ny)) == false) continue;
+
+			distance[index] = distance[current] + 1;
+			queue[tail++] = index;
+		}
+	}
+}
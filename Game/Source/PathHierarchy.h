@@ -0,0 +1,90 @@
+#ifndef __PATHHIERARCHY_H__
+#define __PATHHIERARCHY_H__
+
+#include "Point.h"
+
+#include "SDL/include/SDL_rect.h"
+
+#define PATH_CLUSTER_SIZE 10
+
+struct WalkabilityMap;
+
+// Side of a cluster an entrance lies on
+enum ClusterSide
+{
+	SIDE_UP,
+	SIDE_DOWN,
+	SIDE_LEFT,
+	SIDE_RIGHT
+};
+
+// ---------------------------------------------------------------------
+// Abstract graph for hierarchical pathfinding (HPA*). The map is split in
+// square clusters; every run of walkable tiles crossing a cluster border
+// gets one entrance on each side, linked to each other. Entrances of the
+// same cluster are joined by their distance inside the cluster.
+// Abstract node ids are cluster * maxEntrances + slot
+// ---------------------------------------------------------------------
+class PathHierarchy
+{
+public:
+	PathHierarchy();
+	~PathHierarchy();
+
+	// Abstraction of map. With the previous map and its hierarchy only the clusters whose
+	// tiles changed, and their neighbours, are recomputed; the rest is copied
+	static PathHierarchy* Create(const WalkabilityMap& map, int clusterSize, const WalkabilityMap* previous = NULL);
+
+	int ClusterOf(const iPoint& pos) const;
+	SDL_Rect GetClusterRect(int cluster) const;
+
+	inline int GetNodeCount() const { return clusterCount * maxEntrances; }
+	inline int GetMaxEntrances() const { return maxEntrances; }
+	inline int GetClusterSize() const { return clusterSize; }
+	inline int GetEntranceCount(int cluster) const { return entranceCount[cluster]; }
+	inline const iPoint& GetEntrance(int node) const { return entrancePos[node]; }
+	inline int GetLink(int node) const { return entranceLink[node]; }
+
+	// Distance inside the cluster between two of its entrances, -1 if they do not connect
+	inline int GetIntraDistance(int cluster, int from, int to) const
+	{
+		return intraDistance[(cluster * maxEntrances + from) * maxEntrances + to];
+	}
+
+	// Breadth first distance from "from" to every tile of rect without leaving it, -1 where unreachable.
+	// distance and queue need rect.w * rect.h entries
+	static void ClusterDistances(const WalkabilityMap& map, const SDL_Rect& rect, const iPoint& from, int* distance, int* queue);
+
+private:
+	void Allocate(const WalkabilityMap& map, int clusterSize);
+	void CopyFrom(const PathHierarchy& other);
+
+	void BuildEntrances(const WalkabilityMap& map, int cluster);
+	void AddBorderEntrances(const WalkabilityMap& map, int cluster, ClusterSide side);
+	void LinkEntrances(int cluster);
+	void BuildIntraDistances(const WalkabilityMap& map, int cluster);
+
+private:
+	int clusterSize;
+	int clustersWidth;
+	int clustersHeight;
+	int clusterCount;
+	int maxEntrances;
+
+	// map the clusters are laid over
+	uint width;
+	uint height;
+	iPoint origin;
+
+	int* entranceCount;
+	iPoint* entrancePos;
+	int* entranceSide;
+	int* entranceLink;		// node on the other side of the border
+	int* intraDistance;
+
+	// Scratch for the breadth first searches while building
+	int* distance;
+	int* queue;
+};
+
+#endif // __PATHHIERARCHY_H__
@@ -0,0 +1,620 @@
+#include "PathSearch.h"
+#include "PathHierarchy.h"
+#include "SurfaceGraph.h"
+
+#include "Defs.h"
+
+#include <string.h>
+#include <limits.h>
+
+WalkabilityMap* WalkabilityMap::Create(uint width, uint height, const uchar* data, const iPoint& origin)
+{
+	WalkabilityMap* walkability = new WalkabilityMap();
+	walkability->width = width;
+	walkability->height = height;
+	walkability->origin = origin;
+	walkability->hierarchy = NULL;
+	walkability->jumpDistances = NULL;
+	walkability->surfaces = NULL;
+	walkability->map = new uchar[width * height];
+	memcpy(walkability->map, data, width * height);
+	SDL_AtomicSet(&walkability->references, 1);
+
+	return walkability;
+}
+
+void WalkabilityMap::AddRef()
+{
+	SDL_AtomicIncRef(&references);
+}
+
+void WalkabilityMap::Release()
+{
+	if (SDL_AtomicDecRef(&references))
+	{
+		RELEASE_ARRAY(map);
+		RELEASE(hierarchy);
+		RELEASE_ARRAY(jumpDistances);
+		RELEASE(surfaces);
+		delete this;
+	}
+}
+
+// JPS+ tables. Every cell stores, for each direction, the steps to the next jump point
+// (positive) or to the last walkable tile before a wall (zero or negative). A vertical
+// jump stops on any tile where a horizontal jump would find a jump point
+void WalkabilityMap::BuildJumpDistances()
+{
+	RELEASE_ARRAY(jumpDistances);
+	jumpDistances = new short[width * height * JUMP_MAX];
+
+	for (int y = origin.y; y < origin.y + (int)height; ++y)
+	{
+		for (int i = 0; i < (int)width; ++i)
+		{
+			// Right to left for JUMP_RIGHT so the next tile is already known, left to right for JUMP_LEFT
+			iPoint right(origin.x + width - 1 - i, y);
+			iPoint left(origin.x + i, y);
+			jumpDistances[CellIndex(right) * JUMP_MAX + JUMP_RIGHT] = NextJumpDistance(right, JUMP_RIGHT);
+			jumpDistances[CellIndex(left) * JUMP_MAX + JUMP_LEFT] = NextJumpDistance(left, JUMP_LEFT);
+		}
+	}
+
+	for (int x = origin.x; x < origin.x + (int)width; ++x)
+	{
+		for (int i = 0; i < (int)height; ++i)
+		{
+			iPoint down(x, origin.y + height - 1 - i);
+			iPoint up(x, origin.y + i);
+			jumpDistances[CellIndex(down) * JUMP_MAX + JUMP_DOWN] = NextJumpDistance(down, JUMP_DOWN);
+			jumpDistances[CellIndex(up) * JUMP_MAX + JUMP_UP] = NextJumpDistance(up, JUMP_UP);
+		}
+	}
+}
+
+short WalkabilityMap::NextJumpDistance(const iPoint& pos, JumpDirection direction) const
+{
+	const int offsets[JUMP_MAX][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+	int dx = offsets[direction][0];
+	int dy = offsets[direction][1];
+
+	iPoint next(pos.x + dx, pos.y + dy);
+	if (IsWalkable(next) == false) return 0;
+
+	if (dx != 0)
+	{
+		if (IsHorizontalJumpPoint(next, dx)) return 1;
+	}
+	else if (IsVerticalJumpPoint(next, dy) ||
+		jumpDistances[CellIndex(next) * JUMP_MAX + JUMP_LEFT] > 0 || jumpDistances[CellIndex(next) * JUMP_MAX + JUMP_RIGHT] > 0)
+	{
+		return 1;
+	}
+
+	short distance = jumpDistances[CellIndex(next) * JUMP_MAX + direction];
+	return (distance > 0) ? distance + 1 : distance - 1;
+}
+
+// Forced neighbours: a tile beside the line that can only be reached optimally through pos
+bool WalkabilityMap::IsHorizontalJumpPoint(const iPoint& pos, int dx) const
+{
+	return (IsWalkable(iPoint(pos.x, pos.y - 1)) && !IsWalkable(iPoint(pos.x - dx, pos.y - 1))) ||
+		(IsWalkable(iPoint(pos.x, pos.y + 1)) && !IsWalkable(iPoint(pos.x - dx, pos.y + 1)));
+}
+
+bool WalkabilityMap::IsVerticalJumpPoint(const iPoint& pos, int dy) const
+{
+	return (IsWalkable(iPoint(pos.x - 1, pos.y)) && !IsWalkable(iPoint(pos.x - 1, pos.y - dy))) ||
+		(IsWalkable(iPoint(pos.x + 1, pos.y)) && !IsWalkable(iPoint(pos.x + 1, pos.y - dy)));
+}
+
+PathSearch::PathSearch() : nodes(NULL), openHeap(NULL), closed(NULL), nodeCapacity(0), openCount(0), generation(0),
+	walkability(NULL), hierarchy(NULL), jumping(false), goal(-1), state(SEARCH_IDLE), startNode(-1), startCluster(-1), goalCluster(-1),
+	directDistance(-1), startDistance(NULL), goalDistance(NULL), clusterDistance(NULL), clusterQueue(NULL),
+	entranceCapacity(0), clusterCapacity(0)
+{}
+
+PathSearch::~PathSearch()
+{
+	End();
+	Release();
+}
+
+void PathSearch::Release()
+{
+	RELEASE_ARRAY(nodes);
+	RELEASE_ARRAY(openHeap);
+	RELEASE_ARRAY(closed);
+	nodeCapacity = 0;
+
+	ReleaseClusterBuffers();
+}
+
+void PathSearch::ReleaseClusterBuffers()
+{
+	RELEASE_ARRAY(startDistance);
+	RELEASE_ARRAY(goalDistance);
+	RELEASE_ARRAY(clusterDistance);
+	RELEASE_ARRAY(clusterQueue);
+	entranceCapacity = 0;
+	clusterCapacity = 0;
+}
+
+void PathSearch::Reserve(uint count)
+{
+	if (count <= nodeCapacity) return;
+
+	RELEASE_ARRAY(nodes);
+	RELEASE_ARRAY(openHeap);
+	RELEASE_ARRAY(closed);
+
+	nodeCapacity = count;
+	nodes = new PathNode[nodeCapacity];
+	openHeap = new int[nodeCapacity];
+	closed = new uint[(nodeCapacity + 31) / 32];
+
+	// Generation 0 is never used by a search, so every node starts unvisited
+	memset(nodes, 0, nodeCapacity * sizeof(PathNode));
+	generation = 0;
+}
+
+// Open heap -----------------------------------------------------------------------
+// Lowest score first, ties go to the node closest to the destination
+// ---------------------------------------------------------------------------------
+bool PathSearch::HeapLess(int a, int b) const
+{
+	const PathNode& nodeA = nodes[a];
+	const PathNode& nodeB = nodes[b];
+
+	if (nodeA.Score() != nodeB.Score()) return nodeA.Score() < nodeB.Score();
+	return nodeA.heuristic < nodeB.heuristic;
+}
+
+void PathSearch::HeapUp(int index)
+{
+	int cell = openHeap[index];
+	while (index > 0)
+	{
+		int parentIndex = (index - 1) / 2;
+		if (HeapLess(cell, openHeap[parentIndex]) == false) break;
+
+		openHeap[index] = openHeap[parentIndex];
+		nodes[openHeap[index]].heapIndex = index;
+		index = parentIndex;
+	}
+	openHeap[index] = cell;
+	nodes[cell].heapIndex = index;
+}
+
+void PathSearch::HeapDown(int index)
+{
+	int cell = openHeap[index];
+	while (true)
+	{
+		int child = index * 2 + 1;
+		if (child >= openCount) break;
+		if (child + 1 < openCount && HeapLess(openHeap[child + 1], openHeap[child])) ++child;
+		if (HeapLess(openHeap[child], cell) == false) break;
+
+		openHeap[index] = openHeap[child];
+		nodes[openHeap[index]].heapIndex = index;
+		index = child;
+	}
+	openHeap[index] = cell;
+	nodes[cell].heapIndex = index;
+}
+
+void PathSearch::HeapPush(int cell)
+{
+	openHeap[openCount] = cell;
+	HeapUp(openCount++);
+}
+
+int PathSearch::HeapPop()
+{
+	int cell = openHeap[0];
+	nodes[cell].heapIndex = -1;
+
+	if (--openCount > 0)
+	{
+		openHeap[0] = openHeap[openCount];
+		HeapDown(0);
+	}
+	return cell;
+}
+
+// ----------------------------------------------------------------------------------
+// Actual A* algorithm, split so it can be advanced a few expansions at a time ------
+// When the map has a hierarchy it runs over the cluster entrances instead of the
+// tiles, and GetPath refines the abstract path one cluster at a time
+// ----------------------------------------------------------------------------------
+bool PathSearch::Begin(WalkabilityMap* walkability, const iPoint& origin, const iPoint& destination, PathMode mode)
+{
+	End();
+
+	if (!walkability->IsWalkable(origin) || !walkability->IsWalkable(destination))
+	{
+		state = SEARCH_FAILED;
+		return false;
+	}
+
+	// The map stays alive until End even if SetMap replaces it meanwhile
+	this->walkability = walkability;
+	walkability->AddRef();
+	hierarchy = (mode == PATH_MODE_HIERARCHICAL) ? walkability->hierarchy : NULL;
+	jumping = (mode == PATH_MODE_JPS);
+
+	uint count = (hierarchy != NULL) ? hierarchy->GetNodeCount() + 2 : walkability->width * walkability->height;
+	Reserve(count);
+
+	// A new generation invalidates every node of the previous search without touching them
+	if (++generation == 0)
+	{
+		memset(nodes, 0, nodeCapacity * sizeof(PathNode));
+		generation = 1;
+	}
+	memset(closed, 0, ((count + 31) / 32) * sizeof(uint));
+	openCount = 0;
+
+	this->origin = origin;
+	this->destination = destination;
+
+	int start;
+	if (hierarchy != NULL)
+	{
+		BeginAbstract();
+		start = startNode;
+	}
+	else
+	{
+		start = walkability->CellIndex(origin);
+		goal = walkability->CellIndex(destination);
+	}
+
+	Open(start, 0, origin, -1);
+
+	state = SEARCH_RUNNING;
+	return true;
+}
+
+// Connects origin and destination to the entrances of their clusters
+void PathSearch::BeginAbstract()
+{
+	int maxEntrances = hierarchy->GetMaxEntrances();
+	int clusterTiles = hierarchy->GetClusterSize() * hierarchy->GetClusterSize();
+
+	if (maxEntrances > entranceCapacity || clusterTiles > clusterCapacity)
+	{
+		ReleaseClusterBuffers();
+		entranceCapacity = maxEntrances;
+		clusterCapacity = clusterTiles;
+		startDistance = new int[entranceCapacity];
+		goalDistance = new int[entranceCapacity];
+		clusterDistance = new int[clusterCapacity];
+		clusterQueue = new int[clusterCapacity];
+	}
+
+	startNode = hierarchy->GetNodeCount();
+	goal = startNode + 1;
+	startCluster = hierarchy->ClusterOf(origin);
+	goalCluster = hierarchy->ClusterOf(destination);
+
+	SDL_Rect rect = hierarchy->GetClusterRect(startCluster);
+	PathHierarchy::ClusterDistances(*walkability, rect, origin, clusterDistance, clusterQueue);
+	for (int i = 0; i < hierarchy->GetEntranceCount(startCluster); ++i)
+	{
+		const iPoint& pos = hierarchy->GetEntrance(startCluster * maxEntrances + i);
+		startDistance[i] = clusterDistance[(pos.y - rect.y) * rect.w + (pos.x - rect.x)];
+	}
+	directDistance = (startCluster == goalCluster) ? clusterDistance[(destination.y - rect.y) * rect.w + (destination.x - rect.x)] : -1;
+
+	rect = hierarchy->GetClusterRect(goalCluster);
+	PathHierarchy::ClusterDistances(*walkability, rect, destination, clusterDistance, clusterQueue);
+	for (int i = 0; i < hierarchy->GetEntranceCount(goalCluster); ++i)
+	{
+		const iPoint& pos = hierarchy->GetEntrance(goalCluster * maxEntrances + i);
+		goalDistance[i] = clusterDistance[(pos.y - rect.y) * rect.w + (pos.x - rect.x)];
+	}
+}
+
+// Adds a node to the open set or lowers its cost if it is already there
+void PathSearch::Open(int index, int costSoFar, const iPoint& pos, int parent)
+{
+	if (closed[index >> 5] & (1u << (index & 31))) return;
+
+	PathNode& node = nodes[index];
+	if (node.generation != generation)
+	{
+		node.costSoFar = costSoFar;
+		node.heuristic = pos.DistanceManhattan(destination);
+		node.parent = parent;
+		node.generation = generation;
+		HeapPush(index);
+	}
+	else if (costSoFar < node.costSoFar)
+	{
+		// Decrease key, the node only moves up
+		node.costSoFar = costSoFar;
+		node.parent = parent;
+		HeapUp(node.heapIndex);
+	}
+}
+
+SearchState PathSearch::Step(int maxExpansions, int& expanded)
+{
+	expanded = 0;
+	if (state != SEARCH_RUNNING) return state;
+
+	while (openCount > 0 && expanded < maxExpansions)
+	{
+		int current = HeapPop();
+		closed[current >> 5] |= 1u << (current & 31);
+		++expanded;
+
+		if (current == goal)
+		{
+			state = SEARCH_FOUND;
+			return state;
+		}
+
+		if (hierarchy != NULL) ExpandAbstract(current);
+		else if (jumping) ExpandJumps(current);
+		else ExpandTile(current);
+	}
+
+	if (openCount == 0) state = SEARCH_FAILED;
+	return state;
+}
+
+void PathSearch::ExpandTile(int current)
+{
+	const int offsets[4][2] = { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+
+	iPoint pos = walkability->CellPosition(current);
+	int costSoFar = nodes[current].costSoFar + 1;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		iPoint cell(pos.x + offsets[i][0], pos.y + offsets[i][1]);
+		if (walkability->IsWalkable(cell)) Open(walkability->CellIndex(cell), costSoFar, cell, current);
+	}
+}
+
+// Jump point search for 4 connected grids. Moving horizontally only the way forward
+// and the tiles above and below are followed, moving vertically only the way forward
+// and the sides. Jumps skip the tiles in between, which every optimal path can cross
+// in this order, so only the tiles where a path may turn are expanded
+void PathSearch::ExpandJumps(int current)
+{
+	const int offsets[JUMP_MAX][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+
+	iPoint pos = walkability->CellPosition(current);
+	int costSoFar = nodes[current].costSoFar;
+
+	int dx = 0, dy = 0;
+	if (nodes[current].parent != -1)
+	{
+		iPoint parent = walkability->CellPosition(nodes[current].parent);
+		dx = (pos.x > parent.x) - (pos.x < parent.x);
+		dy = (pos.y > parent.y) - (pos.y < parent.y);
+	}
+
+	for (int i = 0; i < JUMP_MAX; ++i)
+	{
+		// Pruned: going back, and sideways along the axis the node was reached on
+		if (dx != 0 && offsets[i][0] != 0 && offsets[i][0] != dx) continue;
+		if (dy != 0 && offsets[i][1] != 0 && offsets[i][1] != dy) continue;
+
+		iPoint jump;
+		bool found = (walkability->jumpDistances != NULL) ? JumpTable(pos, (JumpDirection)i, jump) : Jump(pos, offsets[i][0], offsets[i][1], jump);
+		if (found) Open(walkability->CellIndex(jump), costSoFar + pos.DistanceManhattan(jump), jump, current);
+	}
+}
+
+bool PathSearch::Jump(const iPoint& pos, int dx, int dy, iPoint& jump) const
+{
+	iPoint cell = pos;
+	iPoint side;
+
+	while (true)
+	{
+		cell.x += dx;
+		cell.y += dy;
+
+		if (walkability->IsWalkable(cell) == false) return false;
+		if (cell == destination) break;
+
+		if (dx != 0)
+		{
+			if (walkability->IsHorizontalJumpPoint(cell, dx)) break;
+		}
+		else if (walkability->IsVerticalJumpPoint(cell, dy) || Jump(cell, 1, 0, side) || Jump(cell, -1, 0, side))
+		{
+			break;
+		}
+	}
+
+	jump = cell;
+	return true;
+}
+
+// Same as Jump reading the JPS+ tables, only the destination has to be checked on the way
+bool PathSearch::JumpTable(const iPoint& pos, JumpDirection direction, iPoint& jump) const
+{
+	short distance = walkability->jumpDistances[walkability->CellIndex(pos) * JUMP_MAX + direction];
+	int reach = (distance > 0) ? distance : -distance;
+
+	if (direction == JUMP_LEFT || direction == JUMP_RIGHT)
+	{
+		int dx = (direction == JUMP_RIGHT) ? 1 : -1;
+		int steps = (destination.x - pos.x) * dx;
+		if (destination.y == pos.y && steps > 0 && steps <= reach)
+		{
+			jump = destination;
+			return true;
+		}
+		if (distance <= 0) return false;
+
+		jump = iPoint(pos.x + dx * distance, pos.y);
+		return true;
+	}
+
+	int dy = (direction == JUMP_DOWN) ? 1 : -1;
+	int steps = (destination.y - pos.y) * dy;
+	if (steps > 0 && steps <= reach)
+	{
+		// On the destination row the horizontal jump from the line may reach it
+		iPoint row(pos.x, destination.y);
+		int across = abs(destination.x - pos.x);
+		short side = walkability->jumpDistances[walkability->CellIndex(row) * JUMP_MAX + ((destination.x > pos.x) ? JUMP_RIGHT : JUMP_LEFT)];
+		if (across == 0 || across <= ((side > 0) ? side : -side))
+		{
+			jump = row;
+			return true;
+		}
+	}
+	if (distance <= 0) return false;
+
+	jump = iPoint(pos.x, pos.y + dy * distance);
+	return true;
+}
+
+void PathSearch::ExpandAbstract(int current)
+{
+	int maxEntrances = hierarchy->GetMaxEntrances();
+	int costSoFar = nodes[current].costSoFar;
+
+	if (current == startNode)
+	{
+		for (int i = 0; i < hierarchy->GetEntranceCount(startCluster); ++i)
+		{
+			int node = startCluster * maxEntrances + i;
+			if (startDistance[i] >= 0) Open(node, costSoFar + startDistance[i], hierarchy->GetEntrance(node), current);
+		}
+		if (directDistance >= 0) Open(goal, costSoFar + directDistance, destination, current);
+		return;
+	}
+
+	int cluster = current / maxEntrances;
+	int slot = current % maxEntrances;
+
+	for (int i = 0; i < hierarchy->GetEntranceCount(cluster); ++i)
+	{
+		int distance = hierarchy->GetIntraDistance(cluster, slot, i);
+		int node = cluster * maxEntrances + i;
+		if (i != slot && distance >= 0) Open(node, costSoFar + distance, hierarchy->GetEntrance(node), current);
+	}
+
+	int link = hierarchy->GetLink(current);
+	if (link >= 0) Open(link, costSoFar + 1, hierarchy->GetEntrance(link), current);
+
+	if (cluster == goalCluster && goalDistance[slot] >= 0) Open(goal, costSoFar + goalDistance[slot], destination, current);
+}
+
+iPoint PathSearch::NodePosition(int node) const
+{
+	if (hierarchy == NULL) return walkability->CellPosition(node);
+	if (node == startNode) return origin;
+	if (node == goal) return destination;
+
+	return hierarchy->GetEntrance(node);
+}
+
+int PathSearch::GetPath(DynArray<iPoint>& path)
+{
+	if (state != SEARCH_FOUND) return -1;
+
+	// Walk the parents back from the destination, the open heap is free once the search is done
+	int waypoints = 0;
+	for (int node = goal; node != -1; node = nodes[node].parent)
+	{
+		openHeap[waypoints++] = node;
+	}
+
+	path.PushBack(origin);
+	int counter = 1;
+
+	for (int i = waypoints - 2; i >= 0; --i)
+	{
+		iPoint from = NodePosition(openHeap[i + 1]);
+		iPoint to = NodePosition(openHeap[i]);
+		if (from == to) continue;
+
+		// Tiles and linked entrances are next to each other, entrances of one cluster need the tiles between them
+		if (hierarchy != NULL && hierarchy->ClusterOf(from) == hierarchy->ClusterOf(to))
+		{
+			counter += RefineSegment(from, to, path);
+		}
+		else
+		{
+			// Jump points are on the same row or column, plain A* steps are next to each other
+			iPoint pos = from;
+			while (pos != to)
+			{
+				pos.x += (to.x > pos.x) - (to.x < pos.x);
+				pos.y += (to.y > pos.y) - (to.y < pos.y);
+				path.PushBack(pos);
+				++counter;
+			}
+		}
+	}
+	return counter;
+}
+
+// Tiles from "from" (excluded) to "to" without leaving their cluster, following the
+// distances to "to" downhill
+int PathSearch::RefineSegment(const iPoint& from, const iPoint& to, DynArray<iPoint>& path)
+{
+	const int offsets[4][2] = { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+
+	SDL_Rect rect = hierarchy->GetClusterRect(hierarchy->ClusterOf(from));
+	PathHierarchy::ClusterDistances(*walkability, rect, to, clusterDistance, clusterQueue);
+
+	iPoint pos = from;
+	int distance = clusterDistance[(pos.y - rect.y) * rect.w + (pos.x - rect.x)];
+	int counter = 0;
+
+	while (distance > 0)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			iPoint cell(pos.x + offsets[i][0], pos.y + offsets[i][1]);
+			if (cell.x < rect.x || cell.y < rect.y || cell.x >= rect.x + rect.w || cell.y >= rect.y + rect.h) continue;
+
+			if (clusterDistance[(cell.y - rect.y) * rect.w + (cell.x - rect.x)] == distance - 1)
+			{
+				pos = cell;
+				break;
+			}
+		}
+
+		path.PushBack(pos);
+		++counter;
+		--distance;
+	}
+	return counter;
+}
+
+void PathSearch::End()
+{
+	if (walkability != NULL) walkability->Release();
+	walkability = NULL;
+	hierarchy = NULL;
+	jumping = false;
+	state = SEARCH_IDLE;
+}
+
+int PathSearch::Run(WalkabilityMap* walkability, const iPoint& origin, const iPoint& destination, DynArray<iPoint>& path, PathMode mode)
+{
+	int expanded = 0;
+	int counter = -1;
+
+	if (Begin(walkability, origin, destination, mode))
+	{
+		Step(INT_MAX, expanded);
+		counter = GetPath(path);
+	}
+	End();
+
+	return counter;
+}
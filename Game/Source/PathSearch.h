@@ -0,0 +1,200 @@
+#ifndef __PATHSEARCH_H__
+#define __PATHSEARCH_H__
+
+#include "Point.h"
+#include "DynArray.h"
+
+#include "SDL/include/SDL.h"
+
+#define INVALID_WALK_CODE 255
+
+class PathHierarchy;
+class SurfaceGraph;
+
+// How a search moves over the map
+enum PathMode
+{
+	PATH_MODE_DEFAULT,		// the one set in config.xml
+	PATH_MODE_ASTAR,		// tile by tile
+	PATH_MODE_JPS,			// jump point search, JPS+ if the map has jump distances
+	PATH_MODE_HIERARCHICAL	// over the cluster entrances, tile by tile if the map has no hierarchy
+};
+
+enum JumpDirection
+{
+	JUMP_UP,
+	JUMP_DOWN,
+	JUMP_LEFT,
+	JUMP_RIGHT,
+	JUMP_MAX
+};
+
+// ---------------------------------------------------------------------
+// Walkability map shared by the main thread and the path workers.
+// Never modified once created: SetMap replaces it with a new one and
+// the old one is deleted when the last search using it releases it
+// ---------------------------------------------------------------------
+struct WalkabilityMap
+{
+	static WalkabilityMap* Create(uint width, uint height, const uchar* data, const iPoint& origin);
+
+	void AddRef();
+	void Release();
+
+	// Precomputes the jump distances for JPS+
+	void BuildJumpDistances();
+	bool IsHorizontalJumpPoint(const iPoint& pos, int dx) const;
+	bool IsVerticalJumpPoint(const iPoint& pos, int dy) const;
+	short NextJumpDistance(const iPoint& pos, JumpDirection direction) const;
+
+	// Utility: return true if pos is inside the map boundaries
+	inline bool CheckBoundaries(const iPoint& pos) const
+	{
+		return (pos.x >= origin.x && pos.x < origin.x + (int)width &&
+			pos.y >= origin.y && pos.y < origin.y + (int)height);
+	}
+
+	// Utility: return the walkability value of a tile
+	inline uchar GetTileCost(const iPoint& pos) const
+	{
+		return CheckBoundaries(pos) ? map[CellIndex(pos)] : INVALID_WALK_CODE;
+	}
+
+	// Utility: returns true is the tile is walkable
+	inline bool IsWalkable(const iPoint& pos) const
+	{
+		uchar t = GetTileCost(pos);
+		return t != INVALID_WALK_CODE && t != 254;
+	}
+
+	inline int CellIndex(const iPoint& pos) const { return (pos.y - origin.y) * width + (pos.x - origin.x); }
+	inline iPoint CellPosition(int index) const { return iPoint(origin.x + index % (int)width, origin.y + index / (int)width); }
+
+	// size of the map
+	uint width;
+	uint height;
+
+	// map tile of the first cell, infinite maps only hand the resident window
+	iPoint origin;
+
+	// all map walkability values [0..255]
+	uchar* map;
+
+	// Cluster abstraction for long searches, NULL if disabled
+	PathHierarchy* hierarchy;
+
+	// JUMP_MAX distances per cell for JPS+, NULL if disabled
+	short* jumpDistances;
+
+	// Spans and jumps of ground walkers, NULL until one tells how it moves
+	SurfaceGraph* surfaces;
+
+	SDL_atomic_t references;
+};
+
+// ---------------------------------------------------------------------
+// Pathnode: search state of a cell, kept in an arena the size of the map.
+// Only valid while generation matches the search being run
+// ---------------------------------------------------------------------
+struct PathNode
+{
+	int costSoFar;
+	int heuristic;
+	int parent;		// cell index of the previous node, -1 for the origin
+	int heapIndex;	// position in the open heap, -1 once closed
+	uint generation;
+
+	// Calculates this tile score
+	inline int Score() const { return costSoFar + heuristic; }
+};
+
+enum SearchState
+{
+	SEARCH_IDLE,
+	SEARCH_RUNNING,
+	SEARCH_FOUND,
+	SEARCH_FAILED
+};
+
+// ---------------------------------------------------------------------
+// A* search with its own buffers, one per thread that searches paths.
+// Buffers only grow, so searches on the same map do not allocate.
+// Open and closed sets persist between Step calls so a search can be
+// spread over several frames
+// ---------------------------------------------------------------------
+class PathSearch
+{
+public:
+	PathSearch();
+	~PathSearch();
+
+	// Whole search at once: returns the number of tiles of the path, added to path from origin to destination, or -1
+	int Run(WalkabilityMap* walkability, const iPoint& origin, const iPoint& destination, DynArray<iPoint>& path, PathMode mode = PATH_MODE_ASTAR);
+
+	// Resumable search: Begin, Step until it is no longer running, GetPath and End
+	bool Begin(WalkabilityMap* walkability, const iPoint& origin, const iPoint& destination, PathMode mode = PATH_MODE_ASTAR);
+	SearchState Step(int maxExpansions, int& expanded);
+	int GetPath(DynArray<iPoint>& path);
+	void End();
+
+	inline SearchState GetState() const { return state; }
+
+	// Grows the search buffers to fit a map with this many cells
+	void Reserve(uint count);
+
+	void Release();
+
+private:
+	// Open set: binary min heap of cell indices ordered by score
+	void HeapPush(int cell);
+	int HeapPop();
+	void HeapUp(int index);
+	void HeapDown(int index);
+	bool HeapLess(int a, int b) const;
+
+	void Open(int index, int costSoFar, const iPoint& pos, int parent);
+	void ExpandTile(int current);
+
+	// Jump point search
+	void ExpandJumps(int current);
+	bool Jump(const iPoint& pos, int dx, int dy, iPoint& jump) const;
+	bool JumpTable(const iPoint& pos, JumpDirection direction, iPoint& jump) const;
+
+	// Abstract graph of the hierarchy: entrances plus the origin and destination nodes
+	void BeginAbstract();
+	void ExpandAbstract(int current);
+	int RefineSegment(const iPoint& from, const iPoint& to, DynArray<iPoint>& path);
+	iPoint NodePosition(int node) const;
+	void ReleaseClusterBuffers();
+
+private:
+	PathNode* nodes;
+	int* openHeap;
+	uint* closed;
+	uint nodeCapacity;
+	int openCount;
+	uint generation;
+
+	// Search in progress, holds a reference to its map until End
+	WalkabilityMap* walkability;
+	const PathHierarchy* hierarchy;
+	bool jumping;
+	iPoint origin;
+	iPoint destination;
+	int goal;
+	SearchState state;
+
+	// Abstract search: distances from origin and to destination inside their clusters
+	int startNode;
+	int startCluster;
+	int goalCluster;
+	int directDistance;
+	int* startDistance;
+	int* goalDistance;
+	int* clusterDistance;
+	int* clusterQueue;
+	int entranceCapacity;
+	int clusterCapacity;
+};
+
+#endif // __PATHSEARCH_H__
@@ -8,6 +8,8 @@
 
 #include "SDL/include/SDL.h"
 
+#define PHYSICS_TILE_SIZE 64
+
 
 class Collider;
 
@@ -52,80 +54,32 @@ public:
 
 
 	// Collisions
-	void ResolveCollisions(SDL_Rect& currentFrame, iPoint nextFrame, bool goingLeft)
+	// Moves currentFrame to nextFrame, X first and then Y, stopping each axis at the first
+	// blocking tile the box would enter. Returns the normals of the faces it hit, 0 on a free axis
+	iPoint ResolveCollisions(SDL_Rect& currentFrame, iPoint nextFrame)
 	{
-		iPoint tiledPos(currentFrame.x / 64, currentFrame.y / 64);
-		iPoint correctedPos;
-		iPoint checkedPos;
-		//LOG("past: %d,%d current: %d,%d\n", playerRect.x, playerRect.y, nextFrame.x, nextFrame.y);
+		iPoint normal(0, 0);
 
 		// X axis
-		if (!goingLeft) { // right
-			tiledPos.x = (currentFrame.x + currentFrame.w) / 64;
-			int i = 0;
-			while ((app->map->GetTileProperty(tiledPos.x + i, tiledPos.y, "Collider") == Collider::Type::AIR || app->map->GetTileProperty(tiledPos.x + i,  tiledPos.y,  "Collider") == Collider::Type::BOX || app->map->GetTileProperty(tiledPos.x+i, tiledPos.y, "Collider") == Collider::Type::CHECKPOINT) && i < 5)
-			{
-				i++;
-			}
-			i--;
-			correctedPos.x = MIN(nextFrame.x - currentFrame.x, (tiledPos.x + i) * 64 - currentFrame.x);
-		}
-		else { // left
-			int i = 0;
-			while ((app->map->GetTileProperty(tiledPos.x - i, tiledPos.y, "Collider") == Collider::Type::AIR || app->map->GetTileProperty(tiledPos.x - i, tiledPos.y, "Collider") == Collider::Type::BOX || app->map->GetTileProperty(tiledPos.x - i, tiledPos.y, "Collider") == Collider::Type::CHECKPOINT) && i < 5)
-			{
-				i++;
-			}
-			i--;
-			correctedPos.x = -MIN(currentFrame.x - nextFrame.x, currentFrame.x - (tiledPos.x - i) * 64);
-		}
+		int rowMin = FloorTile(currentFrame.y), rowMax = FloorTile(currentFrame.y + currentFrame.h - 1);
+		int deltaX = nextFrame.x - currentFrame.x;
+		int leadX = (deltaX > 0) ? currentFrame.x + currentFrame.w : currentFrame.x;
+		currentFrame.x += Sweep(leadX, deltaX, rowMin, rowMax, true, normal.x);
 
 		// Y axis
+		int columnMin = FloorTile(currentFrame.x), columnMax = FloorTile(currentFrame.x + currentFrame.w - 1);
+		int deltaY = nextFrame.y - currentFrame.y;
 
-		if (positiveSpeedY) {
-			tiledPos.y = (currentFrame.y + currentFrame.h) / 64;
-			int i = 0;
-			while ((app->map->GetTileProperty(tiledPos.x, tiledPos.y + i, "Collider") == Collider::Type::AIR || app->map->GetTileProperty(tiledPos.x, tiledPos.y + i, "Collider") == Collider::Type::BOX || app->map->GetTileProperty(tiledPos.x, tiledPos.y + i, "Collider") == Collider::Type::CHECKPOINT) && i < 5)
-			{
-				i++;
-			}
-			i--;
-			correctedPos.y = MIN(nextFrame.y - currentFrame.y, (tiledPos.y + i) * 64 - currentFrame.y);
-		}
-		else {
-			int i = 0;
-			while (app->map->GetTileProperty(tiledPos.x, tiledPos.y - i, "Collider") == Collider::Type::AIR || app->map->GetTileProperty(tiledPos.x, tiledPos.y - i, "Collider") == Collider::Type::BOX && i < 5)
-			{
-				i++;
-			}
-			i--;
-			correctedPos.y = -MIN(currentFrame.y - nextFrame.y, currentFrame.y - (tiledPos.y - i) * 64);
-		}
-
-		currentFrame.x += correctedPos.x;
-		currentFrame.y += correctedPos.y;
-
-
-		if (app->map->GetTileProperty(currentFrame.x / 64 + 1, currentFrame.y / 64, "Collider") == Collider::Type::SOLID)
-		{
-			speed.x = 0.0f;
-			currentFrame.x -= correctedPos.x;
-			
-		}
-		else if (app->map->GetTileProperty(currentFrame.x / 64, currentFrame.y / 64, "Collider") == Collider::Type::SOLID)
-		{
-			speed.x = 0.0f;
-			currentFrame.x -= correctedPos.x;
-			
-		}
-		else if (app->map->GetTileProperty(currentFrame.x / 64, currentFrame.y / 64 + 1, "Collider") == Collider::Type::SOLID) {
-			speed.y = 0.0f;
-		}
-		else if (app->map->GetTileProperty(currentFrame.x / 64, currentFrame.y / 64, "Collider") == Collider::Type::SOLID ) {
-			speed.y = 0.0f;
-		}
+		// Resting on the ground is a contact even before gravity moves the box a whole pixel
+		bool resting = (deltaY == 0 && speed.y >= 0.0f);
+		int leadY = (deltaY > 0 || resting) ? currentFrame.y + currentFrame.h : currentFrame.y;
+		int movedY = Sweep(leadY, (resting) ? 1 : deltaY, columnMin, columnMax, false, normal.y);
+		if (!resting) currentFrame.y += movedY;
 
+		if (normal.x != 0) speed.x = 0.0f;
+		if (normal.y != 0) speed.y = 0.0f;
 
+		return normal;
 	}
 
 	bool axisY;
@@ -135,6 +89,43 @@ public:
 	fPoint speed;
 	float gravity = 950.0f;
 
+private:
+
+	// Tiles a body can not go into, boxes are platforms the player stands on by itself
+	static bool IsBlocking(Collider::Type type)
+	{
+		return type != Collider::Type::AIR && type != Collider::Type::BOX && type != Collider::Type::CHECKPOINT;
+	}
+
+	static int FloorTile(int pixel)
+	{
+		return (pixel >= 0) ? pixel / PHYSICS_TILE_SIZE : -((PHYSICS_TILE_SIZE - 1 - pixel) / PHYSICS_TILE_SIZE);
+	}
+
+	// Distance a face at lead covers of delta before it enters a blocking tile. Walks the
+	// tile lines it crosses in order, checking the tiles from crossMin to crossMax on each,
+	// so the box stops at the first one whatever the length of the step
+	int Sweep(int lead, int delta, int crossMin, int crossMax, bool horizontal, int& normal) const
+	{
+		if (delta == 0) return 0;
+
+		int step = (delta > 0) ? 1 : -1;
+		int first = (delta > 0) ? FloorTile(lead + PHYSICS_TILE_SIZE - 1) : FloorTile(lead) - 1;
+		int last = (delta > 0) ? FloorTile(lead + delta - 1) : FloorTile(lead + delta);
+
+		for (int line = first; line * step <= last * step; line += step)
+		{
+			for (int cross = crossMin; cross <= crossMax; ++cross)
+			{
+				Collider::Type type = (horizontal) ? app->map->GetColliderType(line, cross) : app->map->GetColliderType(cross, line);
+				if (IsBlocking(type) == false) continue;
+
+				normal = -step;
+				return ((delta > 0) ? line : line + 1) * PHYSICS_TILE_SIZE - lead;
+			}
+		}
+		return delta;
+	}
 };
 
 #endif // !__PHYSICS_H__
\ No newline at end of file
@@ -21,15 +21,11 @@
 Player::Player(int x, int y) : Entity(x, y, EntityType::PLAYER)
 {
 
-	entityRect = { x,y,idle.GetCurrentFrame().w,idle.GetCurrentFrame().h };
+	entityRect = { x, y, 64, 64 };
 	specialAttackRect = { 0,0,normal.GetCurrentFrame().w,normal.GetCurrentFrame().h };
 
 	pendingToDelete = false;
-	collider = app->collisions->AddCollider(entityRect, Collider::Type::PLAYER, (Module*)app->entityManager);
-	if (hurtBox != nullptr)
-	{
-		hurtBox->pendingToDelete = true;
-	}
+	collider = app->collisions->AddCollider(entityRect, Collider::Type::PLAYER, (Module*)app->entityManager, this);
 	specialBarRectOne = { 0 , 0 , 64, 15 };
 	specialBarRectTwo = { 0 ,15 , 64, 9 };
 	specialBarRectThree = { entityRect.x + 5,entityRect.y + 73,0,9 };
@@ -121,10 +117,7 @@ Player::Player(int x, int y) : Entity(x, y, EntityType::PLAYER)
 
 Player::~Player()
 {
-	if (hurtBox != nullptr)
-	{
-		hurtBox->pendingToDelete = true;
-	}
+	app->collisions->RemoveCollider(hurtBox);
 }
 
 
@@ -246,19 +239,21 @@ bool Player::Update(float dt)
 
 			app->audio->PlayFx(app->entityManager->attackSFX, 0);
 			currentAnimation = &attack;
+			// The box of the previous attack would stay behind where it was last placed
+			app->collisions->RemoveCollider(hurtBox);
 			hurtBox = app->collisions->AddCollider(currentAnimation->GetCurrentFrame(), Collider::Type::ATTACK, (Module*)app->entityManager);
 		}
 
-
-		if (hurtBox != nullptr)
+		Collider* attackBox = app->collisions->GetCollider(hurtBox);
+		if (attackBox != nullptr)
 		{
 			if (inverted && currentAnimation == &attack)
 			{
-				hurtBox->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
+				attackBox->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
 			}
 			else
 			{
-				hurtBox->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
+				attackBox->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
 			}
 		}
 
@@ -373,11 +368,12 @@ bool Player::Update(float dt)
 		playerPhysics.UpdatePhysics(nextFrame, dt);
 
 		//collision 
-		playerPhysics.ResolveCollisions(entityRect, nextFrame, inverted);
+		iPoint contact = playerPhysics.ResolveCollisions(entityRect, nextFrame);
 
 		//LOG("player: x: %d y: %d", playerRect.x, playerRect.y);
 
-		if (app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64 + 1, "Collider") == Collider::Type::SOLID)
+		// Standing on the ground
+		if (contact.y < 0)
 		{
 			if (currentAnimation != &moving && currentAnimation != &attack && !heDed) currentAnimation = &idle;
 			jumps = 2;
@@ -387,7 +383,7 @@ bool Player::Update(float dt)
 
 
 
-			if (app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64 + 1, "Collider") == Collider::Type::BOX || app->map->GetTileProperty(entityRect.x / 64 + 1, entityRect.y / 64 + 1, "Collider") == Collider::Type::BOX)
+			if (app->map->GetColliderType(entityRect.x / 64, entityRect.y / 64 + 1) == Collider::Type::BOX || app->map->GetColliderType(entityRect.x / 64 + 1, entityRect.y / 64 + 1) == Collider::Type::BOX)
 			{
 
 				if (currentAnimation != &moving && currentAnimation != &attack && !heDed) currentAnimation = &idle;
@@ -411,12 +407,13 @@ bool Player::Update(float dt)
 
 		if (currentAnimation != &attack)
 		{
-			collider->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
+			Collider* body = app->collisions->GetCollider(collider);
+			if (body != nullptr) body->SetPos(entityRect.x, entityRect.y, currentAnimation->GetCurrentFrame().w, currentAnimation->GetCurrentFrame().h);
 		}
 
 
 		// Dead
-		if ((app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64 + 1, "Collider") == Collider::Type::PAIN || app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64, "Collider") == Collider::Type::PAIN || app->map->GetTileProperty(entityRect.x / 64 + 1, entityRect.y / 64, "Collider") == Collider::Type::PAIN || app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64, "Collider") == Collider::Type::PAIN) && !godLike)
+		if ((app->map->GetColliderType(entityRect.x / 64, entityRect.y / 64 + 1) == Collider::Type::PAIN || app->map->GetColliderType(entityRect.x / 64, entityRect.y / 64) == Collider::Type::PAIN || app->map->GetColliderType(entityRect.x / 64 + 1, entityRect.y / 64) == Collider::Type::PAIN || app->map->GetColliderType(entityRect.x / 64, entityRect.y / 64) == Collider::Type::PAIN) && !godLike)
 		{
 			currentAnimation = &ded;
 			heDed = true;
@@ -426,7 +423,7 @@ bool Player::Update(float dt)
 		//Checkpoint 
 
 
-		if ((app->map->GetTileProperty(entityRect.x / 64, entityRect.y / 64, "Collider") == Collider::Type::CHECKPOINT))
+		if ((app->map->GetColliderType(entityRect.x / 64, entityRect.y / 64) == Collider::Type::CHECKPOINT))
 		{
 			app->audio->PlayFx(app->entityManager->flagSFX, 0);
 			checkpointX = nextFrame.x;
@@ -94,7 +94,7 @@ private:
 	bool godLike;  //God Mode Debug Option
 
 
-	Collider* hurtBox = nullptr;
+	ColliderHandle hurtBox;
 
 
 	bool positiveSpeedX = true;
@@ -48,8 +48,8 @@ public:
 
 		if(format != NULL)
 		{
-			static char tmp[TMP_STRING_SIZE];
-			static va_list  ap;
+			static thread_local char tmp[TMP_STRING_SIZE];
+			va_list  ap;
 
 			// Construct the string from variable arguments
 			va_start(ap, format);
@@ -83,8 +83,8 @@ public:
 
 		if(format != NULL)
 		{
-			static char tmp[TMP_STRING_SIZE];
-			static va_list  ap;
+			static thread_local char tmp[TMP_STRING_SIZE];
+			va_list  ap;
 
 			// Construct the string from variable arguments
 			va_start(ap, format);
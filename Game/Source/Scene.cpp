@@ -6,7 +6,6 @@
 #include "Window.h"
 #include "Scene.h"
 #include "Map.h"
-#include "PathFinding.h"
 #include "Transition.h"
 #include "Animation.h"
 #include "ModuleFonts.h"
@@ -41,13 +40,46 @@ bool Scene::Start()
 	app->collisions->Enable();
 	app->entityManager->Enable();
 
+	app->audio->PlayMusic("Assets/Audio/Music/child's_nightmare.ogg");
+
+	// The level is spawned once the map finishes loading behind the transition
+	levelReady = false;
+	app->map->Enable();
+	app->map->LoadAsync("level_1.tmx");
+
+	deathScreenTexture = app->tex->Load("Assets/death_screen.png");
+	menuBackgroundTexture = app->tex->Load("Assets/menu_background2.png");
+
+	respawn = true;
+	menuOn = false;
+	settingsOn = false;
+
+	btnResume = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 10, "Resume", { 550, 175, 189, 44 }, this);
+	btnSettings = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 3, "Settings", { 550, 275, 189, 44 }, this);
+	btnBack2Title = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 11, "TitleScreen", { 550, 375, 189, 44 }, this);
+	btnQuit = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 5, "Quit", { 550, 475, 189, 44 }, this);
+	btnBack = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 12, "Back", { 550, 475, 189, 44 }, this);
+
+	cbFullscreen = (GuiCheckBox*)app->guiManager->CreateGuiControl(GuiControlType::CHECKBOX, 8, "Fullscreen", { 510, 350, 40, 40 }, this);
+	cbVSync = (GuiCheckBox*)app->guiManager->CreateGuiControl(GuiControlType::CHECKBOX, 9, "VSync", { 900, 350, 40, 40 }, this);
+
+	seconds = 0;
+	minutes = 0;
+	coins = 0;
+	score = 0;
+
+	return true;
+}
+
+// Creates the entities of the level, called once the map is loaded
+void Scene::SpawnLevel()
+{
+	levelReady = true;
+
 	player = (Player*)app->entityManager->CreateEntity(1600, 5120, EntityType::PLAYER);
 
-	app->audio->PlayMusic("Assets/Audio/Music/child's_nightmare.ogg");
 	app->render->camera.x = -(player->playerSpawnpointX - player->entityRect.x /*+ 1600*/);
 	app->render->camera.y = -(player->playerSpawnpointY - player->entityRect.y /*+ 5120*/);
-	
-	app->map->Load("level_1.tmx");
 
 	fly = app->entityManager->CreateEntity(app->map->data.tileWidth * 90, app->map->data.tileHeight * 24, EntityType::ENEMY, player, EnemyType::FLYING);
 	slime = app->entityManager->CreateEntity(app->map->data.tileWidth * 44, app->map->data.tileHeight * 87, EntityType::ENEMY, player, EnemyType::GROUND);
@@ -66,34 +98,6 @@ bool Scene::Start()
 	app->entityManager->CreateEntity(app->map->data.tileWidth * 63, app->map->data.tileHeight * 48, EntityType::COIN);
 	app->entityManager->CreateEntity(app->map->data.tileWidth * 64, app->map->data.tileHeight * 28, EntityType::COIN);
 
-
-	app->map->Enable();
-	if (app->map->Load("level_1.tmx") == true)
-	{
-		int w, h;
-		uchar* data = NULL;
-
-		if (app->map->CreateWalkabilityMap(&w, &h, &data))
-		{
-			app->pathfinding->SetMap(w, h, data);
-		}
-
-		RELEASE_ARRAY(data);
-	}
-
-	deathScreenTexture = app->tex->Load("Assets/death_screen.png");
-	menuBackgroundTexture = app->tex->Load("Assets/menu_background2.png");
-
-	respawn = true;
-	menuOn = false;
-	settingsOn = false;
-
-	btnResume = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 10, "Resume", { 550, 175, 189, 44 }, this);
-	btnSettings = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 3, "Settings", { 550, 275, 189, 44 }, this);
-	btnBack2Title = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 11, "TitleScreen", { 550, 375, 189, 44 }, this);
-	btnQuit = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 5, "Quit", { 550, 475, 189, 44 }, this);
-	btnBack = (GuiButton*)app->guiManager->CreateGuiControl(GuiControlType::BUTTON, 12, "Back", { 550, 475, 189, 44 }, this);
-
 	ListItem<Entity*>* e = app->entityManager->entities.start;
 	while (e != nullptr)
 	{
@@ -104,15 +108,6 @@ bool Scene::Start()
 		e = e->next;
 	}
 
-
-	cbFullscreen = (GuiCheckBox*)app->guiManager->CreateGuiControl(GuiControlType::CHECKBOX, 8, "Fullscreen", { 510, 350, 40, 40 }, this);
-	cbVSync = (GuiCheckBox*)app->guiManager->CreateGuiControl(GuiControlType::CHECKBOX, 9, "VSync", { 900, 350, 40, 40 }, this);
-
-	seconds = 0;
-	minutes = 0;
-	coins = 0;
-	score = 0;
-
 	if (app->titleScreen->continueOn)
 	{
 		app->titleScreen->continueOn = false;
@@ -120,13 +115,23 @@ bool Scene::Start()
 	}
 
 	cameraPos = { -app->render->camera.x, -app->render->camera.y };
-
-	return true;
 }
 
 // Called each loop iteration
 bool Scene::PreUpdate()
 {
+	if (levelReady == false)
+	{
+		// Nothing to play without the map, back to the title once the fade in is over
+		if (app->map->LoadFailed())
+		{
+			if (app->transition->TransitionStep(this, (Module*)app->titleScreen, false, 10.0f)) LOG("Level map could not be loaded, returning to the title screen");
+			return true;
+		}
+
+		if (app->map->IsLoaded() == false) return true;
+		SpawnLevel();
+	}
 
 	app->render->camera.x = -player->entityRect.x + 600;
 	app->render->camera.y = -player->entityRect.y + 300;
@@ -179,6 +184,7 @@ bool Scene::PreUpdate()
 // Called each loop iteration
 bool Scene::Update(float dt)
 {
+	if (levelReady == false) return true;
 
 
 	ListItem<Entity*>* e = app->entityManager->entities.start;
@@ -223,6 +229,7 @@ bool Scene::Update(float dt)
 bool Scene::PostUpdate()
 {
 	if (exit) { return false; }
+	if (levelReady == false) return true;
 
 	if (&coin->currentAnim != nullptr) { app->render->DrawTexture(app->entityManager->coinTexture, cameraPos.x + 1100, cameraPos.y + 10, &coin->currentAnim->GetCurrentFrame()); }
 	sprintf_s(coinText, 4, "%02d", coins);
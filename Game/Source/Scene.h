@@ -51,10 +51,14 @@ public:
 	iPoint cameraPos = { 0,0 };
 
 private:
+	// Creates the entities of the level, called once the map is loaded
+	void SpawnLevel();
+
 	SDL_Texture* deathScreenTexture;
 	SDL_Texture* menuBackgroundTexture;
 
 	bool respawn = true;
+	bool levelReady = false;
 
 	bool menuOn = false;
 	bool settingsOn = false;
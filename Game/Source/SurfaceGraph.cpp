@@ -0,0 +1,330 @@
+#include "SurfaceGraph.h"
+#include "PathSearch.h"
+
+#include "Defs.h"
+
+#include <math.h>
+#include <limits.h>
+#include <string.h>
+
+void SurfaceField::Reserve(int links)
+{
+	if (links <= capacity) return;
+
+	Release();
+	capacity = links;
+	cost = new int[capacity];
+	heap = new int[capacity];
+	heapIndex = new int[capacity];
+}
+
+void SurfaceField::Release()
+{
+	RELEASE_ARRAY(cost);
+	RELEASE_ARRAY(heap);
+	RELEASE_ARRAY(heapIndex);
+	capacity = 0;
+	valid = false;
+}
+
+SurfaceGraph::SurfaceGraph() : map(NULL), width(0), height(0), origin(0, 0), spanOfTile(NULL)
+{}
+
+SurfaceGraph::~SurfaceGraph()
+{
+	RELEASE_ARRAY(spanOfTile);
+}
+
+SurfaceGraph* SurfaceGraph::Create(const WalkabilityMap& map, const SurfaceMotion& motion)
+{
+	SurfaceGraph* graph = new SurfaceGraph();
+	graph->map = &map;
+	graph->width = map.width;
+	graph->height = map.height;
+	graph->origin = map.origin;
+
+	graph->BuildSpans();
+	graph->BuildLinks(motion);
+	graph->map = NULL;
+
+	return graph;
+}
+
+// Maximal runs of walkable tiles standing on a tile that is not
+void SurfaceGraph::BuildSpans()
+{
+	spanOfTile = new int[width * height];
+	for (uint i = 0; i < width * height; ++i) spanOfTile[i] = (map->IsWalkable(map->CellPosition(i))) ? -1 : -2;
+
+	for (int y = origin.y; y < origin.y + (int)height; ++y)
+	{
+		int left = INT_MAX;
+		for (int x = origin.x; x <= origin.x + (int)width; ++x)
+		{
+			bool ground = (x < origin.x + (int)width && map->IsWalkable(iPoint(x, y)) && map->IsWalkable(iPoint(x, y + 1)) == false);
+			if (ground && left == INT_MAX) left = x;
+			if (ground || left == INT_MAX) continue;
+
+			SurfaceSpan span;
+			span.y = y;
+			span.left = left;
+			span.right = x - 1;
+			span.firstLink = span.linkCount = 0;
+			span.firstIncoming = span.incomingCount = 0;
+
+			for (int i = left; i < x; ++i) spanOfTile[map->CellIndex(iPoint(i, y))] = spans.Count();
+			spans.PushBack(span);
+			left = INT_MAX;
+		}
+	}
+}
+
+// Falls off both ends of every span and jumps from every tile in both directions,
+// keeping the cheapest link from one span to another of each kind
+void SurfaceGraph::BuildLinks(const SurfaceMotion& motion)
+{
+	for (uint s = 0; s < spans.Count(); ++s)
+	{
+		SurfaceSpan& span = spans[s];
+		span.firstLink = links.Count();
+
+		iPoint landing;
+		for (int direction = -1; direction <= 1; direction += 2)
+		{
+			iPoint end((direction < 0) ? span.left : span.right, span.y);
+			iPoint edge(end.x + direction, end.y);
+			if (map->IsWalkable(edge))
+			{
+				int to = Simulate(motion, s, edge, direction, 0.0f, landing);
+				if (to != -1) AddLink(s, to, LINK_FALL, end, landing);
+			}
+
+			for (int x = span.left; x <= span.right; ++x)
+			{
+				iPoint takeoff(x, span.y);
+				int to = Simulate(motion, s, takeoff, direction, -motion.jumpSpeed, landing);
+				if (to != -1) AddLink(s, to, LINK_JUMP, takeoff, landing);
+			}
+		}
+
+		span.linkCount = links.Count() - span.firstLink;
+	}
+
+	// Links arriving at every span, for the search back from the goal
+	for (uint i = 0; i < links.Count(); ++i) ++spans[links[i].to].incomingCount;
+
+	int first = 0;
+	for (uint s = 0; s < spans.Count(); ++s)
+	{
+		spans[s].firstIncoming = first;
+		first += spans[s].incomingCount;
+		spans[s].incomingCount = 0;
+	}
+
+	incoming.Clear();
+	for (uint i = 0; i < links.Count(); ++i) incoming.PushBack(0);
+	for (uint i = 0; i < links.Count(); ++i)
+	{
+		SurfaceSpan& span = spans[links[i].to];
+		incoming[span.firstIncoming + span.incomingCount++] = i;
+	}
+}
+
+void SurfaceGraph::AddLink(int from, int to, SurfaceLinkType type, const iPoint& takeoff, const iPoint& landing)
+{
+	SurfaceLink link;
+	link.from = from;
+	link.to = to;
+	link.type = type;
+	link.takeoff = takeoff;
+	link.landing = landing;
+	link.cost = abs(landing.x - takeoff.x) + abs(landing.y - takeoff.y);
+
+	for (uint i = spans[from].firstLink; i < links.Count(); ++i)
+	{
+		SurfaceLink& other = links[i];
+		if (other.to != to || other.type != type) continue;
+
+		if (link.cost < other.cost) other = link;
+		return;
+	}
+	links.PushBack(link);
+}
+
+// Integrates the walker's centre the way Physics does, one frame at a time, from
+// the centre of start moving in direction. Returns the span it lands on, other than
+// the one it left, or -1 if it hits something first or stays too long in the air
+int SurfaceGraph::Simulate(const SurfaceMotion& motion, int span, const iPoint& start, int direction, float speedY, iPoint& landing) const
+{
+	const float dt = 1.0f / 60.0f;
+	const float size = (float)motion.tileSize;
+	const float speedX = (direction < 0) ? motion.speedLeft : motion.speedRight;
+
+	float x = (start.x + 0.5f) * size;
+	float y = (start.y + 0.5f) * size;
+	iPoint tile = start;
+
+	for (int frame = 0; frame < SURFACE_MAX_AIR_FRAMES; ++frame)
+	{
+		x += direction * speedX * dt;
+		y += speedY * dt + (motion.gravity * dt * dt * 0.5f);
+		speedY += motion.gravity * dt;
+
+		iPoint current((int)floorf(x / size), (int)floorf(y / size));
+		if (current == tile) continue;
+		tile = current;
+
+		if (map->IsWalkable(tile) == false) return -1;
+
+		int to = SpanAt(tile);
+		if (speedY > 0.0f && to >= 0 && to != span)
+		{
+			landing = tile;
+			return to;
+		}
+	}
+	return -1;
+}
+
+int SurfaceGraph::FindSpan(const iPoint& pos) const
+{
+	for (iPoint tile = pos; tile.y < origin.y + (int)height; ++tile.y)
+	{
+		int span = SpanAt(tile);
+		if (span != -1) return (span >= 0) ? span : -1;
+	}
+	return -1;
+}
+
+// Binary min heap over link ids ordered by field cost, same scheme as the A* open set
+static void FieldSiftUp(SurfaceField& field, int index)
+{
+	while (index > 0)
+	{
+		int parent = (index - 1) / 2;
+		if (field.cost[field.heap[parent]] <= field.cost[field.heap[index]]) break;
+
+		SWAP(field.heap[index], field.heap[parent]);
+		field.heapIndex[field.heap[index]] = index;
+		index = parent;
+	}
+	field.heapIndex[field.heap[index]] = index;
+}
+
+static void FieldSiftDown(SurfaceField& field, int index, int count)
+{
+	for (;;)
+	{
+		int smallest = index, left = 2 * index + 1, right = left + 1;
+		if (left < count && field.cost[field.heap[left]] < field.cost[field.heap[smallest]]) smallest = left;
+		if (right < count && field.cost[field.heap[right]] < field.cost[field.heap[smallest]]) smallest = right;
+		if (smallest == index) break;
+
+		SWAP(field.heap[index], field.heap[smallest]);
+		field.heapIndex[field.heap[index]] = index;
+		index = smallest;
+	}
+	field.heapIndex[field.heap[index]] = index;
+}
+
+// Cost of every link is the cheapest way to the goal once the walker takes it:
+// the link itself, walking along the span it lands on and the links after it
+bool SurfaceGraph::BuildField(const iPoint& goal, SurfaceField& field) const
+{
+	field.Reserve(MAX((int)links.Count(), 1));
+	field.root = goal;
+	field.valid = true;
+
+	for (uint i = 0; i < links.Count(); ++i)
+	{
+		field.cost[i] = -1;
+		field.heapIndex[i] = -1;
+	}
+
+	int goalSpan = FindSpan(goal);
+	if (goalSpan == -1) return false;
+
+	int count = 0;
+	const SurfaceSpan& target = spans[goalSpan];
+	for (int i = 0; i < target.incomingCount; ++i)
+	{
+		int link = incoming[target.firstIncoming + i];
+		field.cost[link] = links[link].cost + abs(links[link].landing.x - goal.x);
+		field.heap[count] = link;
+		FieldSiftUp(field, count++);
+	}
+
+	while (count > 0)
+	{
+		int current = field.heap[0];
+		field.heapIndex[current] = -2;
+		if (--count > 0)
+		{
+			field.heap[0] = field.heap[count];
+			FieldSiftDown(field, 0, count);
+		}
+
+		// Links landing on the span this one leaves from can walk to its takeoff
+		const SurfaceLink& link = links[current];
+		const SurfaceSpan& span = spans[link.from];
+		for (int i = 0; i < span.incomingCount; ++i)
+		{
+			int before = incoming[span.firstIncoming + i];
+			if (field.heapIndex[before] == -2) continue;
+
+			int cost = links[before].cost + abs(links[before].landing.x - link.takeoff.x) + field.cost[current];
+			if (field.cost[before] != -1 && field.cost[before] <= cost) continue;
+
+			field.cost[before] = cost;
+			if (field.heapIndex[before] == -1)
+			{
+				field.heap[count] = before;
+				field.heapIndex[before] = count++;
+			}
+			FieldSiftUp(field, field.heapIndex[before]);
+		}
+	}
+	return true;
+}
+
+bool SurfaceGraph::GetStep(const iPoint& pos, const SurfaceField& field, iPoint& next, bool& jump) const
+{
+	jump = false;
+
+	int from = FindSpan(pos);
+	int goalSpan = FindSpan(field.root);
+	if (from == -1 || goalSpan == -1) return false;
+
+	const SurfaceSpan& span = spans[from];
+	int best = (from == goalSpan) ? abs(pos.x - field.root.x) : INT_MAX;
+	int bestLink = -1;
+
+	for (int i = span.firstLink; i < span.firstLink + span.linkCount; ++i)
+	{
+		if (field.cost[i] < 0) continue;
+
+		int cost = abs(pos.x - links[i].takeoff.x) + field.cost[i];
+		if (cost < best)
+		{
+			best = cost;
+			bestLink = i;
+		}
+	}
+
+	if (best == INT_MAX) return false;
+
+	int targetX = (bestLink == -1) ? field.root.x : links[bestLink].takeoff.x;
+	if (pos.x != targetX)
+	{
+		next = iPoint(pos.x + ((targetX > pos.x) ? 1 : -1), span.y);
+		return true;
+	}
+
+	// Arrived: on the goal's span nothing is left to do, at a takeoff the link is taken
+	if (bestLink == -1) return false;
+
+	const SurfaceLink& link = links[bestLink];
+	next = link.landing;
+	jump = (link.type == LINK_JUMP);
+	return true;
+}
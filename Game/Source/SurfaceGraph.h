@@ -0,0 +1,124 @@
+#ifndef __SURFACEGRAPH_H__
+#define __SURFACEGRAPH_H__
+
+#include <assert.h>
+
+#include "Point.h"
+#include "DynArray.h"
+
+// Jumps and falls longer than this (frames at 60 fps) are not followed
+#define SURFACE_MAX_AIR_FRAMES 180
+
+struct WalkabilityMap;
+
+// How a ground walker moves, in pixels and seconds
+struct SurfaceMotion
+{
+	float gravity;
+	float jumpSpeed;	// upward speed given by a jump
+	float speedLeft;	// horizontal speeds, kept while in the air
+	float speedRight;
+	int tileSize;
+
+	bool operator ==(const SurfaceMotion& other) const
+	{
+		return gravity == other.gravity && jumpSpeed == other.jumpSpeed && speedLeft == other.speedLeft && speedRight == other.speedRight && tileSize == other.tileSize;
+	}
+};
+
+// Row of tiles with ground below, a walker moves freely along it
+struct SurfaceSpan
+{
+	int y;
+	int left;
+	int right;
+	int firstLink;
+	int linkCount;
+	int firstIncoming;
+	int incomingCount;
+};
+
+enum SurfaceLinkType
+{
+	LINK_FALL,	// walking off the end of the span
+	LINK_JUMP
+};
+
+struct SurfaceLink
+{
+	int from;
+	int to;
+	SurfaceLinkType type;
+	iPoint takeoff;		// tile of the "from" span where the walker leaves it
+	iPoint landing;		// tile of the "to" span where it lands
+	int cost;
+};
+
+// Costs to the goal after taking every link, rebuilt when the goal moves
+struct SurfaceField
+{
+	SurfaceField() : root(0, 0), valid(false), cost(NULL), heap(NULL), heapIndex(NULL), capacity(0) {}
+	~SurfaceField() { Release(); }
+
+	void Reserve(int links);
+	void Release();
+
+	iPoint root;
+	bool valid;
+	int* cost;
+	int* heap;
+	int* heapIndex;
+	int capacity;
+};
+
+// ---------------------------------------------------------------------
+// Navigation graph of a platformer walker: the spans it can stand on,
+// joined by the falls and jumps its motion can actually make. Built by
+// simulating the same integration Physics uses from every span tile
+// ---------------------------------------------------------------------
+class SurfaceGraph
+{
+public:
+	SurfaceGraph();
+	~SurfaceGraph();
+
+	static SurfaceGraph* Create(const WalkabilityMap& map, const SurfaceMotion& motion);
+
+	// Span a walker at pos stands on, or would land on falling straight down, -1 if none
+	int FindSpan(const iPoint& pos) const;
+
+	// Dijkstra back from goal over the links, false if the goal is over no span
+	bool BuildField(const iPoint& goal, SurfaceField& field) const;
+
+	// Next tile to head for from pos. jump is set when the walker has to jump to reach it
+	bool GetStep(const iPoint& pos, const SurfaceField& field, iPoint& next, bool& jump) const;
+
+	inline int GetSpanCount() const { return spans.Count(); }
+	inline int GetLinkCount() const { return links.Count(); }
+
+private:
+	void BuildSpans();
+	void BuildLinks(const SurfaceMotion& motion);
+	void AddLink(int from, int to, SurfaceLinkType type, const iPoint& takeoff, const iPoint& landing);
+	int Simulate(const SurfaceMotion& motion, int span, const iPoint& start, int direction, float speedY, iPoint& landing) const;
+
+	inline int SpanAt(const iPoint& pos) const
+	{
+		int x = pos.x - origin.x, y = pos.y - origin.y;
+		// Outside the map counts as air
+		return (x >= 0 && y >= 0 && x < (int)width && y < (int)height) ? spanOfTile[y * width + x] : -1;
+	}
+
+private:
+	const WalkabilityMap* map;	// only valid while building
+	uint width;
+	uint height;
+	iPoint origin;
+
+	DynArray<SurfaceSpan> spans;
+	DynArray<SurfaceLink> links;	// grouped by "from"
+	DynArray<int> incoming;			// link ids grouped by "to"
+	int* spanOfTile;				// span of every tile, -1 in the air and -2 on solid ones
+};
+
+#endif // __SURFACEGRAPH_H__
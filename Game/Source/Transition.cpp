@@ -3,6 +3,7 @@
 #include "App.h"
 #include "Window.h"
 #include "Render.h"
+#include "Map.h"
 
 #include "SDL/include/SDL_render.h"
 
@@ -30,6 +31,16 @@ bool Transition::Update(float dt)
 		{
 			moduleToDisable->Disable();
 			moduleToEnable->Enable();
+			currentStep = Transition_Step::LOADING;
+		}
+	}
+	else if (currentStep == Transition_Step::LOADING)
+	{
+		// The map finishes loading in its own Update, keep fading frames coming meanwhile
+		loadProgress = app->map->GetLoadProgress();
+		if (app->map->IsLoading() == false)
+		{
+			loadProgress = 1.0f;
 			currentStep = Transition_Step::FROM_BLACK;
 		}
 	}
@@ -55,6 +66,16 @@ bool Transition::PostUpdate()
 	SDL_SetRenderDrawColor(app->render->renderer, 0, 0, 0, (Uint8)(fadeRatio * 255.0f));
 	SDL_RenderFillRect(app->render->renderer, &screenRect);
 
+	if (currentStep == Transition_Step::LOADING)
+	{
+		SDL_Rect bar = { screenRect.w / 4, screenRect.h - 80, screenRect.w / 2, 12 };
+		SDL_SetRenderDrawColor(app->render->renderer, 255, 255, 255, 255);
+		SDL_RenderDrawRect(app->render->renderer, &bar);
+
+		bar.w = (int)(bar.w * loadProgress);
+		SDL_RenderFillRect(app->render->renderer, &bar);
+	}
+
 	return true;
 }
 
@@ -25,12 +25,16 @@ public:
 	// After the first step, the modules should be switched
 	bool TransitionStep(Module* toDisable, Module* toEnable, bool onlyFadeIn = false, float frames = 60);
 
+	// Progress from 0 to 1 of the level loading behind the black screen
+	float GetLoadProgress() const { return loadProgress; }
+
 private:
 
 	enum Transition_Step
 	{
 		NONE,
 		TO_BLACK,
+		LOADING,
 		FROM_BLACK
 	} currentStep = Transition_Step::NONE;
 
@@ -41,6 +45,9 @@ private:
 	// The rectangle of the screen, used to render the black rectangle
 	SDL_Rect screenRect;
 
+	// The screen stays black while the enabled module loads its level
+	float loadProgress = 1.0f;
+
 	// The modules that should be switched after the first step
 	Module* moduleToEnable = nullptr;
 	Module* moduleToDisable = nullptr;